@@ -1,9 +1,14 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <array>
+#include <map>
+#include <unordered_map>
+#include <memory>
 #include <functional>
 #include <cstdint>
 #include <boost/multiprecision/cpp_dec_float.hpp>
+#include "simBrokerCowVector.hpp"
 
 using namespace boost::multiprecision;
 typedef cpp_dec_float_100 currency;
@@ -15,6 +20,12 @@ typedef cpp_dec_float_100 currency;
 // If your data comes from an external resource such as an API,
 // it is recommended to build an on-disk cache mechanism as we pull
 // a lot of data.
+//
+// Thread safety: a single SimBroker only calls its data source from whichever thread is calling
+// into the SimBroker. If you share one data source between SimBrokers on different threads
+// (SimBrokerSweep does), every method must be safe to call concurrently - including the const-looking
+// ones. Watch out for things like std::map::operator[], which inserts on a miss.
+// SimBrokerMemoryDataSource (simBrokerMemoryDataSource.hpp) is safe to share once frozen.
 class SimBrokerStockDataSource {
   public:
     struct Bar {
@@ -65,8 +76,26 @@ class SimBrokerStockDataSource {
     virtual bool isTickerMarginable(std::string ticker, uint64_t time) = 0; // Throw exception if data not available
     virtual bool isTickerETB(std::string ticker, uint64_t time) = 0;
     virtual bool isTickerShortable(std::string ticker, uint64_t time) = 0;
+
+    // Batched lookups of one ticker at many points in time. SimBroker uses these to charge
+    // many nights of borrow fees in one go after a large updateClock.
+    //
+    // The defaults just call getPrice/getAssetBorrowRate for each time - override them if
+    // your data source can answer them in a single query.
+    virtual std::vector<currency> getPriceSeries(std::string ticker, std::vector<uint64_t> times);
+    virtual std::vector<cpp_dec_float_100> getAssetBorrowRateSeries(std::string ticker, std::vector<uint64_t> times);
+
+    // Batched lookups of many tickers at one point in time, used for the nightly borrow fees
+    // on all of our shorts. Defaults call getPrice/getAssetBorrowRate per ticker.
+    virtual std::vector<currency> getPrices(std::vector<std::string> tickers, uint64_t time);
+    virtual std::vector<cpp_dec_float_100> getAssetBorrowRates(std::vector<std::string> tickers, uint64_t time);
 };
 
+class SimBrokerAsyncStockDataSource;
+class SimBrokerDataCache;
+class SimBrokerScheduler;
+class SimBrokerTracer;
+
 class SimBroker {
   public:
     enum OrderType {
@@ -107,6 +136,18 @@ class SimBroker {
 			int64_t lastChangeTime = 0;
     };
 
+    // What was charged at a market close: margin interest plus the borrow fee of each short
+    // position, one entry per short in each array
+    struct NightlyAccrual {
+      uint64_t time = 0;
+      currency interest = 0;
+      std::vector<std::string> symbols;
+      std::vector<uint64_t> qtys; // Quantity billed (rounded up to round lots if enabled)
+      std::vector<currency> prices;
+      std::vector<cpp_dec_float_100> rates;
+      std::vector<currency> fees;
+    };
+
     struct OrderPlan {
       std::string symbol = "SPY";
       int64_t qty = 0; // Use a negative value to sell
@@ -148,6 +189,27 @@ class SimBroker {
     };
 
     SimBroker(SimBrokerStockDataSource* dataSource, uint64_t startTime, bool margin);
+
+    // Returns an independent copy of this broker for "what if" branching. The fork shares its
+    // order, position and calendar storage with us until either side changes it, so forking is
+    // cheap no matter how long the history is, and a branch only pays for what it modifies. The
+    // last nightly accrual, margin screen and profile are shared the same way.
+    //
+    // Handlers are copied as-is; replace them on the fork if they capture the original broker.
+    // Automatic checkpoints are not: the fork starts with them disabled, so it can't overwrite
+    // ours. Call setAutoCheckpoint on it with its own path if it needs them.
+    //
+    // Threads: separate forks may be updated on different threads at once (SimBrokerSweep does),
+    // as long as their data source allows it and they don't share a fill scheduler. A broker must
+    // not be forked, or read, while another thread is updating it.
+    SimBroker fork();
+
+    // Puts the broker back in the state SimBroker(dataSource, startTime, margin) would be in,
+    // keeping the same data source. Order and position storage (including each order's history)
+    // and the trading day index are kept for reuse, so a broker that is reset between runs of
+    // similar backtests stops allocating once it has warmed up.
+    void reset(uint64_t startTime, bool margin);
+
     void updateClock(uint64_t time);
     // TODO: wouldn't it make more sense to return Order? It still contains the id.
     uint64_t placeOrder(OrderPlan p);
@@ -184,6 +246,9 @@ class SimBroker {
     void setInterestRate(cpp_dec_float_100 rate);
     cpp_dec_float_100 getInterestRate();
 
+    // Breakdown of the most recent night of interest and borrow fees
+    NightlyAccrual getLastNightlyAccrual();
+
     // Note: this requires us to obtain the value of all of our positions via the data source
     // for every updateClock() call while we have any kind of loan.
     //
@@ -200,6 +265,13 @@ class SimBroker {
     // Will obtain the value of all of our positions via the stock data source, so be aware of any 
     // API time costs.
     //
+    // After a full check we remember how far each position's price can move before we could
+    // possibly breach maintenance. Until the balance or positions change, later checks skip the
+    // full repricing while all prices stay inside those bounds: they look every position's price
+    // up in one batched getPrices call (so a data source that answers batches in one query pays
+    // for one lookup per check), and don't look anything up again at a clock they've already
+    // checked. Without a loan (no shorts and a positive balance) checks are free.
+    //
     // Using this function instead of the setMarginCallHandler callback can allow you better control
     // over the resource costs of your data source.
     bool checkForMarginCall();
@@ -213,17 +285,153 @@ class SimBroker {
     void enableInstaFill();
     void disableInstaFill();
     bool instaFillEnabled();
+
+    // Simulates fills for different symbols in parallel on the scheduler's threads, then applies
+    // them to the balance and positions in order id order, so results are identical to the serial
+    // path. Worth it with open orders in many symbols; NULL (the default) processes serially.
+    //
+    // The data source must be safe to call concurrently. The scheduler is not owned and is
+    // shared with forks - don't update brokers sharing one from different threads at once.
+    // Brokers in a SimBrokerGroup, or on an async data source, always process serially (their
+    // data is already local by then).
+    void setFillScheduler(SimBrokerScheduler* scheduler);
+
+    // Records spans of updateClock, updateState, each order's fill, interest and margin/PDT checks
+    // into the tracer (see simBrokerTracer.hpp), tagged with the simulated time, symbol and order
+    // id. Not owned, shared with forks, kept by restore(). NULL (the default) turns tracing off.
+    void setTracer(SimBrokerTracer* tracer);
+
+    // Checkpoints
+    //
+    // A checkpoint is a compact binary snapshot of everything needed to continue a backtest
+    // exactly where it left off: clock, balance, settings, orders, positions, day trades, PDT flag
+    // and interest timestamp. Amounts are stored exactly, so a restored broker behaves identically
+    // to the original from then on.
+    //
+    // The data source and the margin call/PDT handlers are not part of a checkpoint - restoring
+    // keeps whatever the broker being restored into has.
+    //
+    // Invalid or truncated checkpoints throw std::runtime_error.
+    std::string checkpoint();
+    void restore(const std::string& checkpoint);
+    void saveCheckpoint(std::string path); // Written to path.tmp first, then renamed over path
+    void loadCheckpoint(std::string path);
+
+    // Saves a checkpoint to path from updateClock whenever the clock has moved at least the given
+    // number of simulated days past the last one (including at market closes in the middle of a
+    // long updateClock). 0 days disables. Forks don't inherit this.
+    void setAutoCheckpoint(std::string path, uint32_t days);
+
+    // Statistics
+    //
+    // Cumulative counters and timers showing where updates spend their time, to find what's hot
+    // in a slow backtest without a profiler. Off by default; while off nothing is timed or counted
+    // beyond a thread local increment per bar. Times are wall time in nanoseconds. With a fill
+    // scheduler (see setFillScheduler) the parallel part of an update all counts as fill time.
+    //
+    // Kept across restore(), cleared by reset().
+    struct Stats {
+      uint64_t updates = 0;             // updateState calls
+      uint64_t ordersScanned = 0;       // Orders looked at by updates
+      uint64_t ordersUpdated = 0;       // ...that were live or waiting to expire. The rest stay shared with forks.
+      uint64_t barsVisited = 0;         // Bars walked by fill simulation
+      uint64_t gapFillPrices = 0;       // getPrice calls made to fill gaps in bar data
+      uint64_t marginChecks = 0;
+      uint64_t marginScreenHits = 0;    // ...settled by the price bands, without repricing every position
+      uint64_t tradingDayLookups = 0;
+      uint64_t tradingDayCacheHits = 0; // ...answered without searching the calendar index
+      uint64_t bulkAccruedNights = 0;   // Nights charged without a full update in between (see updateClock)
+      uint64_t tifNs = 0;               // updateOrderTIF
+      uint64_t fillNs = 0;              // updateOrderFillState
+      uint64_t marginCheckNs = 0;
+      uint64_t pdtCheckNs = 0;
+    };
+    void enableStats();
+    void disableStats();
+    bool statsEnabled();
+    Stats getStats();
+    void resetStats();
+
+    // Profiling
+    //
+    // Attributes the cost of every updateClock to the simulated trading day it was spent on, and
+    // the cost of each order's fill updates to the order and its symbol - to find the days, orders
+    // and symbols that make a backtest slow (a data gap that makes fills rescan, a GTC order that
+    // never fills), which a wall clock profiler can't tell apart. Cost is wall time plus data
+    // source calls, counted by routing the data source through a counter during updateClock
+    // (prefetches by an async data source aren't counted).
+    //
+    // Off by default; while off it costs nothing. Kept across restore(), cleared by reset().
+    // Doesn't change results or checkpoints.
+    struct ProfileCost {
+      uint64_t ns = 0;
+      uint64_t dataSourceCalls = 0;
+      uint64_t samples = 0; // Updates on the day, or fill updates of the order/symbol's orders
+    };
+    struct DayProfile {
+      uint64_t dayStart; // The trading day's PREMARKET phase change (0 before the calendar starts)
+      ProfileCost cost;
+    };
+    struct SymbolProfile {
+      std::string symbol;
+      ProfileCost cost;
+    };
+    struct OrderProfile {
+      uint64_t orderId;
+      std::string symbol;
+      ProfileCost cost;
+    };
+    enum ProfileOrder { BY_TIME, BY_DATA_SOURCE_CALLS };
+
+    void enableProfiling();
+    void disableProfiling();
+    bool profilingEnabled();
+    void resetProfile();
+    // The n most expensive of each, most expensive first
+    std::vector<DayProfile> hottestDays(size_t n, ProfileOrder by = BY_TIME);
+    std::vector<SymbolProfile> hottestSymbols(size_t n, ProfileOrder by = BY_TIME);
+    std::vector<OrderProfile> hottestOrders(size_t n, ProfileOrder by = BY_TIME);
   private:
+    friend class SimBrokerGroup;
+    friend class SimBrokerPortfolio;
+
+    // Orders that can still change on the next updateState (they may fill or expire)
+    bool orderIsLive(const Order& o);
+    // Orders that updateState may touch at all (live, or waiting to expire)
+    bool orderNeedsUpdate(const Order& o);
     void cleanStuckOrders();
+
+    // With an async data source, fetches everything runUpdate is known to need concurrently first
     void updateState();
+    void runUpdate();
+    void prefetch(SimBrokerDataCache& cache);
+
+    // Earliest minute bar each symbol's live orders will look at (see updateOrderFillState),
+    // merged into starts
+    void neededBars(std::map<std::string, uint64_t>& starts);
     void chargeDayInterest();
+
+    // Charges interest and borrow fees for every market close in the list without updating
+    // state in between. Only valid while nothing can fill or expire (see canAccrueInBulk)
+    void accrueNights(std::vector<uint64_t> closes);
+    bool canAccrueInBulk();
     cpp_dec_float_100 estimateFillRate(SimBrokerStockDataSource::Bar b);
 
     void eachBarChunk(std::string ticker, 
                       uint64_t startTime,
                       std::function<bool(std::vector<SimBrokerStockDataSource::Bar> bars, uint64_t chunkStart, uint64_t chunkEnd)> func);
     void eachBar(std::string ticker, uint64_t startTime, std::function<bool(SimBrokerStockDataSource::Bar b)> func);
+    // Checks the plan is supported and builds an order for it at the clock (not placed yet)
+    Order newOrder(const OrderPlan& p);
     void updateOrderFillState(Order& o);
+    // Updates the position and balance for the part of the order filled since startQty
+    void applyFill(const Order& o, int64_t startQty);
+    // TIF and fill updates for the orders at these indices, simulated per symbol on the fill scheduler
+    void updateOrdersParallel(const std::vector<size_t>& due);
+
+    // Recomputes the order's filledQty/filledAvgPrice/filledAt/doneFilling from its status
+    // history, up to the clock. Doesn't touch positions or the balance.
+    void simulateFill(Order& o);
     void updateOrderTIF(Order& o);
 
     // Updates order history as well as sets the status on the order (DO NOT SET ORDER STATUS DIRECTLY)
@@ -234,14 +442,37 @@ class SimBroker {
     // Will remove position if it ends up at a qty of zero
     void addToPosition(std::string symbol, int64_t qty, currency avgPrice);
 
+    // Trading day number of a point in time: the number of PREMARKET phase changes at or before it
+    // (offset by an arbitrary constant, so only compare these to each other).
+    // Built lazily from the data source's calendar and cached in tradingDayStarts.
+    int64_t tradingDay(uint64_t time);
+    std::shared_ptr<const std::vector<uint64_t>> extendTradingDays(uint64_t time);
+    void recordDayTrade(int64_t day);
+
+    // Reprices everything to check for a margin call, and recomputes marginBands
+    bool fullMarginCheck();
+
+    bool autoCheckpointDue(uint64_t time);
+
+    // Charges the time and data source calls since the last charge to time's trading day.
+    // update: this was an updateState (counted as a sample)
+    void profileCharge(uint64_t time, bool update);
+    // PREMARKET phase change starting time's trading day (0 before the calendar starts)
+    uint64_t profileDayStart(uint64_t time);
+    // Charges one order's fill update
+    void profileOrder(const Order& o, const ProfileCost& cost);
+
     SimBrokerStockDataSource* stockDataSource;
+    SimBrokerAsyncStockDataSource* asyncSource = NULL; // stockDataSource, if it's async
     currency balance;
     uint64_t clock = 0;
-    std::vector<Order>    orders;
-    std::vector<Position> positions;
+    SimBrokerCowVector<Order>    orders;
+    SimBrokerCowVector<Position> positions;
     bool marginEnabled = false;
     bool shortRoundLotFee = true;
     bool instaFill = false;
+    SimBrokerScheduler* fillScheduler = NULL;
+    SimBrokerTracer* tracer = NULL;
     cpp_dec_float_100 initialMarginRequirement = 0.5;
     cpp_dec_float_100 maintenanceMarginRequirement = 0.35;
     bool marginCallHandlerDefined = false;
@@ -250,6 +481,63 @@ class SimBroker {
     cpp_dec_float_100 interestRate = 0.0375;
     std::function<void()> marginCallHandler;
     std::function<void()> PDTCallHandler;
-		std::vector<int64_t> roundTrips;
+    SimBrokerCow<NightlyAccrual> lastAccrual;
 		bool isPDT = false;
+
+    // Sorted PREMARKET phase change times, (*tradingDayStarts)[i] starts trading day firstTradingDay+i
+    // Never modified in place (we swap in an extended copy) so forks can share it.
+    std::shared_ptr<const std::vector<uint64_t>> tradingDayStarts = std::make_shared<std::vector<uint64_t>>();
+    int64_t firstTradingDay = 0;
+    bool tradingDayHistoryExhausted = false;
+
+    // Last tradingDay() answer, valid for times in [cachedDayFrom, cachedDayTo)
+    int64_t cachedDay = 0;
+    uint64_t cachedDayFrom = 1;
+    uint64_t cachedDayTo = 0;
+
+    // Round trips per trading day, in a ring keyed by day number. Only the last 5 days matter for PDT.
+    struct DayTradeCount {
+      int64_t day;
+      uint32_t count;
+    };
+    std::array<DayTradeCount, 8> dayTrades = {};
+
+    // Bumped whenever the balance or positions change
+    uint64_t accountVersion = 0;
+
+    // Price bounds per position within which we can't be margin called, valid while
+    // marginScreenVersion == accountVersion. One entry per position in each array.
+    struct MarginBands {
+      std::vector<std::string> symbols; // Passed to getPrices as they are
+      std::vector<double> low;
+      std::vector<double> high;
+    };
+    SimBrokerCow<MarginBands> marginBands;
+    bool marginScreenValid = false;
+    uint64_t marginScreenVersion = 0;
+    uint64_t marginScreenTime = 0; // Clock at which every price was last known to be inside its band
+
+    std::string autoCheckpointPath;
+    uint32_t autoCheckpointDays = 0;
+    uint64_t lastCheckpointTime = 0;
+
+    bool statsOn = false;
+    Stats stats;
+
+    bool profilingOn = false;
+    struct ProfileTotals {
+      std::unordered_map<uint64_t, ProfileCost> days; // By dayStart
+      std::unordered_map<std::string, ProfileCost> symbols;
+      std::unordered_map<uint64_t, OrderProfile> orders;
+    };
+    struct Profile {
+      SimBrokerCow<ProfileTotals> totals;
+      int depth = 0;              // updateClock nesting
+      uint64_t chargedNs = 0;     // Steady clock at the last profileCharge
+      uint64_t chargedCalls = 0;  // Data source calls at the last profileCharge
+      uint64_t otherThreadCalls = 0; // Made by parallel fills on other threads since then
+      uint64_t dayFrom = 1;       // Last profileDayStart answer, valid for times in [dayFrom, dayTo)
+      uint64_t dayTo = 0;
+    };
+    Profile profile;
 };
@@ -0,0 +1,175 @@
+#pragma once
+#include "simBroker.hpp"
+#include <coroutine>
+#include <optional>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <utility>
+
+// The result of an asynchronous data source request, to be completed later (possibly on another
+// thread) by whoever is serving it.
+//
+// Copies share the same result. Either co_await it from a coroutine - which is resumed on the
+// thread that completes the request - or block on get().
+template <typename T>
+class SimBrokerRequest {
+  public:
+    SimBrokerRequest() : state(std::make_shared<State>()) {};
+
+    // Serving side. Complete each request exactly once.
+    void complete(T value) {
+      std::coroutine_handle<> waiter;
+      {
+        std::lock_guard<std::mutex> lock(this->state->lock);
+        this->state->value = std::move(value);
+        this->state->done = true;
+        waiter = std::exchange(this->state->waiter, nullptr);
+      }
+      this->state->cv.notify_all();
+      if (waiter) waiter.resume();
+    }
+
+    void fail(std::exception_ptr error) {
+      std::coroutine_handle<> waiter;
+      {
+        std::lock_guard<std::mutex> lock(this->state->lock);
+        this->state->error = error;
+        this->state->done = true;
+        waiter = std::exchange(this->state->waiter, nullptr);
+      }
+      this->state->cv.notify_all();
+      if (waiter) waiter.resume();
+    }
+
+    bool ready() {
+      std::lock_guard<std::mutex> lock(this->state->lock);
+      return this->state->done;
+    }
+
+    // Blocks until the request completes. Rethrows the request's exception, if it failed.
+    T get() {
+      std::unique_lock<std::mutex> lock(this->state->lock);
+      this->state->cv.wait(lock, [this] { return this->state->done; });
+      if (this->state->error) std::rethrow_exception(this->state->error);
+      return *this->state->value;
+    }
+
+    // Awaitable. Only one coroutine may wait on a request at a time.
+    bool await_ready() { return this->ready(); }
+    bool await_suspend(std::coroutine_handle<> h) {
+      std::lock_guard<std::mutex> lock(this->state->lock);
+      if (this->state->done) return false;
+      this->state->waiter = h;
+      return true;
+    }
+    T await_resume() { return this->get(); }
+
+  private:
+    struct State {
+      std::mutex lock;
+      std::condition_variable cv;
+      bool done = false;
+      std::optional<T> value;
+      std::exception_ptr error;
+      std::coroutine_handle<> waiter;
+    };
+
+    std::shared_ptr<State> state;
+};
+
+// Return type for coroutines that co_await requests. Starts running straight away; wait() blocks
+// until the coroutine has finished and rethrows anything it threw.
+class SimBrokerTask {
+  public:
+    struct promise_type {
+      SimBrokerRequest<bool> done;
+      std::exception_ptr error;
+
+      SimBrokerTask get_return_object() { return SimBrokerTask(this->done); }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { this->error = std::current_exception(); }
+
+      // The frame is destroyed before anyone waiting is told we're done, so nothing of the
+      // coroutine outlives wait()
+      struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+          SimBrokerRequest<bool> done = h.promise().done;
+          std::exception_ptr error = h.promise().error;
+          h.destroy();
+          if (error) done.fail(error);
+          else done.complete(true);
+        }
+        void await_resume() noexcept {}
+      };
+      FinalAwaiter final_suspend() noexcept { return {}; }
+    };
+
+    void wait() { this->done.get(); }
+
+  private:
+    SimBrokerTask(SimBrokerRequest<bool> done) : done(done) {};
+    SimBrokerRequest<bool> done;
+};
+
+// A data source that can have many minute bar and price requests in flight at once, e.g. one
+// backed by a remote API where each request mostly waits on the network.
+//
+// Give one to SimBroker like any other data source. Each clock update it then requests the bars
+// and prices it knows it'll need all at once, and only carries on with its usual (synchronous)
+// update once they've all arrived - instead of paying the latency of each request in turn.
+// Anything it didn't ask for up front goes through the blocking interface, which by default
+// waits on the asynchronous one.
+//
+// Requests may be completed on any thread. Everything else follows SimBrokerStockDataSource's
+// thread safety rules.
+class SimBrokerAsyncStockDataSource : public SimBrokerStockDataSource {
+  public:
+    virtual SimBrokerRequest<std::vector<Bar>> requestMinuteBars(std::string ticker, uint64_t startTime, uint64_t endTime) = 0;
+    virtual SimBrokerRequest<currency> requestPrice(std::string ticker, uint64_t time) = 0;
+
+    virtual std::vector<Bar> getMinuteBars(std::string ticker, uint64_t startTime, uint64_t endTime) {
+      return this->requestMinuteBars(ticker, startTime, endTime).get();
+    }
+    virtual currency getPrice(std::string ticker, uint64_t time) {
+      return this->requestPrice(ticker, time).get();
+    }
+};
+
+// Serves asynchronous requests by calling a blocking data source from a pool of threads. The
+// blocking source must be safe to call concurrently (see SimBrokerStockDataSource).
+class SimBrokerThreadedAsyncDataSource : public SimBrokerAsyncStockDataSource {
+  public:
+    SimBrokerThreadedAsyncDataSource(SimBrokerStockDataSource* source, unsigned threads = 8);
+    ~SimBrokerThreadedAsyncDataSource();
+
+    SimBrokerRequest<std::vector<Bar>> requestMinuteBars(std::string ticker, uint64_t startTime, uint64_t endTime);
+    SimBrokerRequest<currency> requestPrice(std::string ticker, uint64_t time);
+
+    cpp_dec_float_100 getAssetBorrowRate(std::string ticker, uint64_t time);
+    MarketPhase getMarketPhase(uint64_t time);
+    MarketPhaseChange getNextMarketPhaseChange(uint64_t time);
+    MarketPhaseChange getPrevMarketPhaseChange(uint64_t time);
+    MarketPhaseChange getNextMarketPhaseChangeTo(uint64_t time, MarketPhase to);
+    MarketPhaseChange getPrevMarketPhaseChangeTo(uint64_t time, MarketPhase to);
+    MarketPhaseChange getNextMarketPhaseChangeFrom(uint64_t time, MarketPhase from);
+    MarketPhaseChange getPrevMarketPhaseChangeFrom(uint64_t time, MarketPhase from);
+    bool isTickerMarginable(std::string ticker, uint64_t time);
+    bool isTickerETB(std::string ticker, uint64_t time);
+    bool isTickerShortable(std::string ticker, uint64_t time);
+
+  private:
+    void submit(std::function<void()> job);
+    void worker();
+
+    SimBrokerStockDataSource* source;
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> jobs;
+    bool stopping = false;
+};
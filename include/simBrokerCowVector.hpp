@@ -0,0 +1,160 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+
+// Whether p is the only owner of its object, so it can be written in place.
+//
+// use_count() is only a relaxed load. A copy on another thread may have just let go of the object
+// (a release decrement); the acquire fence makes sure its last reads of the object happen before
+// our writes. Nothing can make a copy that is still being made or read on another thread safe to
+// write under - see SimBroker::fork() for the rules this relies on.
+template <typename T>
+bool simBrokerCowUnique(const std::shared_ptr<T>& p) {
+  if (p.use_count() != 1) return false;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return true;
+}
+
+// A vector whose copies share storage until one of them writes to it.
+//
+// Elements live in fixed size chunks, and the list of chunks is itself shared. Copying is O(1).
+// The first write after a copy duplicates the chunk list (one pointer per chunk) and the one
+// chunk written to; everything else stays shared. Reads never copy.
+//
+// Reads go through operator[]/iteration (const), writes through mut()/push_back()/erase()/clear().
+// References returned by mut() are invalidated by the next write.
+//
+// Chunks are never given back while we own them: clear() and erase() only move the end, so a
+// vector that is cleared and refilled (see SimBroker::reset) reuses its storage.
+template <typename T, size_t ChunkSize = 64>
+class SimBrokerCowVector {
+  public:
+    SimBrokerCowVector() : chunks(std::make_shared<ChunkList>()) {};
+
+    size_t size() const { return this->count; }
+    bool empty() const { return this->count == 0; }
+
+    const T& operator[](size_t i) const { return (*(*this->chunks)[i/ChunkSize])[i%ChunkSize]; }
+    const T& back() const { return (*this)[this->count-1]; }
+
+    T& mut(size_t i) {
+      return (*this->ownChunk(i/ChunkSize))[i%ChunkSize];
+    }
+
+    void push_back(const T& v) {
+      size_t c = this->count/ChunkSize;
+      if (c == this->chunks->size()) {
+        this->ownList();
+        auto chunk = std::make_shared<Chunk>();
+        chunk->reserve(ChunkSize);
+        this->chunks->push_back(chunk);
+      }
+
+      // Slots past the end may still hold old elements (see clear()); assigning over them
+      // reuses whatever they had allocated
+      Chunk* chunk = this->ownChunk(c);
+      size_t slot = this->count%ChunkSize;
+      if (slot < chunk->size()) (*chunk)[slot] = v;
+      else chunk->push_back(v);
+      this->count++;
+    }
+
+    void erase(size_t i) {
+      for (size_t j = i; j+1 < this->count; j++) this->mut(j) = (*this)[j+1];
+      this->count--;
+    }
+
+    // Empties the vector but keeps its chunks, and the elements in them, to be reused by later
+    // push_backs. Storage shared with copies is let go of instead.
+    void clear() {
+      if (!simBrokerCowUnique(this->chunks)) this->chunks = std::make_shared<ChunkList>();
+      this->count = 0;
+    }
+
+    std::vector<T> vector() const {
+      std::vector<T> r;
+      r.reserve(this->count);
+      for (size_t c = 0; c < this->chunks->size(); c++) {
+        auto& chunk = *(*this->chunks)[c];
+        r.insert(r.end(), chunk.begin(), chunk.begin()+this->live(c));
+      }
+      return r;
+    }
+
+    class const_iterator {
+      public:
+        const_iterator(const SimBrokerCowVector* v, size_t i) : v(v), i(i) {};
+        const T& operator*() const { return (*this->v)[this->i]; }
+        const T* operator->() const { return &(*this->v)[this->i]; }
+        const_iterator& operator++() { this->i++; return *this; }
+        bool operator==(const const_iterator& o) const { return this->i == o.i; }
+        bool operator!=(const const_iterator& o) const { return this->i != o.i; }
+
+      private:
+        const SimBrokerCowVector* v;
+        size_t i;
+    };
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, this->count); }
+
+  private:
+    typedef std::vector<T> Chunk;
+    typedef std::vector<std::shared_ptr<Chunk>> ChunkList;
+
+    void ownList() {
+      if (!simBrokerCowUnique(this->chunks)) this->chunks = std::make_shared<ChunkList>(*this->chunks);
+    }
+
+    Chunk* ownChunk(size_t c) {
+      this->ownList();
+
+      auto& chunk = (*this->chunks)[c];
+      if (!simBrokerCowUnique(chunk)) {
+        auto copy = std::make_shared<Chunk>();
+        copy->reserve(ChunkSize);
+        copy->insert(copy->end(), chunk->begin(), chunk->begin()+this->live(c));
+        chunk = copy;
+      }
+
+      return chunk.get();
+    }
+
+    // Elements of chunk c in use, the rest (if any) are left over from before a clear()/erase()
+    size_t live(size_t c) const {
+      if (this->count <= c*ChunkSize) return 0;
+      return std::min(ChunkSize, this->count-c*ChunkSize);
+    }
+
+    std::shared_ptr<ChunkList> chunks;
+    size_t count = 0;
+};
+
+// A single value shared between copies until one of them writes to it, for members that are
+// rarely written but would otherwise be deep copied by every fork.
+//
+// Reads go through operator*/operator->, writes through mut(). Nothing is allocated until the
+// first write; until then (and after assigning {}) it reads as a default constructed T.
+template <typename T>
+class SimBrokerCow {
+  public:
+    const T& operator*() const { return this->value ? *this->value : empty(); }
+    const T* operator->() const { return &**this; }
+
+    T& mut() {
+      if (!this->value) this->value = std::make_shared<T>();
+      else if (!simBrokerCowUnique(this->value)) this->value = std::make_shared<T>(*this->value);
+      return *this->value;
+    }
+
+  private:
+    static const T& empty() {
+      static const T e;
+      return e;
+    }
+
+    std::shared_ptr<T> value;
+};
@@ -0,0 +1,67 @@
+#pragma once
+#include "simBroker.hpp"
+#include <unordered_map>
+#include <map>
+
+// Sits between SimBrokers and a data source for the duration of one clock update, serving
+// requests from data fetched up front instead of going to the source every time.
+//
+// Blocks of minute bars are handed to it per ticker (setBars), and any getMinuteBars request
+// falling inside a block is sliced out of it. Prices are memoized by exact (ticker, time) and
+// market phases are remembered between phase changes. Everything else, and anything not
+// covered, goes straight to the source.
+//
+// Slicing assumes the source's getMinuteBars returns bars with startTime <= time < endTime-60,
+// like the reference and SimBrokerMemoryDataSource do.
+//
+// Not thread safe, and only valid while the data behind it can't change - call clear() between
+// updates.
+class SimBrokerDataCache : public SimBrokerStockDataSource {
+  public:
+    SimBrokerDataCache(SimBrokerStockDataSource* source);
+
+    // bars must be what source->getMinuteBars(ticker, startTime, endTime) returns
+    void setBars(std::string ticker, uint64_t startTime, uint64_t endTime, std::vector<Bar> bars);
+    void setPrice(std::string ticker, uint64_t time, currency price);
+    void clear();
+
+    struct Stats {
+      uint64_t barRequests = 0;      // getMinuteBars calls made to the cache
+      uint64_t barBlocksFetched = 0; // getMinuteBars calls that went to the data source (incl. setBars)
+      uint64_t priceRequests = 0;
+      uint64_t pricesFetched = 0;
+      uint64_t phaseRequests = 0;
+      uint64_t phasesFetched = 0;
+    };
+    Stats stats;
+
+    std::vector<Bar> getMinuteBars(std::string ticker, uint64_t startTime, uint64_t endTime);
+    currency getPrice(std::string ticker, uint64_t time);
+    cpp_dec_float_100 getAssetBorrowRate(std::string ticker, uint64_t time);
+    MarketPhase getMarketPhase(uint64_t time);
+    MarketPhaseChange getNextMarketPhaseChange(uint64_t time);
+    MarketPhaseChange getPrevMarketPhaseChange(uint64_t time);
+    MarketPhaseChange getNextMarketPhaseChangeTo(uint64_t time, MarketPhase to);
+    MarketPhaseChange getPrevMarketPhaseChangeTo(uint64_t time, MarketPhase to);
+    MarketPhaseChange getNextMarketPhaseChangeFrom(uint64_t time, MarketPhase from);
+    MarketPhaseChange getPrevMarketPhaseChangeFrom(uint64_t time, MarketPhase from);
+    bool isTickerMarginable(std::string ticker, uint64_t time);
+    bool isTickerETB(std::string ticker, uint64_t time);
+    bool isTickerShortable(std::string ticker, uint64_t time);
+
+  private:
+    struct Block {
+      uint64_t start;
+      uint64_t end;
+      std::vector<Bar> bars;
+    };
+
+    SimBrokerStockDataSource* source;
+    std::unordered_map<std::string, Block> blocks;
+    std::map<std::pair<std::string, uint64_t>, currency> prices;
+
+    // The market phase is constant strictly between two phase changes
+    uint64_t phaseFrom = 1;
+    uint64_t phaseTo = 0;
+    MarketPhase phase = MarketPhase::CLOSED;
+};
@@ -0,0 +1,40 @@
+#pragma once
+#include "simBroker.hpp"
+
+// Passes every call on to the data source it wraps, batches as batches. A base for wrappers that
+// only care about some calls: override called() to see every call (counting, tracing...), ticker()
+// to rename the tickers passed on, or any method to change what it does.
+//
+// Calls called() from whatever thread calls it, and is otherwise as thread safe as the wrapped
+// source. Like SimBrokerInstrumentedDataSource, it doesn't forward
+// SimBrokerAsyncStockDataSource's interface - wrapping an async source makes it a blocking one.
+class SimBrokerForwardingDataSource : public SimBrokerStockDataSource {
+  public:
+    SimBrokerForwardingDataSource(SimBrokerStockDataSource* source);
+
+    std::vector<Bar> getMinuteBars(std::string ticker, uint64_t startTime, uint64_t endTime);
+    currency getPrice(std::string ticker, uint64_t time);
+    cpp_dec_float_100 getAssetBorrowRate(std::string ticker, uint64_t time);
+    MarketPhase getMarketPhase(uint64_t time);
+    MarketPhaseChange getNextMarketPhaseChange(uint64_t time);
+    MarketPhaseChange getPrevMarketPhaseChange(uint64_t time);
+    MarketPhaseChange getNextMarketPhaseChangeTo(uint64_t time, MarketPhase to);
+    MarketPhaseChange getPrevMarketPhaseChangeTo(uint64_t time, MarketPhase to);
+    MarketPhaseChange getNextMarketPhaseChangeFrom(uint64_t time, MarketPhase from);
+    MarketPhaseChange getPrevMarketPhaseChangeFrom(uint64_t time, MarketPhase from);
+    bool isTickerMarginable(std::string ticker, uint64_t time);
+    bool isTickerETB(std::string ticker, uint64_t time);
+    bool isTickerShortable(std::string ticker, uint64_t time);
+    std::vector<currency> getPriceSeries(std::string ticker, std::vector<uint64_t> times);
+    std::vector<cpp_dec_float_100> getAssetBorrowRateSeries(std::string ticker, std::vector<uint64_t> times);
+    std::vector<currency> getPrices(std::vector<std::string> tickers, uint64_t time);
+    std::vector<cpp_dec_float_100> getAssetBorrowRates(std::vector<std::string> tickers, uint64_t time);
+
+  protected:
+    // Once per call, before it's passed on. A batch is one call.
+    virtual void called() {}
+    // What each ticker is passed on as
+    virtual std::string ticker(std::string t) { return t; }
+
+    SimBrokerStockDataSource* source;
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include "simBroker.hpp"
+#include "simBrokerDataCache.hpp"
+#include <memory>
+
+// Advances many SimBroker accounts in lockstep on a common clock, e.g. hundreds of parameter
+// variants trading the same symbols over the same dates.
+//
+// Instead of every account fetching and walking the same minute bars on its own, the group
+// fetches one block of bars per symbol per clock update (covering every account's live orders)
+// and serves each account's requests out of that shared block. Prices and market phases are
+// shared between accounts the same way.
+//
+// Only the data is shared. Every account is still a complete SimBroker holding its own positions,
+// orders and balance, and fills are simulated account by account - account state is not laid out
+// as struct-of-arrays and nothing here vectorizes across accounts. If the accounts trade the same
+// orders in different sizes, SimBrokerPortfolio keeps their order state in per-account columns and
+// simulates each order once.
+//
+// Slicing the shared block assumes the data source's getMinuteBars returns bars with
+// startTime <= time < endTime-60, like the reference and SimBrokerMemoryDataSource do.
+class SimBrokerGroup {
+  public:
+    SimBrokerGroup(SimBrokerStockDataSource* dataSource, uint64_t startTime, bool margin, size_t accounts);
+
+    size_t size();
+    SimBroker& account(size_t i);
+
+    // Moves every account's clock forward. Don't call updateClock on the accounts directly,
+    // or they'll bypass the shared bars.
+    void updateClock(uint64_t time);
+    uint64_t getClock();
+
+    // One entry per account
+    std::vector<currency> getBalances();
+    std::vector<currency> getEquities();
+
+    typedef SimBrokerDataCache::Stats Stats;
+    Stats getStats();
+
+  private:
+    SimBrokerStockDataSource* stockDataSource;
+
+    // Sits between the accounts and the real data source
+    std::unique_ptr<SimBrokerDataCache> shared;
+    std::vector<SimBroker> accounts;
+    uint64_t clock;
+};
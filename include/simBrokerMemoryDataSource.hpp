@@ -0,0 +1,92 @@
+#pragma once
+#include "simBroker.hpp"
+#include <unordered_map>
+#include <memory>
+
+// A SimBrokerStockDataSource that holds everything in memory.
+//
+// Load it with addBar/addCalendarDay (or the load*File helpers), then call freeze(). Once frozen
+// nothing can be added, and every read is a lock-free binary search over immutable arrays - so
+// one instance can be shared by any number of SimBrokers running on different threads.
+//
+// Frozen bars are kept in a read-only shared memory mapping, so worker processes forked after
+// freeze() (see SimBrokerSweep::runProcesses) all read the same single copy of the data.
+//
+// Lookups behave like the reference data source in test/test.cpp: getMinuteBars returns bars
+// with startTime <= time < endTime-60, and getPrice returns the open of the first bar at or
+// after the requested time.
+class SimBrokerMemoryDataSource : public SimBrokerStockDataSource {
+  public:
+    SimBrokerMemoryDataSource();
+
+    // Loading. All of these throw std::logic_error once frozen.
+    void addBar(std::string ticker, Bar bar);
+    void addCalendarDay(uint64_t open, uint64_t close);
+    void setAssetBorrowRate(std::string ticker, cpp_dec_float_100 rate); // Default 0.03
+    void setTickerFlags(std::string ticker, bool marginable, bool ETB, bool shortable); // Default all true
+
+    // File format: ticker,timeframe:time,openprice,closeprice,highprice,lowprice,volume\n
+    // (as written by test/mkTestData.cpp). Only 1Min bars are loaded.
+    void loadBarsFile(std::string path);
+
+    // File format: open,close\n
+    void loadCalendarFile(std::string path);
+
+    // Sorts and indexes everything. Reads are only valid (and thread-safe) after this.
+    void freeze();
+    bool frozen();
+
+    std::vector<Bar> getMinuteBars(std::string ticker, uint64_t startTime, uint64_t endTime);
+    currency getPrice(std::string ticker, uint64_t time);
+    cpp_dec_float_100 getAssetBorrowRate(std::string ticker, uint64_t time);
+
+    MarketPhase getMarketPhase(uint64_t time);
+    MarketPhaseChange getNextMarketPhaseChange(uint64_t time);
+    MarketPhaseChange getPrevMarketPhaseChange(uint64_t time);
+    MarketPhaseChange getNextMarketPhaseChangeTo(uint64_t time, MarketPhase to);
+    MarketPhaseChange getPrevMarketPhaseChangeTo(uint64_t time, MarketPhase to);
+    MarketPhaseChange getNextMarketPhaseChangeFrom(uint64_t time, MarketPhase from);
+    MarketPhaseChange getPrevMarketPhaseChangeFrom(uint64_t time, MarketPhase from);
+
+    bool isTickerMarginable(std::string ticker, uint64_t time);
+    bool isTickerETB(std::string ticker, uint64_t time);
+    bool isTickerShortable(std::string ticker, uint64_t time);
+
+  private:
+    // Bars are stored as plain doubles (which is what the text files hold anyway) and only
+    // turned into currency on the way out
+    struct PackedBar {
+      uint64_t time;
+      double openPrice;
+      double closePrice;
+      double highPrice;
+      double lowPrice;
+      uint64_t volume;
+    };
+
+    struct TickerInfo {
+      uint64_t firstBar = 0; // Range of this ticker's bars in bars
+      uint64_t endBar = 0;
+      cpp_dec_float_100 borrowRate = 0.03;
+      bool marginable = true;
+      bool ETB = true;
+      bool shortable = true;
+    };
+
+    void checkNotFrozen();
+    const TickerInfo* ticker(const std::string& ticker);
+    Bar unpack(const PackedBar& b);
+
+    bool isFrozen = false;
+
+    // Staging area while loading
+    std::unordered_map<std::string, std::vector<PackedBar>> loadingBars;
+    std::vector<std::pair<uint64_t, uint64_t>> calendar;
+
+    // Frozen state
+    std::unordered_map<std::string, TickerInfo> tickers;
+    std::shared_ptr<PackedBar> barStore; // Read-only shared mapping (see freeze)
+    const PackedBar* bars = NULL;        // Grouped by ticker, sorted by time within each ticker
+    uint64_t barCount = 0;
+    std::vector<MarketPhaseChange> marketPhaseChanges;
+};
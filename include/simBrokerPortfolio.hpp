@@ -0,0 +1,105 @@
+#pragma once
+#include "simBroker.hpp"
+#include <unordered_map>
+#include <array>
+
+// Runs the same strategy for many sub-accounts (e.g. thousands of client accounts with different
+// cash levels) without a SimBroker per account.
+//
+// State is stored as columns with one entry per account: balances, one quantity/entry price
+// column per symbol, and one quantity/fill/status column per order. An order is placed for all
+// accounts at once, each with its own quantity. Its fill is simulated once, by the same code
+// SimBroker uses, and then applied to every account's column. Equity and buying power are
+// computed for all accounts in one pass that looks up each price once.
+//
+// Sub-accounts are cash accounts, behaving like SimBroker(dataSource, startTime, false): no
+// margin, so no shorts, interest or PDT rules.
+//
+// Buys and sells fill under different rules (a buy limit fills at or below the limit, a sell limit
+// at or above it), so an order's buying accounts and selling accounts are simulated separately:
+// each side for the largest quantity among its accounts, and every account gets up to its own
+// quantity of its side's fill. With SimBroker's fill model (unlimited fill rate, see
+// SimBroker::estimateFillRate) that is exactly the fill each account would get on its own.
+class SimBrokerPortfolio {
+  public:
+    SimBrokerPortfolio(SimBrokerStockDataSource* dataSource, uint64_t startTime, size_t accounts);
+
+    size_t size();
+
+    void updateClock(uint64_t time);
+    uint64_t getClock();
+
+    void addFunds(size_t account, currency chedda);
+    void addFunds(const std::vector<currency>& amounts); // One amount per account
+    void rmFunds(size_t account, currency cheeze);
+
+    // Places the order for every account. qtys has one quantity per account (negative to sell).
+    // Each account's share is accepted or rejected on its own, like SimBroker::placeOrder; a
+    // quantity of zero is rejected. Quantities may differ in sign. p.qty is ignored. Returns the
+    // order id, shared by all accounts.
+    uint64_t placeOrder(SimBroker::OrderPlan p, const std::vector<int64_t>& qtys);
+    void cancelOrder(uint64_t orderId);                 // For every account
+    void cancelOrder(uint64_t orderId, size_t account); // For one account
+
+    // The order as a SimBroker for that account would report it
+    SimBroker::Order getOrder(uint64_t orderId, size_t account);
+    uint64_t getOrderCount();
+
+    std::vector<SimBroker::Position> getPositions(size_t account);
+    currency getBalance(size_t account);
+    const std::vector<currency>& getBalances();
+
+    // One entry per account. Each symbol's price is looked up once for all accounts.
+    std::vector<currency> getEquities();
+    std::vector<currency> getBuyingPowers();
+
+    void enableInstaFill();
+    void disableInstaFill();
+    bool instaFillEnabled();
+
+  private:
+    // One column per symbol
+    struct Holding {
+      std::string symbol;
+      std::vector<int64_t> qty;
+      std::vector<currency> avgEntryPrice;
+      std::vector<currency> costBasis;
+      std::vector<uint64_t> createdTime;
+      std::vector<uint64_t> positionId; // Per account, in order of creation
+    };
+
+    // One column per order
+    struct SharedOrder {
+      // [0] for the accounts buying, [1] for those selling, each simulated with the largest
+      // quantity on its side (REJECTED if there's nobody on it)
+      std::array<SimBroker::Order, 2> sides;
+      std::vector<int64_t> qty;
+      std::vector<int64_t> filledQty;
+      std::vector<SimBroker::OrderStatus> status;
+      std::vector<uint64_t> filledAt;
+      std::vector<currency> filledAvgPrice;
+
+      // Status history of accounts that were rejected or cancelled on their own. Everyone else
+      // shares their side's orderStatusHistory.
+      std::unordered_map<size_t, std::vector<SimBroker::Order::OrderStatusHistoryEntry>> ownHistory;
+    };
+
+    void updateState();
+    void applyFill(SharedOrder& so, int side);
+    void setAccountStatus(SharedOrder& so, size_t account, SimBroker::OrderStatus status);
+    Holding& holding(const std::string& symbol);
+    void addToPosition(Holding& h, size_t account, int64_t qty, currency avgPrice);
+
+    SimBrokerStockDataSource* stockDataSource;
+    size_t accounts;
+    uint64_t clock;
+
+    // Used for its order handling (TIF and fill simulation) only, never holds state of its own
+    SimBroker engine;
+
+    std::vector<currency> balances;
+    std::vector<Holding> holdings;
+    std::unordered_map<std::string, size_t> holdingIndex;
+    std::vector<uint64_t> nextPositionId; // Per account
+    std::vector<SharedOrder> orders;
+};
@@ -0,0 +1,93 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+
+// Runs batches of jobs (typically one SimBroker backtest each) on a persistent pool of threads.
+//
+// Backtests vary a lot in cost, so every worker has its own deque of jobs and steals from the
+// back of another worker's deque once its own runs dry - nobody sits idle while jobs remain.
+// Jobs with a higher priority are started first; give expensive jobs a higher priority to keep
+// them from landing at the tail of the batch.
+//
+// Cancellation is cooperative: once cancelled, jobs that haven't started are dropped and running
+// jobs can poll Context::cancelled() to stop early.
+class SimBrokerScheduler {
+  public:
+    class Context {
+      public:
+        bool cancelled();
+        void cancelRemaining(); // e.g. once a target result has been found
+        unsigned worker();      // Index of the worker thread running this job
+
+      private:
+        friend class SimBrokerScheduler;
+        Context(SimBrokerScheduler* scheduler, unsigned worker);
+        SimBrokerScheduler* scheduler;
+        unsigned workerIndex;
+    };
+
+    typedef std::function<void(Context& ctx)> Job;
+
+    struct Report {
+      uint64_t completed = 0;
+      uint64_t cancelled = 0; // Dropped without running
+      uint64_t stolen = 0;    // Run by a worker other than the one they were queued on
+    };
+
+    // threads = 0 uses one thread per core
+    SimBrokerScheduler(unsigned threads = 0);
+    ~SimBrokerScheduler();
+    SimBrokerScheduler(const SimBrokerScheduler&) = delete;
+    SimBrokerScheduler& operator=(const SimBrokerScheduler&) = delete;
+
+    // Queue a job for the next run()
+    void submit(Job job, int64_t priority = 0);
+
+    // Runs everything submitted so far and blocks until it's done (or dropped).
+    // Exceptions thrown by jobs are rethrown here (the first one), after the batch has finished.
+    Report run();
+
+    // Drops every job of the current batch that hasn't started yet
+    void cancel();
+
+    unsigned getThreads();
+
+  private:
+    struct QueuedJob {
+      Job job;
+      int64_t priority;
+    };
+
+    struct Worker {
+      std::mutex lock;
+      std::deque<QueuedJob> jobs; // Highest priority at the front
+    };
+
+    void workerLoop(unsigned index);
+    void runBatch(unsigned index);
+    bool takeJob(unsigned index, QueuedJob& out, bool& stolen);
+
+    std::vector<QueuedJob> pending;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    uint64_t batch = 0;
+    unsigned busyWorkers = 0;
+    bool stopping = false;
+
+    std::atomic<bool> isCancelled = false;
+    std::atomic<uint64_t> completed = 0;
+    std::atomic<uint64_t> dropped = 0;
+    std::atomic<uint64_t> stolen = 0;
+    std::exception_ptr error;
+};
@@ -0,0 +1,112 @@
+#pragma once
+#include "simBroker.hpp"
+#include "simBrokerScheduler.hpp"
+#include <map>
+#include <optional>
+#include <memory>
+
+struct SimBrokerSweepQueue;
+
+// Runs many independent backtests that only differ in their strategy parameters, spread over a
+// pool of threads (one per core by default, see SimBrokerScheduler). Every run gets its own
+// SimBroker, but they all read from the same data source - which therefore must be safe to call
+// from multiple threads at once.
+class SimBrokerSweep {
+  public:
+    // How each run's SimBroker is set up before the strategy gets it
+    struct BrokerConfig {
+      uint64_t startTime = 0;
+      bool margin = false;
+      currency funds = 0.0;
+      bool instaFill = false;
+      bool shortRoundLotFee = true;
+      cpp_dec_float_100 initialMarginRequirement = 0.5;
+      cpp_dec_float_100 maintenanceMarginRequirement = 0.35;
+      cpp_dec_float_100 interestRate = 0.0375;
+
+      // If set, every run starts from this checkpoint (see SimBroker::saveCheckpoint) instead of
+      // the settings above, e.g. to sweep only what comes after a long common warm-up. The
+      // checkpoint is loaded once per call to run() and forked for each run.
+      std::string checkpoint;
+    };
+
+    // One point of the parameter grid (parameter name -> value)
+    typedef std::map<std::string, double> Params;
+
+    // Runs a single backtest - place orders, move the clock forward etc.
+    // Called from several threads at once, so it shouldn't touch shared state without locking.
+    // Each thread reuses one broker for all its runs (see SimBroker::reset), so don't hold on to
+    // it after returning.
+    typedef std::function<void(SimBroker& broker, const Params& params)> Strategy;
+
+    struct Result {
+      uint64_t run = 0; // Index into the list of params passed to run()
+      Params params;
+      bool failed = false;
+      std::string error; // If the strategy threw, what() of the exception
+      uint64_t clock = 0;
+      currency balance = 0.0;
+      currency equity = 0.0;
+      std::vector<SimBroker::Position> positions;
+      uint64_t orderCount = 0;
+      bool cancelled = false; // Never ran because the sweep was stopped early
+    };
+
+    // Rough relative cost of a run, used to start expensive runs first
+    typedef std::function<int64_t(const Params& params)> CostEstimate;
+
+    // Return true to stop the sweep (e.g. once a result is good enough). Runs that haven't
+    // started yet are skipped. Called from several threads at once, like the strategy.
+    typedef std::function<bool(const Result& result)> StopCondition;
+
+    // threads = 0 uses one thread per core
+    SimBrokerSweep(SimBrokerStockDataSource* dataSource, BrokerConfig config, unsigned threads = 0);
+
+    // Every combination of the given parameter values
+    static std::vector<Params> grid(std::map<std::string, std::vector<double>> axes);
+
+    // Blocks until every run is done. Results are in the same order as params.
+    std::vector<Result> run(std::vector<Params> params, Strategy strategy, StopCondition stop = nullptr);
+
+    // Like run(), but every run happens in a forked worker process instead of on a thread - for
+    // strategies that aren't thread safe, or that might crash. processes = 0 uses one per core.
+    //
+    // Workers are forked from the calling process, so they inherit the data source as it is at
+    // that point. With a frozen SimBrokerMemoryDataSource the bars are in shared memory, so the
+    // data exists once no matter how many workers there are.
+    //
+    // Workers send each run's final broker state back over a pipe as a checkpoint. The strategy
+    // runs in the worker, so anything it does outside the broker is lost - only the Result comes
+    // back. The stop condition is called in this process. A worker that dies mid-run fails that
+    // run; the other workers carry on with the rest.
+    //
+    // Forking a process that has other threads running can deadlock the child (on a lock one of
+    // them held), so this first shuts down the thread pool run() uses. The next run() starts a
+    // new one.
+    std::vector<Result> runProcesses(std::vector<Params> params, Strategy strategy, StopCondition stop = nullptr,
+                                     unsigned processes = 0);
+
+    void setCostEstimate(CostEstimate func);
+    unsigned getThreads();
+
+  private:
+    Result runOne(uint64_t run, const Params& params, Strategy& strategy, SimBroker& broker);
+    // Resets a used broker to the start of a run (see SimBroker::reset)
+    void prepareBroker(SimBroker& broker);
+    SimBroker& pooledBroker(unsigned worker);
+    void fillResult(Result& r, SimBroker& broker);
+    std::vector<Result> startSweep(const std::vector<Params>& params);
+    void workerProcess(int fd, const std::vector<uint64_t>& order, const std::vector<Params>& params,
+                       Strategy& strategy, SimBrokerSweepQueue* queue);
+
+    SimBrokerStockDataSource* stockDataSource;
+    BrokerConfig config;
+    unsigned threads;
+    // Started by run() and shut down by runProcesses(), which mustn't fork with threads running
+    std::unique_ptr<SimBrokerScheduler> scheduler;
+    CostEstimate costEstimate;
+    std::optional<SimBroker> prefix; // Loaded from config.checkpoint
+
+    // One broker per scheduler thread, reused by every run on that thread
+    std::vector<std::optional<SimBroker>> pool;
+};
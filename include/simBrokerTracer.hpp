@@ -0,0 +1,87 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+// Records timed spans of what SimBroker is doing - updateClock, updateState, each order's fill,
+// interest charging, margin and PDT checks, and data source calls (through
+// SimBrokerInstrumentedDataSource) - and exports them as a Chrome trace, to see on a timeline
+// exactly which simulated day and which order a slow backtest was stuck on. Open the file in
+// chrome://tracing or https://ui.perfetto.dev.
+//
+// Hand one to SimBroker::setTracer and/or SimBrokerInstrumentedDataSource::setTracer. One tracer
+// can be shared by any number of brokers and threads: each thread records into a ring buffer of
+// its own, so recording takes no locks (only the first span on each thread does, to create the
+// ring). A full ring overwrites its oldest spans, so a long backtest keeps its most recent ones.
+//
+// Read the spans (events/chromeTrace/writeChromeTrace) or clear() while nothing is recording.
+class SimBrokerTracer {
+  public:
+    struct Event {
+      const char* name;    // Must outlive the tracer - a string literal
+      uint64_t begin;      // Nanoseconds since the tracer was created
+      uint64_t duration;   // Nanoseconds
+      uint64_t simTime;    // Broker clock the span was for, 0 if none
+      int64_t orderId;     // -1 if none
+      char symbol[16];     // Empty if none, truncated if longer
+      uint32_t thread;     // Order in which threads first recorded into this tracer
+    };
+
+    // Records from construction to destruction. Does nothing with a NULL tracer, so call sites can
+    // construct one unconditionally.
+    class Span {
+      public:
+        Span(SimBrokerTracer* tracer, const char* name, uint64_t simTime = 0,
+             const std::string* symbol = NULL, int64_t orderId = -1);
+        ~Span();
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+      private:
+        SimBrokerTracer* tracer;
+        const char* name;
+        uint64_t simTime;
+        const std::string* symbol;
+        int64_t orderId;
+        uint64_t begin;
+    };
+
+    SimBrokerTracer(size_t eventsPerThread = 65536);
+    SimBrokerTracer(const SimBrokerTracer&) = delete;
+    SimBrokerTracer& operator=(const SimBrokerTracer&) = delete;
+
+    void record(const char* name, uint64_t begin, uint64_t end, uint64_t simTime = 0,
+                const std::string* symbol = NULL, int64_t orderId = -1);
+    // Nanoseconds since the tracer was created, on the clock spans are recorded with
+    uint64_t now();
+
+    // Every span still in a ring, ordered by start time
+    std::vector<Event> events();
+    // Spans overwritten because their thread's ring was full
+    uint64_t dropped();
+    void clear();
+
+    // Chrome trace event format (JSON). Each span's args carry its simulated time (also as a
+    // UTC date), symbol and order id.
+    std::string chromeTrace();
+    void writeChromeTrace(std::string path);
+
+  private:
+    struct Ring {
+      std::vector<Event> events;
+      std::atomic<uint64_t> written = 0; // Total ever written; the next goes at written%size
+      uint32_t thread;
+    };
+
+    Ring* ring();
+
+    const uint64_t id; // Unique per tracer, so a thread's cached ring can't go to a later tracer at the same address
+    const size_t eventsPerThread;
+    const int64_t epoch;
+
+    std::mutex lock; // Guards rings (not their contents)
+    std::vector<std::unique_ptr<Ring>> rings;
+};
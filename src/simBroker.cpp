@@ -1,49 +1,439 @@
 #include "simBroker.hpp"
+#include "simBrokerAsyncDataSource.hpp"
+#include "simBrokerDataCache.hpp"
+#include "simBrokerForwardingDataSource.hpp"
+#include "simBrokerScheduler.hpp"
+#include "simBrokerTracer.hpp"
 #include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <type_traits>
+#include <boost/core/nvp.hpp>
+#include <chrono>
+#include <thread>
 #include "math.h"
 
 // TODO: implement order expirey
 // TODO: simulate the effect that our own investment has on the price of the stock
 // TODO: simulate slippage (related to the above, but not fully defined by it)
 
+std::vector<currency> SimBrokerStockDataSource::getPriceSeries(std::string ticker, std::vector<uint64_t> times) {
+  std::vector<currency> r;
+  r.reserve(times.size());
+  for (auto t : times) r.push_back(this->getPrice(ticker, t));
+  return r;
+}
+
+std::vector<cpp_dec_float_100> SimBrokerStockDataSource::getAssetBorrowRateSeries(std::string ticker, std::vector<uint64_t> times) {
+  std::vector<cpp_dec_float_100> r;
+  r.reserve(times.size());
+  for (auto t : times) r.push_back(this->getAssetBorrowRate(ticker, t));
+  return r;
+}
+
+std::vector<currency> SimBrokerStockDataSource::getPrices(std::vector<std::string> tickers, uint64_t time) {
+  std::vector<currency> r;
+  r.reserve(tickers.size());
+  for (auto& t : tickers) r.push_back(this->getPrice(t, time));
+  return r;
+}
+
+std::vector<cpp_dec_float_100> SimBrokerStockDataSource::getAssetBorrowRates(std::vector<std::string> tickers, uint64_t time) {
+  std::vector<cpp_dec_float_100> r;
+  r.reserve(tickers.size());
+  for (auto& t : tickers) r.push_back(this->getAssetBorrowRate(t, time));
+  return r;
+}
+
 SimBroker::SimBroker(SimBrokerStockDataSource* dataSource, uint64_t startTime, bool margin) : 
   stockDataSource(dataSource),
+  asyncSource(dynamic_cast<SimBrokerAsyncStockDataSource*>(dataSource)),
   balance(0.0),
   clock(startTime),
   marginEnabled(margin),
   lastInterestTime(startTime)
 {};
 
+// Orders, positions, the calendar, the last accrual, margin bands and profile are all shared
+// copy-on-write, so a plain copy is the fork. What's left is fixed size apart from the handlers
+// and the auto-checkpoint path.
+SimBroker SimBroker::fork() {
+  SimBroker f = *this;
+
+  // Branches would overwrite our checkpoint (and race on path.tmp)
+  f.autoCheckpointPath.clear();
+  f.autoCheckpointDays = 0;
+  f.lastCheckpointTime = 0;
+  return f;
+}
+
+// Stats
+//
+// Fills may be simulated on other threads (see updateOrdersParallel), so the per-bar counters are
+// kept per thread and collected by the update.
+static thread_local uint64_t barsVisited = 0;
+static thread_local uint64_t gapFillPrices = 0;
+
+// Adds the time until it goes out of scope to a Stats timer, if stats are on
+class StatsTimer {
+  public:
+    StatsTimer(bool on, uint64_t& total) : total(on ? &total : NULL) {
+      if (this->total) this->begin = std::chrono::steady_clock::now();
+    }
+    ~StatsTimer() {
+      if (this->total) *this->total += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-this->begin).count();
+    }
+
+  private:
+    uint64_t* total;
+    std::chrono::steady_clock::time_point begin;
+};
+
+// Profiling
+//
+// While profiling, the outermost updateClock routes the data source through a ProfiledSource,
+// which counts calls per thread. Fills may be simulated on other threads, whose calls
+// updateOrdersParallel adds to profile.otherThreadCalls.
+static thread_local uint64_t sourceCalls = 0;
+
+static uint64_t profileNow() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class ProfiledSource : public SimBrokerForwardingDataSource {
+  public:
+    ProfiledSource(SimBrokerStockDataSource* source) : SimBrokerForwardingDataSource(source) {}
+    SimBrokerStockDataSource* wrapped() { return this->source; }
+
+  protected:
+    // Batches count as one call, and go to the source as batches
+    void called() { sourceCalls++; }
+};
+
+void SimBroker::enableProfiling() { this->profilingOn = true; }
+void SimBroker::disableProfiling() { this->profilingOn = false; }
+bool SimBroker::profilingEnabled() { return this->profilingOn; }
+
+void SimBroker::resetProfile() { this->profile.totals = {}; }
+
+void SimBroker::profileCharge(uint64_t time, bool update) {
+  if (this->profile.depth == 0) return;
+  uint64_t ns = profileNow()-this->profile.chargedNs;
+  uint64_t calls = sourceCalls-this->profile.chargedCalls+this->profile.otherThreadCalls;
+
+  ProfileCost& c = this->profile.totals.mut().days[this->profileDayStart(time)];
+  c.ns += ns;
+  c.dataSourceCalls += calls;
+  if (update) c.samples++;
+
+  // Our own bookkeeping (including profileDayStart's calls) isn't charged to anything
+  this->profile.chargedNs = profileNow();
+  this->profile.chargedCalls = sourceCalls;
+  this->profile.otherThreadCalls = 0;
+}
+
+// Like tradingDay(), but leaves the broker's own calendar index alone - profiling mustn't change
+// what a checkpoint holds. Anything the index and its cache don't cover is looked up in the data
+// source and only remembered in the profile.
+uint64_t SimBroker::profileDayStart(uint64_t time) {
+  Profile& p = this->profile;
+  if (time >= p.dayFrom && time < p.dayTo) return p.dayFrom;
+
+  const auto& starts = *this->tradingDayStarts;
+  if (time >= this->cachedDayFrom && time < this->cachedDayTo) {
+    p.dayFrom = this->cachedDayFrom;
+    p.dayTo = this->cachedDayTo;
+  } else if (starts.size() > 0 && time >= starts.front() && starts.back() > time) {
+    size_t i = std::upper_bound(starts.begin(), starts.end(), time)-starts.begin();
+    p.dayFrom = starts[i-1];
+    p.dayTo = starts[i];
+  } else {
+    const auto premarket = SimBrokerStockDataSource::MarketPhase::PREMARKET;
+    try {
+      p.dayFrom = this->stockDataSource->getPrevMarketPhaseChangeTo(time, premarket).time;
+    } catch (const std::exception&) {
+      p.dayFrom = 0; // Before the calendar starts
+    }
+    try {
+      p.dayTo = this->stockDataSource->getNextMarketPhaseChangeTo(time, premarket).time;
+    } catch (const std::exception&) {
+      p.dayTo = time+1; // Past the end of the calendar, so only good for this time
+    }
+  }
+
+  return p.dayFrom;
+}
+
+void SimBroker::profileOrder(const Order& o, const ProfileCost& cost) {
+  ProfileTotals& t = this->profile.totals.mut();
+  ProfileCost& s = t.symbols[o.symbol];
+  s.ns += cost.ns;
+  s.dataSourceCalls += cost.dataSourceCalls;
+  s.samples += cost.samples;
+
+  auto it = t.orders.find(o.id);
+  if (it == t.orders.end()) it = t.orders.emplace(o.id, OrderProfile{o.id, o.symbol, {}}).first;
+  ProfileCost& c = it->second.cost;
+  c.ns += cost.ns;
+  c.dataSourceCalls += cost.dataSourceCalls;
+  c.samples += cost.samples;
+}
+
+template <typename T>
+static std::vector<T> hottest(std::vector<T> all, size_t n, SimBroker::ProfileOrder by) {
+  auto key = [by](const T& t) { return by == SimBroker::BY_TIME ? t.cost.ns : t.cost.dataSourceCalls; };
+  n = std::min(n, all.size());
+  std::partial_sort(all.begin(), all.begin()+n, all.end(), [&key](const T& a, const T& b) { return key(a) > key(b); });
+  all.resize(n);
+  return all;
+}
+
+std::vector<SimBroker::DayProfile> SimBroker::hottestDays(size_t n, ProfileOrder by) {
+  std::vector<DayProfile> all;
+  for (auto& [day, cost] : this->profile.totals->days) all.push_back({day, cost});
+  return hottest(all, n, by);
+}
+
+std::vector<SimBroker::SymbolProfile> SimBroker::hottestSymbols(size_t n, ProfileOrder by) {
+  std::vector<SymbolProfile> all;
+  for (auto& [symbol, cost] : this->profile.totals->symbols) all.push_back({symbol, cost});
+  return hottest(all, n, by);
+}
+
+std::vector<SimBroker::OrderProfile> SimBroker::hottestOrders(size_t n, ProfileOrder by) {
+  std::vector<OrderProfile> all;
+  for (auto& [id, order] : this->profile.totals->orders) all.push_back(order);
+  return hottest(all, n, by);
+}
+
+void SimBroker::enableStats() { this->statsOn = true; }
+void SimBroker::disableStats() { this->statsOn = false; }
+bool SimBroker::statsEnabled() { return this->statsOn; }
+SimBroker::Stats SimBroker::getStats() { return this->stats; }
+void SimBroker::resetStats() { this->stats = {}; }
+
+// Field by field rather than assigning a new SimBroker, which would drop our storage. The trading
+// day index only depends on the data source, so it stays valid.
+void SimBroker::reset(uint64_t startTime, bool margin) {
+  this->balance = 0.0;
+  this->clock = startTime;
+  this->orders.clear();
+  this->positions.clear();
+  this->marginEnabled = margin;
+  this->shortRoundLotFee = true;
+  this->instaFill = false;
+  this->fillScheduler = NULL;
+  this->tracer = NULL;
+  this->initialMarginRequirement = 0.5;
+  this->maintenanceMarginRequirement = 0.35;
+  this->marginCallHandlerDefined = false;
+  this->PDTCallHandlerDefined = false;
+  this->lastInterestTime = startTime;
+  this->interestRate = 0.0375;
+  this->marginCallHandler = nullptr;
+  this->PDTCallHandler = nullptr;
+  this->isPDT = false;
+
+  auto& a = this->lastAccrual.mut();
+  a.time = 0;
+  a.interest = 0;
+  a.symbols.clear(); a.qtys.clear(); a.prices.clear(); a.rates.clear(); a.fees.clear();
+
+  this->dayTrades = {};
+  this->accountVersion = 0;
+  this->marginBands = {};
+  this->marginScreenValid = false;
+  this->marginScreenVersion = 0;
+  this->marginScreenTime = 0;
+
+  this->autoCheckpointPath.clear();
+  this->autoCheckpointDays = 0;
+  this->lastCheckpointTime = 0;
+
+  this->statsOn = false;
+  this->stats = {};
+
+  this->profilingOn = false;
+  this->profile = {};
+}
+
+// One night of borrow fees on a short position. The rate is taken by value and moved because
+// Boost's expression templates evaluate a product with an rvalue operand in a different order than
+// with an lvalue one, which changes the result in the guard digits (around 1e-119). Fees have always
+// been calculated from getAssetBorrowRate's temporary return value, and balances accumulate them, so
+// the lvalue form would drift from earlier results and checkpoints.
+static currency nightBorrowFee(const currency& price, uint64_t qty, cpp_dec_float_100 rate) {
+  return ((price*qty)*std::move(rate))/360;
+}
+
 void SimBroker::chargeDayInterest() {
-  // Charge interest on margin usage
+  SimBrokerTracer::Span span(this->tracer, "chargeDayInterest", this->clock);
+  auto& a = this->lastAccrual.mut();
+  a.time = this->clock;
+  a.interest = 0;
+  a.symbols.clear();
+  a.qtys.clear();
+
+  // Gather our shorts
   currency shortPositionSaleValue = 0.0;
-  for (auto p : this->getPositions()) {
-    if (p.qty < 0) shortPositionSaleValue -= p.avgEntryPrice*p.qty;
+  for (auto& p : this->positions) {
+    if (p.qty >= 0) continue;
+    shortPositionSaleValue -= p.avgEntryPrice*p.qty;
+    a.symbols.push_back(p.symbol);
+    a.qtys.push_back(labs(p.qty));
   }
 
+  // Charge interest on margin usage
   currency cash = this->balance-shortPositionSaleValue;
   if (cash < 0) {
     cpp_dec_float_100 interest = (fabs(cash)*this->interestRate)/360;
     this->balance -= interest;
+    a.interest = interest;
   }
 
   // Charge short position borrow fees
-  for (auto pos : this->getPositions()) {
-    if (pos.qty < 0) {
-      currency price = this->stockDataSource->getPrice(pos.symbol, this->clock);
-      uint64_t qty = labs(pos.qty);
-      if (this->shortRoundLotFee) qty = (((qty-1)/100)*100)+100;
+  size_t n = a.symbols.size();
+  if (n > 0) {
+    a.prices = this->stockDataSource->getPrices(a.symbols, this->clock);
+    a.rates = this->stockDataSource->getAssetBorrowRates(a.symbols, this->clock);
+  } else {
+    a.prices.clear();
+    a.rates.clear();
+  }
 
-      this->balance -= ((price*qty)*this->stockDataSource->getAssetBorrowRate(pos.symbol, this->clock))/360;
-    }
+  if (this->shortRoundLotFee) {
+    uint64_t* qtys = a.qtys.data();
+    for (size_t i = 0; i < n; i++) qtys[i] = (((qtys[i]-1)/100)*100)+100;
   }
 
+  // Fees stay in the decimal type so balances match exactly - this loop doesn't vectorize, only
+  // the round-lot one above is plain integer arithmetic
+  a.fees.resize(n);
+  for (size_t i = 0; i < n; i++) a.fees[i] = nightBorrowFee(a.prices[i], a.qtys[i], a.rates[i]);
+  for (size_t i = 0; i < n; i++) this->balance -= a.fees[i];
+
   this->lastInterestTime = this->clock;
+  this->accountVersion++;
+  if (this->profilingOn) this->profileCharge(this->clock, false);
+}
+
+bool SimBroker::canAccrueInBulk() {
+  // The margin call handler promises a check every night, which requires the full update
+  if (this->marginCallHandlerDefined) return false;
+
+  for (auto& o : this->orders) {
+    if (this->orderIsLive(o)) return false;
+  }
+
+  return true;
+}
+
+bool SimBroker::orderIsLive(const Order& o) {
+  // Fully filled orders can still expire, but they expire at a fixed time no matter when we notice
+  if (o.qty == 0 || o.filledQty == o.qty) return false;
+  if (o.status == OrderStatus::OPEN) return true;
+
+  // Orders that were cancelled/expired before we processed their fills still need one pass
+  return !o.doneFilling;
+}
+
+bool SimBroker::orderNeedsUpdate(const Order& o) {
+  if (this->orderIsLive(o)) return true;
+  return o.status == OrderStatus::OPEN && o.timeInForce == OrderTimeInForce::DAY;
+}
+
+void SimBroker::accrueNights(std::vector<uint64_t> closes) {
+  if (closes.size() == 0) return;
+  if (this->statsOn) this->stats.bulkAccruedNights += closes.size();
+  SimBrokerTracer::Span span(this->tracer, "accrueNights", closes.back());
+
+  currency shortPositionSaleValue = 0.0;
+  std::vector<std::string> shortSymbols;
+  std::vector<uint64_t> shortQtys;
+  std::vector<std::vector<currency>> shortPrices;
+  std::vector<std::vector<cpp_dec_float_100>> shortRates;
+  for (auto& pos : this->positions) {
+    if (pos.qty >= 0) continue;
+    shortPositionSaleValue -= pos.avgEntryPrice*pos.qty;
+
+    uint64_t qty = labs(pos.qty);
+    if (this->shortRoundLotFee) qty = (((qty-1)/100)*100)+100;
+
+    shortSymbols.push_back(pos.symbol);
+    shortQtys.push_back(qty);
+    shortPrices.push_back(this->stockDataSource->getPriceSeries(pos.symbol, closes));
+    shortRates.push_back(this->stockDataSource->getAssetBorrowRateSeries(pos.symbol, closes));
+  }
+
+  // Same arithmetic (and order of operations) as chargeDayInterest, so the result is identical
+  // to charging night by night
+  NightlyAccrual& accrual = this->lastAccrual.mut();
+  for (size_t n = 0; n < closes.size(); n++) {
+    currency balanceBefore = this->balance;
+    currency cash = this->balance-shortPositionSaleValue;
+    if (cash < 0) {
+      cpp_dec_float_100 interest = (fabs(cash)*this->interestRate)/360;
+      this->balance -= interest;
+    }
+
+    // Keep the breakdown of the last night for getLastNightlyAccrual()
+    bool last = n+1 == closes.size();
+    if (last) {
+      accrual.interest = balanceBefore-this->balance;
+      accrual.prices.clear();
+      accrual.rates.clear();
+      accrual.fees.clear();
+    }
+
+    for (size_t i = 0; i < shortQtys.size(); i++) {
+      currency fee = nightBorrowFee(shortPrices[i][n], shortQtys[i], shortRates[i][n]);
+      this->balance -= fee;
+      if (last) {
+        accrual.prices.push_back(shortPrices[i][n]);
+        accrual.rates.push_back(shortRates[i][n]);
+        accrual.fees.push_back(fee);
+      }
+    }
+  }
+
+  accrual.time = closes.back();
+  accrual.symbols = shortSymbols;
+  accrual.qtys = shortQtys;
+  this->clock = closes.back();
+  this->lastInterestTime = closes.back();
+  this->accountVersion++;
+  if (this->profilingOn) this->profileCharge(this->clock, false);
 }
 
 void SimBroker::updateClock(uint64_t time) {
   if (time < this->clock) throw std::logic_error("SimBroker instructed to travel back in time (this is not possible).");
 
+  // Profile the whole call, including the nested updateClocks for market closes
+  if (this->profilingOn && this->profile.depth == 0) {
+    SimBrokerStockDataSource* source = this->stockDataSource;
+    ProfiledSource counted(source);
+    this->stockDataSource = &counted;
+    this->profile.depth++;
+    this->profile.chargedNs = profileNow();
+    this->profile.chargedCalls = sourceCalls;
+    this->profile.otherThreadCalls = 0;
+
+    try {
+      this->updateClock(time);
+      this->profileCharge(this->clock, false);
+    } catch (...) {
+      this->stockDataSource = source;
+      this->profile.depth--;
+      throw;
+    }
+    this->stockDataSource = source;
+    this->profile.depth--;
+    return;
+  }
+
+  SimBrokerTracer::Span span(this->tracer, "updateClock", time);
+
   if (this->marginEnabled) {
     // We need updateClock to be called after every market close to charge interest,
     // because interest calculations require the current state calculated at that point in time 
@@ -52,6 +442,23 @@ void SimBroker::updateClock(uint64_t time) {
       (nextt = this->stockDataSource->getNextMarketPhaseChangeTo(this->lastInterestTime+1, SimBrokerStockDataSource::MarketPhase::CLOSED).time) 
       < time
       ) {
+      if (this->canAccrueInBulk()) {
+        // Nothing can change between now and the target time other than the balance, so we
+        // can charge all of the remaining nights without re-running updateState for each one
+        std::vector<uint64_t> closes;
+        while (nextt < time) {
+          closes.push_back(nextt);
+          if (this->autoCheckpointDue(nextt)) break;
+          nextt = this->stockDataSource->getNextMarketPhaseChangeTo(nextt+1, SimBrokerStockDataSource::MarketPhase::CLOSED).time;
+        }
+
+        this->accrueNights(closes);
+
+        // Stop at the close to take the checkpoint, then carry on
+        if (this->autoCheckpointDue(closes.back())) { this->updateClock(closes.back()); continue; }
+        break;
+      }
+
       this->updateClock(nextt);
       this->chargeDayInterest();
     }
@@ -60,9 +467,14 @@ void SimBroker::updateClock(uint64_t time) {
   uint64_t oldtime = this->clock;
   this->clock = time;
   if (time != oldtime) this->updateState();
+
+  if (this->autoCheckpointDue(this->clock)) {
+    this->saveCheckpoint(this->autoCheckpointPath);
+    this->lastCheckpointTime = this->clock;
+  }
 }
 
-uint64_t SimBroker::placeOrder(OrderPlan p) {
+SimBroker::Order SimBroker::newOrder(const OrderPlan& p) {
   if (p.timeInForce == SimBroker::OrderTimeInForce::IMMEDIATE_OR_CANCEL ||
       p.timeInForce == SimBroker::OrderTimeInForce::FILL_OR_KILL ||
       p.timeInForce == SimBroker::OrderTimeInForce::ON_OPEN ||
@@ -102,6 +514,12 @@ uint64_t SimBroker::placeOrder(OrderPlan p) {
   o.extendedHours = p.extendedHours;
   o.orderClass    = p.orderClass;
 
+  return o;
+}
+
+uint64_t SimBroker::placeOrder(OrderPlan p) {
+  Order o = this->newOrder(p);
+
 	bool PDTAllowed = true;
 	if (this->PDT() && this->getEquity() < 25000 && this->marginEnabled) {
 		PDTAllowed = false;
@@ -215,7 +633,7 @@ void SimBroker::eachBar(std::string ticker, uint64_t startTime, std::function<bo
 
   this->eachBarChunk(ticker, 
                      startTime, 
-                     [&startTime, &clock, &lastChunkEnd, *this, &ticker, &func, &myPrevBar, &myPrevBarExists]
+                     [&startTime, &clock, &lastChunkEnd, this, &ticker, &func, &myPrevBar, &myPrevBarExists]
                      (auto bars, uint64_t chunkStart, uint64_t chunkEnd) {
     int64_t barIndex = -1;
     SimBrokerStockDataSource::Bar bar;
@@ -235,14 +653,19 @@ void SimBroker::eachBar(std::string ticker, uint64_t startTime, std::function<bo
         // volume of zero, because if a trade occured there would be a bar
         // TODO: we could fall back on hour/day bars ourselves if we don't want to trust the stockDataSource to do it right
         currency price;
-        if (!myPrevBarExists) price = this->stockDataSource->getPrice(ticker, bt);
-        else price = myPrevBar.closePrice;
+        if (!myPrevBarExists) {
+          price = this->stockDataSource->getPrice(ticker, bt);
+          gapFillPrices++;
+        } else {
+          price = myPrevBar.closePrice;
+        }
 
         if (price > 0) myBar = {bt,price,price,price,price,0};
         else continue;
       }
 
 			if (myPrevBarExists && myPrevBar.time == myBar.time) continue;
+      barsVisited++;
       if (!func(myBar)) return false;
 
       if (myPrevBarExists && myPrevBar.time+60 != myBar.time) 
@@ -270,6 +693,21 @@ void SimBroker::updateOrderFillState(Order& o) {
   if (o.filledQty == o.qty || o.qty == 0 || o.doneFilling) return; // Nothing to do in these situations
 
   int64_t startQty = o.filledQty;
+  this->simulateFill(o);
+  this->applyFill(o, startQty);
+}
+
+void SimBroker::applyFill(const Order& o, int64_t startQty) {
+  // Nothing filled, so nothing to apply. addToPosition with a zero quantity isn't a no-op: it
+  // re-rounds the entry price (so results would depend on how often the clock is advanced), and
+  // resets the position's lastChange, which hides a same-day round trip from the PDT check.
+  if (o.filledQty == startQty) return;
+
+  this->addToPosition(o.symbol, o.filledQty-startQty, o.filledAvgPrice);
+  this->balance -= (o.filledQty-startQty)*o.filledAvgPrice;
+}
+
+void SimBroker::simulateFill(Order& o) {
   uint64_t filledSeconds = 0;
   currency avgPrice = 0.0;
   int64_t filledShares = 0;
@@ -350,9 +788,6 @@ void SimBroker::updateOrderFillState(Order& o) {
   } else if (o.filledQty > 0) {
     o.filledAvgPrice = avgPrice;
   }
-
-  this->addToPosition(o.symbol, o.filledQty-startQty, o.filledAvgPrice);
-  this->balance -= (o.filledQty-startQty)*o.filledAvgPrice;
 }
 
 void SimBroker::updateOrderTIF(Order& o) {
@@ -384,19 +819,202 @@ currency SimBroker::getTotalCostBasis() {
   return r;
 }
 
-void SimBroker::updateState() {
+void SimBroker::neededBars(std::map<std::string, uint64_t>& starts) {
   for (auto& o : this->orders) {
-    this->updateOrderTIF(o);
-    this->updateOrderFillState(o);
+    if (!this->orderIsLive(o)) continue;
+    uint64_t start = ((o.createdAt/60)*60)-60;
+    auto it = starts.find(o.symbol);
+    if (it == starts.end() || start < it->second) starts[o.symbol] = start;
+  }
+}
+
+// Everything is requested before the first co_await, so it's all in flight at once
+static SimBrokerTask fetchInto(SimBrokerDataCache* cache, SimBrokerAsyncStockDataSource* source,
+                               std::map<std::string, uint64_t> starts, uint64_t end,
+                               std::vector<std::string> priced, uint64_t time) {
+  std::vector<SimBrokerRequest<std::vector<SimBrokerStockDataSource::Bar>>> bars;
+  for (auto& [ticker, start] : starts) bars.push_back(source->requestMinuteBars(ticker, start, end));
+
+  std::vector<SimBrokerRequest<currency>> prices;
+  for (auto& ticker : priced) prices.push_back(source->requestPrice(ticker, time));
+
+  size_t i = 0;
+  for (auto& [ticker, start] : starts) {
+    cache->setBars(ticker, start, end, co_await bars[i]);
+    i++;
+  }
+  for (i = 0; i < priced.size(); i++) cache->setPrice(priced[i], time, co_await prices[i]);
+}
+
+void SimBroker::prefetch(SimBrokerDataCache& cache) {
+  std::map<std::string, uint64_t> starts;
+  this->neededBars(starts);
+
+  // The margin check prices every position at the clock, including ones our orders open
+  std::vector<std::string> priced;
+  if (this->marginEnabled && this->marginCallHandlerDefined) {
+    for (auto& p : this->positions) priced.push_back(p.symbol);
+    for (auto& [ticker, start] : starts) {
+      if (std::find(priced.begin(), priced.end(), ticker) == priced.end()) priced.push_back(ticker);
+    }
+  }
+
+  if (starts.empty() && priced.empty()) return;
+
+  // SimBroker never asks for bars past this point (see SimBroker::eachBarChunk)
+  uint64_t end = ((this->clock/60)*60)+60;
+  fetchInto(&cache, this->asyncSource, starts, end, priced, this->clock).wait();
+}
+
+void SimBroker::updateState() {
+  SimBrokerTracer::Span span(this->tracer, "updateState", this->clock);
+  if (this->asyncSource == NULL) {
+    this->runUpdate();
+    if (this->profilingOn) this->profileCharge(this->clock, true);
+    return;
+  }
+
+  // Serve this update out of the prefetched data, then put the real source back
+  SimBrokerStockDataSource* source = this->stockDataSource;
+  SimBrokerDataCache cache(source);
+  this->prefetch(cache);
+
+  this->stockDataSource = &cache;
+  try {
+    this->runUpdate();
+  } catch (...) {
+    this->stockDataSource = source;
+    throw;
+  }
+  this->stockDataSource = source;
+  if (this->profilingOn) this->profileCharge(this->clock, true);
+}
+
+// Simulating a fill only reads the order, the clock and the data source, and applying it only
+// touches the balance and positions - so simulating them all first and then applying them in the
+// serial path's order gives the same result.
+void SimBroker::updateOrdersParallel(const std::vector<size_t>& due) {
+  std::vector<Order> work;
+  work.reserve(due.size());
+  std::map<std::string, std::vector<size_t>> bySymbol;
+  for (size_t k = 0; k < due.size(); k++) {
+    work.push_back(this->orders[due[k]]);
+    bySymbol[work[k].symbol].push_back(k);
+  }
+
+  // Per job: bars visited, gap fill prices, data source calls if it ran on another thread (this
+  // thread's are in its own sourceCalls already). Per order: profile.
+  std::vector<std::pair<uint64_t, uint64_t>> counts(bySymbol.size());
+  std::vector<uint64_t> otherThreadCalls(bySymbol.size());
+  std::vector<ProfileCost> costs(this->profilingOn ? due.size() : 0);
+  std::thread::id caller = std::this_thread::get_id();
+
+  size_t job = 0;
+  for (auto& [symbol, ks] : bySymbol) {
+    this->fillScheduler->submit([this, &work, &ks, &counts, &otherThreadCalls, &costs, caller, job](SimBrokerScheduler::Context&) {
+      uint64_t bars = barsVisited, gaps = gapFillPrices, calls = sourceCalls;
+      for (auto k : ks) {
+        Order& o = work[k];
+        SimBrokerTracer::Span span(this->tracer, "fill", this->clock, &o.symbol, o.id);
+        uint64_t begin = this->profilingOn ? profileNow() : 0, calls = sourceCalls;
+        this->updateOrderTIF(o);
+        if (!(o.filledQty == o.qty || o.qty == 0 || o.doneFilling)) this->simulateFill(o);
+        if (this->profilingOn) costs[k] = {profileNow()-begin, sourceCalls-calls, 1};
+      }
+      counts[job] = {barsVisited-bars, gapFillPrices-gaps};
+      if (std::this_thread::get_id() != caller) otherThreadCalls[job] = sourceCalls-calls;
+    });
+    job++;
+  }
+
+  {
+    StatsTimer t(this->statsOn, this->stats.fillNs);
+    this->fillScheduler->run();
+  }
+
+  if (this->statsOn) {
+    for (auto& [bars, gaps] : counts) {
+      this->stats.barsVisited += bars;
+      this->stats.gapFillPrices += gaps;
+    }
+  }
+  for (auto calls : otherThreadCalls) this->profile.otherThreadCalls += calls;
+
+  for (size_t k = 0; k < due.size(); k++) {
+    Order& o = this->orders.mut(due[k]);
+    int64_t startQty = o.filledQty;
+    o = std::move(work[k]);
+    this->applyFill(o, startQty);
+    if (this->profilingOn) this->profileOrder(o, costs[k]);
+  }
+}
+
+void SimBroker::runUpdate() {
+  // Settled orders are left alone so their storage stays shared with any forks
+  std::vector<size_t> due;
+  for (size_t i = 0; i < this->orders.size(); i++) {
+    if (this->orderNeedsUpdate(this->orders[i])) due.push_back(i);
+  }
+
+  bool manySymbols = false;
+  for (auto i : due) {
+    if (this->orders[i].symbol != this->orders[due[0]].symbol) { manySymbols = true; break; }
+  }
+
+  if (this->statsOn) {
+    this->stats.updates++;
+    this->stats.ordersScanned += this->orders.size();
+    this->stats.ordersUpdated += due.size();
+  }
+
+  // Data that's already local (in a cache) isn't worth going parallel for
+  SimBrokerStockDataSource* source = this->stockDataSource;
+  if (auto counted = dynamic_cast<ProfiledSource*>(source)) source = counted->wrapped();
+
+  if (manySymbols && this->fillScheduler != NULL && dynamic_cast<SimBrokerDataCache*>(source) == NULL) {
+    this->updateOrdersParallel(due);
+  } else {
+    uint64_t bars = barsVisited, gaps = gapFillPrices;
+    for (auto i : due) {
+      Order& o = this->orders.mut(i);
+      SimBrokerTracer::Span span(this->tracer, "fill", this->clock, &o.symbol, o.id);
+      uint64_t begin = this->profilingOn ? profileNow() : 0, calls = sourceCalls;
+      {
+        StatsTimer t(this->statsOn, this->stats.tifNs);
+        this->updateOrderTIF(o);
+      }
+      {
+        StatsTimer t(this->statsOn, this->stats.fillNs);
+        this->updateOrderFillState(o);
+      }
+      if (this->profilingOn) this->profileOrder(o, {profileNow()-begin, sourceCalls-calls, 1});
+    }
+
+    if (this->statsOn) {
+      this->stats.barsVisited += barsVisited-bars;
+      this->stats.gapFillPrices += gapFillPrices-gaps;
+    }
   }
 
   // Send margin call if necessary
   if (this->marginEnabled && this->marginCallHandlerDefined) {
-    if (this->checkForMarginCall()) this->marginCallHandler();
+    bool call;
+    {
+      SimBrokerTracer::Span span(this->tracer, "marginCheck", this->clock);
+      StatsTimer t(this->statsOn, this->stats.marginCheckNs);
+      call = this->checkForMarginCall();
+    }
+    if (call) this->marginCallHandler();
   }
 
 	// PDT flag if necessary
-	if (this->roundTrips.size() > 3 && this->remainingDayTrades() < 0) {
+  bool pdt;
+  {
+    SimBrokerTracer::Span span(this->tracer, "pdtCheck", this->clock);
+    StatsTimer t(this->statsOn, this->stats.pdtCheckNs);
+    pdt = this->remainingDayTrades() < 0;
+  }
+	if (pdt) {
 		this->isPDT = true;
 		if (this->PDTCallHandlerDefined) this->PDTCallHandler();
 	}
@@ -423,10 +1041,91 @@ currency SimBroker::getLoan() {
 }
 
 bool SimBroker::checkForMarginCall() {
-  currency loan = this->getLoan();
+  if (!this->marginEnabled) return false;
+  if (this->statsOn) this->stats.marginChecks++;
+
+  if (this->marginScreenValid && this->marginScreenVersion == this->accountVersion) {
+    // Prices only depend on the symbol and the clock, so a clock we've already checked needs no
+    // lookups at all
+    auto& b = *this->marginBands;
+    bool inside = true;
+    if (this->marginScreenTime != this->clock && b.symbols.size() > 0) {
+      std::vector<currency> prices = this->stockDataSource->getPrices(b.symbols, this->clock);
+      for (size_t i = 0; i < prices.size(); i++) {
+        double price = prices[i].convert_to<double>();
+        if (price <= b.low[i] || price >= b.high[i]) { inside = false; break; }
+      }
+    }
+
+    if (inside) {
+      if (this->statsOn) this->stats.marginScreenHits++;
+      this->marginScreenTime = this->clock;
+      return false;
+    }
+  }
+
+  return this->fullMarginCheck();
+}
+
+bool SimBroker::fullMarginCheck() {
+  this->marginScreenValid = false;
+  auto& b = this->marginBands.mut();
+  b.symbols.clear(); b.low.clear(); b.high.clear();
+
+  // Same arithmetic as getLoan() and getEquity(), but looking each price up only once
+  std::vector<currency> prices;
+  prices.reserve(this->positions.size());
+  for (auto& p : this->positions) prices.push_back(this->stockDataSource->getPrice(p.symbol, this->clock));
+
+  currency shortPositionSaleValue = 0.0;
+  for (auto& p : this->positions) {
+    if (p.qty < 0) shortPositionSaleValue -= p.avgEntryPrice*p.qty;
+  }
+
+  currency marginLoan = -(this->balance-shortPositionSaleValue);
+  if (marginLoan < 0) marginLoan = 0;
+
+  currency loan = 0;
+  loan += marginLoan;
+  for (size_t i = 0; i < this->positions.size(); i++) {
+    if (this->positions[i].qty < 0) loan += (prices[i]*labs(this->positions[i].qty));
+  }
 
-  if (!this->marginEnabled || loan <= 0) return false;
-  return this->getEquity()/loan < this->maintenanceMarginRequirement;
+  if (loan <= 0) {
+    // No shorts and no margin loan - nothing but a balance/position change can get us a loan
+    this->marginScreenValid = true;
+    this->marginScreenVersion = this->accountVersion;
+    this->marginScreenTime = this->clock;
+    return false;
+  }
+
+  currency equity = this->balance;
+  for (size_t i = 0; i < this->positions.size(); i++) equity += this->positions[i].qty*prices[i];
+
+  if (equity/loan < this->maintenanceMarginRequirement) return true;
+
+  // We're called when equity < maintenance*loan. A price move d on a position changes that
+  // difference by qty*d for longs and by -(1+maintenance)*|qty|*d for shorts, so splitting the
+  // slack evenly between positions gives each one a price band it can't leave without us
+  // rechecking. The 0.99 leaves room for double rounding.
+  double slack = currency(equity-(this->maintenanceMarginRequirement*loan)).convert_to<double>()*0.99;
+  double maintenance = this->maintenanceMarginRequirement.convert_to<double>();
+  if (slack <= 0 || this->positions.size() == 0) return false;
+
+  for (size_t i = 0; i < this->positions.size(); i++) {
+    auto& p = this->positions[i];
+    double sensitivity = (p.qty > 0) ? p.qty : (1+maintenance)*labs(p.qty);
+    double allowance = slack/(this->positions.size()*sensitivity);
+    double price = prices[i].convert_to<double>();
+    b.symbols.push_back(p.symbol);
+    b.low.push_back(price-allowance);
+    b.high.push_back(price+allowance);
+  }
+
+  this->marginScreenValid = true;
+  this->marginScreenVersion = this->accountVersion;
+  this->marginScreenTime = this->clock;
+  return false;
 }
 
 currency SimBroker::getBalance() {
@@ -445,7 +1144,9 @@ currency SimBroker::getEquity() {
 }
 
 void SimBroker::cancelOrder(uint64_t oid) { 
-  for (auto& o : this->orders) { if (o.id == oid) { setOrderStatus(o, OrderStatus::CANCELLED, this->clock); return; } }
+  for (size_t i = 0; i < this->orders.size(); i++) {
+    if (this->orders[i].id == oid) { setOrderStatus(this->orders.mut(i), OrderStatus::CANCELLED, this->clock); return; }
+  }
   throw std::logic_error("Invalid order ID");
 }
 
@@ -503,27 +1204,20 @@ currency SimBroker::getBuyingPower() {
 }
 
 void SimBroker::addToPosition(std::string symbol, int64_t qty, currency avgPrice) {
+  if (qty != 0) this->accountVersion++;
 
   // Try to apply this to an existing position
   bool exists = false;
-  for (auto& p : this->positions) {
-    if (p.symbol == symbol) {
+  for (size_t i = 0; i < this->positions.size(); i++) {
+    if (this->positions[i].symbol == symbol) {
+      Position& p = this->positions.mut(i);
       p.avgEntryPrice = ((p.qty*p.avgEntryPrice)+(qty*avgPrice))/((p.qty+qty)*1.0);
       p.costBasis = p.avgEntryPrice*p.qty;
       p.qty += qty;
 
       if (((qty > 0 && p.lastChange < 0) || (qty < 0 && p.lastChange > 0)) &&
-          (
-						this->stockDataSource
-             ->getNextMarketPhaseChangeTo(p.lastChangeTime,
-                                          SimBrokerStockDataSource::MarketPhase::PREMARKET)
-             .time
-						 ==
-						 this->stockDataSource
-                        ->getNextMarketPhaseChangeTo(
-                          this->clock, SimBrokerStockDataSource::MarketPhase::PREMARKET)
-                        .time)) {
-        this->roundTrips.push_back(this->clock);
+          this->tradingDay(p.lastChangeTime) == this->tradingDay(this->clock)) {
+        this->recordDayTrade(this->tradingDay(this->clock));
       }
 
                         p.lastChange = qty;
@@ -550,10 +1244,8 @@ void SimBroker::addToPosition(std::string symbol, int64_t qty, currency avgPrice
   }
 
   // Remove empty positions
-  int i = 0;
-  for (auto& p : this->positions) {
-    if (p.qty == 0) this->positions.erase(this->positions.begin() + i);
-    i++;
+  for (size_t i = 0; i < this->positions.size(); i++) {
+    if (this->positions[i].qty == 0) this->positions.erase(i--);
   }
 }
 
@@ -570,44 +1262,110 @@ void SimBroker::setOrderStatus(Order& o, OrderStatus s, uint64_t time) {
 }
 
 // PDT
+int64_t SimBroker::tradingDay(uint64_t time) {
+  if (this->statsOn) this->stats.tradingDayLookups++;
+  if (time >= this->cachedDayFrom && time < this->cachedDayTo) {
+    if (this->statsOn) this->stats.tradingDayCacheHits++;
+    return this->cachedDay;
+  }
+
+  // Forks may share our index, so we extend a copy and swap it in
+  const auto& shared = *this->tradingDayStarts;
+  bool covered = shared.size() > 0 && (time >= shared.front() || this->tradingDayHistoryExhausted) && shared.back() > time;
+  if (!covered) this->tradingDayStarts = this->extendTradingDays(time);
+
+  auto& starts = *this->tradingDayStarts;
+  size_t i = std::upper_bound(starts.begin(), starts.end(), time)-starts.begin();
+  this->cachedDay = this->firstTradingDay+i-1;
+  this->cachedDayFrom = (i > 0) ? starts.at(i-1) : 0;
+  this->cachedDayTo = starts.at(i);
+
+  return this->cachedDay;
+}
+
+std::shared_ptr<const std::vector<uint64_t>> SimBroker::extendTradingDays(uint64_t time) {
+  auto grown = std::make_shared<std::vector<uint64_t>>(*this->tradingDayStarts);
+  auto& starts = *grown;
+  if (starts.size() == 0) {
+    starts.push_back(this->stockDataSource
+                     ->getNextMarketPhaseChangeTo(time, SimBrokerStockDataSource::MarketPhase::PREMARKET).time);
+  }
+
+  // Extend the index backwards until it covers time (or the data source runs out of history)
+  if (time < starts.front() && !this->tradingDayHistoryExhausted) {
+    std::vector<uint64_t> earlier;
+    uint64_t t = starts.front();
+    while (t > time) {
+      try {
+        t = this->stockDataSource
+          ->getPrevMarketPhaseChangeTo(t-1, SimBrokerStockDataSource::MarketPhase::PREMARKET).time;
+      } catch (const std::exception&) {
+        this->tradingDayHistoryExhausted = true;
+        break;
+      }
+      earlier.push_back(t);
+    }
+
+    starts.insert(starts.begin(), earlier.rbegin(), earlier.rend());
+    this->firstTradingDay -= earlier.size();
+  }
+
+  // Extend forwards until we know the start of the trading day after time
+  while (starts.back() <= time) {
+    starts.push_back(this->stockDataSource
+                     ->getNextMarketPhaseChangeTo(starts.back(), SimBrokerStockDataSource::MarketPhase::PREMARKET).time);
+  }
+
+  return grown;
+}
+
+void SimBroker::recordDayTrade(int64_t day) {
+  const int64_t n = this->dayTrades.size();
+  auto& slot = this->dayTrades.at(((day%n)+n)%n);
+  if (slot.day != day) slot = {day, 0};
+  slot.count++;
+}
+
 int8_t SimBroker::remainingDayTrades() {
-	uint64_t start = this->clock;
-	for (int16_t i = 0; i < 5; i++) {
-		start =
-			this->stockDataSource
-			->getPrevMarketPhaseChangeTo(start - 1, SimBrokerStockDataSource::MarketPhase::PREMARKET)
-			.time;
-	}
+  uint32_t total = 0;
+  for (auto& d : this->dayTrades) total += d.count;
+  if (total == 0) return 3; // No need to look at the calendar
 
-	this->roundTrips.erase(
-		std::remove_if(
-			this->roundTrips.begin(),
-			this->roundTrips.end(),
-			[&start](int64_t const &time) { return time < start; }
-			),
-		this->roundTrips.end()
-		);
+  // Day trades count if they happened within the last 5 market days
+  int64_t since = this->tradingDay(this->clock-1)-4;
 
-	return 3-this->roundTrips.size();
+  int64_t trades = 0;
+  for (auto& d : this->dayTrades) {
+    if (d.count > 0 && d.day >= since) trades += d.count;
+  }
+
+	return 3-trades;
 }
 bool SimBroker::PDT() { return this->isPDT; }
 
 void SimBroker::enableInstaFill() { this->instaFill = true; }
 void SimBroker::disableInstaFill() { this->instaFill = false; }
+void SimBroker::setFillScheduler(SimBrokerScheduler* scheduler) { this->fillScheduler = scheduler; }
+void SimBroker::setTracer(SimBrokerTracer* tracer) { this->tracer = tracer; }
+
 bool SimBroker::instaFillEnabled() { return this->instaFill; }
 void SimBroker::enableShortRoundLotFee() { this->shortRoundLotFee = true; }
 void SimBroker::disableShortRoundLotFee() { this->shortRoundLotFee = false; }
 bool SimBroker::shortRoundLotFeeEnabled() { return this->shortRoundLotFee; }
 uint64_t SimBroker::getClock() { return this->clock; }
-void SimBroker::addFunds(currency chedda) { this->balance += chedda; }
-void SimBroker::rmFunds(currency chedda) { this->balance -= chedda; }
-std::vector<SimBroker::Order> SimBroker::getOrders() { return this->orders; }
-std::vector<SimBroker::Position> SimBroker::getPositions() { return this->positions; }
+void SimBroker::addFunds(currency chedda) { this->balance += chedda; this->accountVersion++; }
+void SimBroker::rmFunds(currency chedda) { this->balance -= chedda; this->accountVersion++; }
+std::vector<SimBroker::Order> SimBroker::getOrders() { return this->orders.vector(); }
+std::vector<SimBroker::Position> SimBroker::getPositions() { return this->positions.vector(); }
 void SimBroker::setInterestRate(cpp_dec_float_100 rate) { this->interestRate = rate; }
 cpp_dec_float_100 SimBroker::getInterestRate() { return this->interestRate; }
+SimBroker::NightlyAccrual SimBroker::getLastNightlyAccrual() { return *this->lastAccrual; }
 void SimBroker::setInitialMarginRequirement(cpp_dec_float_100 req) { this->initialMarginRequirement = req; }
 cpp_dec_float_100 SimBroker::getInitialMarginRequirement() { return this->initialMarginRequirement; }
-void SimBroker::setMaintenanceMarginRequirement(cpp_dec_float_100 req) { this->maintenanceMarginRequirement = req; }
+void SimBroker::setMaintenanceMarginRequirement(cpp_dec_float_100 req) {
+  this->maintenanceMarginRequirement = req;
+  this->accountVersion++;
+}
 cpp_dec_float_100 SimBroker::getMaintenanceMarginRequirement() { return this->maintenanceMarginRequirement; }
 void SimBroker::setMarginCallHandler(std::function<void()> func) {
   this->marginCallHandler = func;
@@ -617,3 +1375,245 @@ void SimBroker::setPDTCallHandler(std::function<void()> func) {
   this->PDTCallHandler = func;
   this->PDTCallHandlerDefined = true;
 }
+
+// Checkpoints
+//
+// Layout: magic, version, then every field in a fixed order. Trivially copyable data is copied
+// as-is (host byte order), vectors/strings are prefixed with their length, and currency values are
+// written as cpp_dec_float's own digits/exponent/sign via its serialize() hook so they round trip
+// exactly.
+static const char checkpointMagic[4] = {'S', 'B', 'C', 'K'};
+static const uint32_t checkpointVersion = 1;
+
+struct SimBrokerCheckpointWriter {
+  std::string out;
+
+  template <typename T> void put(const T& v) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    this->out.append((const char*)&v, sizeof(T));
+  }
+
+  template <typename T> void put(const std::vector<T>& v) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    this->put((uint64_t)v.size());
+    this->out.append((const char*)v.data(), v.size()*sizeof(T));
+  }
+
+  void put(const std::string& v) {
+    this->put((uint64_t)v.size());
+    this->out.append(v);
+  }
+
+  void put(const cpp_dec_float_100& v) {
+    const_cast<cpp_dec_float_100&>(v).backend().serialize(*this, 0);
+  }
+
+  // Called by cpp_dec_float::serialize
+  template <typename T> SimBrokerCheckpointWriter& operator&(const boost::serialization::nvp<T>& v) {
+    this->put(v.const_value());
+    return *this;
+  }
+};
+
+struct SimBrokerCheckpointReader {
+  const std::string& in;
+  size_t pos = 0;
+
+  void need(uint64_t bytes) {
+    if (bytes > this->in.size()-this->pos) throw std::runtime_error("Truncated SimBroker checkpoint");
+  }
+
+  template <typename T> void get(T& v) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    this->need(sizeof(T));
+    memcpy(&v, this->in.data()+this->pos, sizeof(T));
+    this->pos += sizeof(T);
+  }
+
+  template <typename T> void get(std::vector<T>& v) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    uint64_t n;
+    this->get(n);
+    if (n > (this->in.size()-this->pos)/sizeof(T)) throw std::runtime_error("Truncated SimBroker checkpoint");
+    v.resize(n);
+    memcpy(v.data(), this->in.data()+this->pos, n*sizeof(T));
+    this->pos += n*sizeof(T);
+  }
+
+  void get(std::string& v) {
+    uint64_t n;
+    this->get(n);
+    this->need(n);
+    v.assign(this->in.data()+this->pos, n);
+    this->pos += n;
+  }
+
+  void get(cpp_dec_float_100& v) {
+    v.backend().serialize(*this, 0);
+  }
+
+  template <typename T> SimBrokerCheckpointReader& operator&(const boost::serialization::nvp<T>& v) {
+    this->get(v.value());
+    return *this;
+  }
+};
+
+// Field lists shared by writing and reading, so the two can't drift apart
+template <typename IO, typename O> static void checkpointOrder(IO& io, O& o) {
+  io(o.symbol); io(o.qty); io(o.type); io(o.timeInForce); io(o.limitPrice); io(o.stopPrice);
+  io(o.trailPrice); io(o.trailPercent); io(o.extendedHours); io(o.orderClass);
+
+  io(o.id); io(o.createdAt); io(o.updatedAt); io(o.submittedAt); io(o.filledAt); io(o.expiredAt);
+  io(o.canceledAt); io(o.failedAt); io(o.replacedAt); io(o.replacedBy); io(o.replaces);
+  io(o.filledQty); io(o.filledAvgPrice); io(o.status); io(o.doneFilling);
+}
+
+template <typename IO, typename P> static void checkpointPosition(IO& io, P& p) {
+  io(p.id); io(p.symbol); io(p.avgEntryPrice); io(p.qty); io(p.costBasis); io(p.createdTime);
+  io(p.lastChange); io(p.lastChangeTime);
+}
+
+std::string SimBroker::checkpoint() {
+  SimBrokerCheckpointWriter w;
+  auto io = [&w](const auto& v) { w.put(v); };
+
+  w.out.append(checkpointMagic, sizeof(checkpointMagic));
+  w.put(checkpointVersion);
+
+  io(this->clock); io(this->balance); io(this->marginEnabled); io(this->shortRoundLotFee);
+  io(this->instaFill); io(this->initialMarginRequirement); io(this->maintenanceMarginRequirement);
+  io(this->interestRate); io(this->lastInterestTime); io(this->isPDT);
+
+  w.put((uint64_t)this->orders.size());
+  for (auto& o : this->orders) {
+    checkpointOrder(io, o);
+    w.put((uint64_t)o.orderStatusHistory.size());
+    for (auto& h : o.orderStatusHistory) { io(h.status); io(h.time); }
+  }
+
+  w.put((uint64_t)this->positions.size());
+  for (auto& p : this->positions) checkpointPosition(io, p);
+
+  // Day trade numbers are relative to the trading day index, so it has to come along
+  w.put(*this->tradingDayStarts);
+  io(this->firstTradingDay); io(this->tradingDayHistoryExhausted);
+  for (auto& d : this->dayTrades) { io(d.day); io(d.count); }
+
+  auto& a = *this->lastAccrual;
+  io(a.time); io(a.interest);
+  w.put((uint64_t)a.symbols.size());
+  for (size_t i = 0; i < a.symbols.size(); i++) {
+    io(a.symbols[i]); io(a.qtys[i]); io(a.prices[i]); io(a.rates[i]); io(a.fees[i]);
+  }
+
+  return w.out;
+}
+
+void SimBroker::restore(const std::string& checkpoint) {
+  SimBrokerCheckpointReader r{checkpoint};
+  auto io = [&r](auto& v) { r.get(v); };
+
+  char magic[sizeof(checkpointMagic)];
+  uint32_t version;
+  r.need(sizeof(magic));
+  memcpy(magic, checkpoint.data(), sizeof(magic));
+  r.pos += sizeof(magic);
+  if (memcmp(magic, checkpointMagic, sizeof(magic)) != 0) throw std::runtime_error("Not a SimBroker checkpoint");
+  r.get(version);
+  if (version != checkpointVersion)
+    throw std::runtime_error("Unsupported SimBroker checkpoint version "+std::to_string(version));
+
+  // Read into a scratch broker so a bad checkpoint leaves us untouched
+  SimBroker b(this->stockDataSource, 0, false);
+  io(b.clock); io(b.balance); io(b.marginEnabled); io(b.shortRoundLotFee);
+  io(b.instaFill); io(b.initialMarginRequirement); io(b.maintenanceMarginRequirement);
+  io(b.interestRate); io(b.lastInterestTime); io(b.isPDT);
+
+  uint64_t n;
+  r.get(n);
+  for (uint64_t i = 0; i < n; i++) {
+    Order o = {};
+    checkpointOrder(io, o);
+
+    uint64_t h;
+    r.get(h);
+    r.need(h); // Cheap sanity check before we allocate
+    o.orderStatusHistory.resize(h);
+    for (auto& e : o.orderStatusHistory) { io(e.status); io(e.time); }
+    b.orders.push_back(o);
+  }
+
+  r.get(n);
+  for (uint64_t i = 0; i < n; i++) {
+    Position p = {};
+    checkpointPosition(io, p);
+    b.positions.push_back(p);
+  }
+
+  std::vector<uint64_t> starts;
+  r.get(starts);
+  b.tradingDayStarts = std::make_shared<std::vector<uint64_t>>(std::move(starts));
+  io(b.firstTradingDay); io(b.tradingDayHistoryExhausted);
+  for (auto& d : b.dayTrades) { io(d.day); io(d.count); }
+
+  auto& a = b.lastAccrual.mut();
+  io(a.time); io(a.interest);
+  r.get(n);
+  r.need(n);
+  a.symbols.resize(n); a.qtys.resize(n); a.prices.resize(n); a.rates.resize(n); a.fees.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    io(a.symbols[i]); io(a.qtys[i]); io(a.prices[i]); io(a.rates[i]); io(a.fees[i]);
+  }
+
+  if (r.pos != checkpoint.size()) throw std::runtime_error("Trailing data in SimBroker checkpoint");
+
+  // Keep our handlers and checkpoint settings, everything else comes from the checkpoint
+  b.marginCallHandler = this->marginCallHandler;
+  b.marginCallHandlerDefined = this->marginCallHandlerDefined;
+  b.PDTCallHandler = this->PDTCallHandler;
+  b.PDTCallHandlerDefined = this->PDTCallHandlerDefined;
+  b.autoCheckpointPath = this->autoCheckpointPath;
+  b.autoCheckpointDays = this->autoCheckpointDays;
+  b.lastCheckpointTime = b.clock;
+  b.fillScheduler = this->fillScheduler;
+  b.tracer = this->tracer;
+  b.statsOn = this->statsOn;
+  b.stats = this->stats;
+  b.profilingOn = this->profilingOn;
+  b.profile = this->profile;
+  *this = b;
+}
+
+void SimBroker::saveCheckpoint(std::string path) {
+  std::string data = this->checkpoint();
+  std::string tmp = path+".tmp";
+
+  FILE* f = fopen(tmp.c_str(), "wb");
+  if (f == NULL) throw std::runtime_error("Failed to open "+tmp+" for writing");
+  bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) throw std::runtime_error("Failed to write checkpoint "+path);
+}
+
+void SimBroker::loadCheckpoint(std::string path) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (f == NULL) throw std::runtime_error("Failed to open checkpoint "+path);
+
+  std::string data;
+  char buf[65536];
+  size_t got;
+  while ((got = fread(buf, 1, sizeof(buf), f)) > 0) data.append(buf, got);
+  fclose(f);
+
+  this->restore(data);
+}
+
+void SimBroker::setAutoCheckpoint(std::string path, uint32_t days) {
+  this->autoCheckpointPath = path;
+  this->autoCheckpointDays = days;
+  this->lastCheckpointTime = this->clock;
+}
+
+bool SimBroker::autoCheckpointDue(uint64_t time) {
+  return this->autoCheckpointDays > 0 && time >= this->lastCheckpointTime+(this->autoCheckpointDays*86400ull);
+}
@@ -0,0 +1,108 @@
+#include "simBrokerAsyncDataSource.hpp"
+
+SimBrokerThreadedAsyncDataSource::SimBrokerThreadedAsyncDataSource(SimBrokerStockDataSource* source, unsigned threads) :
+  source(source)
+{
+  if (threads == 0) threads = 1;
+  for (unsigned i = 0; i < threads; i++) this->threads.emplace_back([this] { this->worker(); });
+};
+
+SimBrokerThreadedAsyncDataSource::~SimBrokerThreadedAsyncDataSource() {
+  {
+    std::lock_guard<std::mutex> lock(this->lock);
+    this->stopping = true;
+  }
+  this->cv.notify_all();
+  for (auto& t : this->threads) t.join();
+}
+
+void SimBrokerThreadedAsyncDataSource::submit(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(this->lock);
+    this->jobs.push_back(std::move(job));
+  }
+  this->cv.notify_one();
+}
+
+// Runs jobs until we're destroyed, finishing whatever is queued first
+void SimBrokerThreadedAsyncDataSource::worker() {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(this->lock);
+      this->cv.wait(lock, [this] { return this->stopping || !this->jobs.empty(); });
+      if (this->jobs.empty()) return;
+      job = std::move(this->jobs.front());
+      this->jobs.pop_front();
+    }
+    job();
+  }
+}
+
+SimBrokerRequest<std::vector<SimBrokerStockDataSource::Bar>> SimBrokerThreadedAsyncDataSource::requestMinuteBars(std::string ticker, uint64_t startTime, uint64_t endTime) {
+  SimBrokerRequest<std::vector<Bar>> r;
+  this->submit([this, r, ticker, startTime, endTime]() mutable {
+    try {
+      r.complete(this->source->getMinuteBars(ticker, startTime, endTime));
+    } catch (...) {
+      r.fail(std::current_exception());
+    }
+  });
+  return r;
+}
+
+SimBrokerRequest<currency> SimBrokerThreadedAsyncDataSource::requestPrice(std::string ticker, uint64_t time) {
+  SimBrokerRequest<currency> r;
+  this->submit([this, r, ticker, time]() mutable {
+    try {
+      r.complete(this->source->getPrice(ticker, time));
+    } catch (...) {
+      r.fail(std::current_exception());
+    }
+  });
+  return r;
+}
+
+cpp_dec_float_100 SimBrokerThreadedAsyncDataSource::getAssetBorrowRate(std::string ticker, uint64_t time) {
+  return this->source->getAssetBorrowRate(ticker, time);
+}
+
+SimBrokerStockDataSource::MarketPhase SimBrokerThreadedAsyncDataSource::getMarketPhase(uint64_t time) {
+  return this->source->getMarketPhase(time);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerThreadedAsyncDataSource::getNextMarketPhaseChange(uint64_t time) {
+  return this->source->getNextMarketPhaseChange(time);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerThreadedAsyncDataSource::getPrevMarketPhaseChange(uint64_t time) {
+  return this->source->getPrevMarketPhaseChange(time);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerThreadedAsyncDataSource::getNextMarketPhaseChangeTo(uint64_t time, MarketPhase to) {
+  return this->source->getNextMarketPhaseChangeTo(time, to);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerThreadedAsyncDataSource::getPrevMarketPhaseChangeTo(uint64_t time, MarketPhase to) {
+  return this->source->getPrevMarketPhaseChangeTo(time, to);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerThreadedAsyncDataSource::getNextMarketPhaseChangeFrom(uint64_t time, MarketPhase from) {
+  return this->source->getNextMarketPhaseChangeFrom(time, from);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerThreadedAsyncDataSource::getPrevMarketPhaseChangeFrom(uint64_t time, MarketPhase from) {
+  return this->source->getPrevMarketPhaseChangeFrom(time, from);
+}
+
+bool SimBrokerThreadedAsyncDataSource::isTickerMarginable(std::string ticker, uint64_t time) {
+  return this->source->isTickerMarginable(ticker, time);
+}
+
+bool SimBrokerThreadedAsyncDataSource::isTickerETB(std::string ticker, uint64_t time) {
+  return this->source->isTickerETB(ticker, time);
+}
+
+bool SimBrokerThreadedAsyncDataSource::isTickerShortable(std::string ticker, uint64_t time) {
+  return this->source->isTickerShortable(ticker, time);
+}
@@ -0,0 +1,110 @@
+#include "simBrokerDataCache.hpp"
+#include <algorithm>
+
+SimBrokerDataCache::SimBrokerDataCache(SimBrokerStockDataSource* source) : source(source) {};
+
+void SimBrokerDataCache::setBars(std::string ticker, uint64_t startTime, uint64_t endTime, std::vector<Bar> bars) {
+  this->blocks[ticker] = {startTime, endTime, std::move(bars)};
+  this->stats.barBlocksFetched++;
+}
+
+void SimBrokerDataCache::setPrice(std::string ticker, uint64_t time, currency price) {
+  this->prices[std::pair(ticker, time)] = price;
+  this->stats.pricesFetched++;
+}
+
+void SimBrokerDataCache::clear() {
+  this->blocks.clear();
+  this->prices.clear();
+}
+
+std::vector<SimBrokerStockDataSource::Bar> SimBrokerDataCache::getMinuteBars(std::string ticker, uint64_t startTime, uint64_t endTime) {
+  this->stats.barRequests++;
+
+  auto it = this->blocks.find(ticker);
+  if (it == this->blocks.end() || startTime < it->second.start || endTime > it->second.end || endTime < 60) {
+    this->stats.barBlocksFetched++;
+    return this->source->getMinuteBars(ticker, startTime, endTime);
+  }
+
+  auto& bars = it->second.bars;
+  auto first = std::lower_bound(bars.begin(), bars.end(), startTime, [](const Bar& b, uint64_t t) { return b.time < t; });
+  auto last = std::lower_bound(first, bars.end(), endTime-60, [](const Bar& b, uint64_t t) { return b.time < t; });
+  return std::vector<Bar>(first, last);
+}
+
+currency SimBrokerDataCache::getPrice(std::string ticker, uint64_t time) {
+  this->stats.priceRequests++;
+
+  auto key = std::pair(ticker, time);
+  auto it = this->prices.find(key);
+  if (it != this->prices.end()) return it->second;
+
+  this->stats.pricesFetched++;
+  currency price = this->source->getPrice(ticker, time);
+  this->prices[key] = price;
+  return price;
+}
+
+SimBrokerStockDataSource::MarketPhase SimBrokerDataCache::getMarketPhase(uint64_t time) {
+  this->stats.phaseRequests++;
+  if (time > this->phaseFrom && time < this->phaseTo) return this->phase;
+
+  this->stats.phasesFetched++;
+  MarketPhase phase = this->source->getMarketPhase(time);
+
+  // Remember the phase for everything strictly between the surrounding phase changes. The
+  // changes themselves are always passed through, as sources may disagree with themselves about
+  // exactly which phase a boundary second belongs to.
+  try {
+    uint64_t from = this->source->getPrevMarketPhaseChange(time).time;
+    uint64_t to = this->source->getNextMarketPhaseChange(time).time;
+    if (time > from) {
+      this->phaseFrom = from;
+      this->phaseTo = to;
+      this->phase = phase;
+    }
+  } catch (const std::exception&) {}
+
+  return phase;
+}
+
+cpp_dec_float_100 SimBrokerDataCache::getAssetBorrowRate(std::string ticker, uint64_t time) {
+  return this->source->getAssetBorrowRate(ticker, time);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerDataCache::getNextMarketPhaseChange(uint64_t time) {
+  return this->source->getNextMarketPhaseChange(time);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerDataCache::getPrevMarketPhaseChange(uint64_t time) {
+  return this->source->getPrevMarketPhaseChange(time);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerDataCache::getNextMarketPhaseChangeTo(uint64_t time, MarketPhase to) {
+  return this->source->getNextMarketPhaseChangeTo(time, to);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerDataCache::getPrevMarketPhaseChangeTo(uint64_t time, MarketPhase to) {
+  return this->source->getPrevMarketPhaseChangeTo(time, to);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerDataCache::getNextMarketPhaseChangeFrom(uint64_t time, MarketPhase from) {
+  return this->source->getNextMarketPhaseChangeFrom(time, from);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerDataCache::getPrevMarketPhaseChangeFrom(uint64_t time, MarketPhase from) {
+  return this->source->getPrevMarketPhaseChangeFrom(time, from);
+}
+
+bool SimBrokerDataCache::isTickerMarginable(std::string ticker, uint64_t time) {
+  return this->source->isTickerMarginable(ticker, time);
+}
+
+bool SimBrokerDataCache::isTickerETB(std::string ticker, uint64_t time) {
+  return this->source->isTickerETB(ticker, time);
+}
+
+bool SimBrokerDataCache::isTickerShortable(std::string ticker, uint64_t time) {
+  return this->source->isTickerShortable(ticker, time);
+}
@@ -0,0 +1,90 @@
+#include "simBrokerForwardingDataSource.hpp"
+
+SimBrokerForwardingDataSource::SimBrokerForwardingDataSource(SimBrokerStockDataSource* source) : source(source) {};
+
+std::vector<SimBrokerStockDataSource::Bar> SimBrokerForwardingDataSource::getMinuteBars(std::string ticker, uint64_t startTime, uint64_t endTime) {
+  this->called();
+  return this->source->getMinuteBars(this->ticker(ticker), startTime, endTime);
+}
+
+currency SimBrokerForwardingDataSource::getPrice(std::string ticker, uint64_t time) {
+  this->called();
+  return this->source->getPrice(this->ticker(ticker), time);
+}
+
+cpp_dec_float_100 SimBrokerForwardingDataSource::getAssetBorrowRate(std::string ticker, uint64_t time) {
+  this->called();
+  return this->source->getAssetBorrowRate(this->ticker(ticker), time);
+}
+
+SimBrokerStockDataSource::MarketPhase SimBrokerForwardingDataSource::getMarketPhase(uint64_t time) {
+  this->called();
+  return this->source->getMarketPhase(time);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerForwardingDataSource::getNextMarketPhaseChange(uint64_t time) {
+  this->called();
+  return this->source->getNextMarketPhaseChange(time);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerForwardingDataSource::getPrevMarketPhaseChange(uint64_t time) {
+  this->called();
+  return this->source->getPrevMarketPhaseChange(time);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerForwardingDataSource::getNextMarketPhaseChangeTo(uint64_t time, MarketPhase to) {
+  this->called();
+  return this->source->getNextMarketPhaseChangeTo(time, to);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerForwardingDataSource::getPrevMarketPhaseChangeTo(uint64_t time, MarketPhase to) {
+  this->called();
+  return this->source->getPrevMarketPhaseChangeTo(time, to);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerForwardingDataSource::getNextMarketPhaseChangeFrom(uint64_t time, MarketPhase from) {
+  this->called();
+  return this->source->getNextMarketPhaseChangeFrom(time, from);
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerForwardingDataSource::getPrevMarketPhaseChangeFrom(uint64_t time, MarketPhase from) {
+  this->called();
+  return this->source->getPrevMarketPhaseChangeFrom(time, from);
+}
+
+bool SimBrokerForwardingDataSource::isTickerMarginable(std::string ticker, uint64_t time) {
+  this->called();
+  return this->source->isTickerMarginable(this->ticker(ticker), time);
+}
+
+bool SimBrokerForwardingDataSource::isTickerETB(std::string ticker, uint64_t time) {
+  this->called();
+  return this->source->isTickerETB(this->ticker(ticker), time);
+}
+
+bool SimBrokerForwardingDataSource::isTickerShortable(std::string ticker, uint64_t time) {
+  this->called();
+  return this->source->isTickerShortable(this->ticker(ticker), time);
+}
+
+std::vector<currency> SimBrokerForwardingDataSource::getPriceSeries(std::string ticker, std::vector<uint64_t> times) {
+  this->called();
+  return this->source->getPriceSeries(this->ticker(ticker), std::move(times));
+}
+
+std::vector<cpp_dec_float_100> SimBrokerForwardingDataSource::getAssetBorrowRateSeries(std::string ticker, std::vector<uint64_t> times) {
+  this->called();
+  return this->source->getAssetBorrowRateSeries(this->ticker(ticker), std::move(times));
+}
+
+std::vector<currency> SimBrokerForwardingDataSource::getPrices(std::vector<std::string> tickers, uint64_t time) {
+  this->called();
+  for (auto& t : tickers) t = this->ticker(t);
+  return this->source->getPrices(std::move(tickers), time);
+}
+
+std::vector<cpp_dec_float_100> SimBrokerForwardingDataSource::getAssetBorrowRates(std::vector<std::string> tickers, uint64_t time) {
+  this->called();
+  for (auto& t : tickers) t = this->ticker(t);
+  return this->source->getAssetBorrowRates(std::move(tickers), time);
+}
@@ -0,0 +1,58 @@
+#include "simBrokerGroup.hpp"
+#include <stdexcept>
+#include <algorithm>
+
+SimBrokerGroup::SimBrokerGroup(SimBrokerStockDataSource* dataSource, uint64_t startTime, bool margin, size_t accounts) :
+  stockDataSource(dataSource),
+  shared(std::make_unique<SimBrokerDataCache>(dataSource)),
+  clock(startTime)
+{
+  this->accounts.reserve(accounts);
+  for (size_t i = 0; i < accounts; i++) this->accounts.emplace_back(this->shared.get(), startTime, margin);
+};
+
+size_t SimBrokerGroup::size() { return this->accounts.size(); }
+SimBroker& SimBrokerGroup::account(size_t i) { return this->accounts.at(i); }
+uint64_t SimBrokerGroup::getClock() { return this->clock; }
+SimBrokerGroup::Stats SimBrokerGroup::getStats() { return this->shared->stats; }
+
+void SimBrokerGroup::updateClock(uint64_t time) {
+  if (time < this->clock) throw std::logic_error("SimBrokerGroup instructed to travel back in time (this is not possible).");
+
+  // One block per symbol, from the earliest bar any account's live orders will look at up to
+  // the new clock
+  std::map<std::string, uint64_t> starts;
+  for (auto& a : this->accounts) a.neededBars(starts);
+
+  // SimBroker never asks for bars past this point (see SimBroker::eachBarChunk)
+  uint64_t end = ((time/60)*60)+60;
+  for (auto& [ticker, start] : starts) {
+    this->shared->setBars(ticker, start, end, this->stockDataSource->getMinuteBars(ticker, start, end));
+  }
+
+  try {
+    for (auto& a : this->accounts) a.updateClock(time);
+  } catch (...) {
+    this->shared->clear();
+    throw;
+  }
+  this->shared->clear();
+
+  this->clock = time;
+}
+
+std::vector<currency> SimBrokerGroup::getBalances() {
+  std::vector<currency> r;
+  r.reserve(this->accounts.size());
+  for (auto& a : this->accounts) r.push_back(a.getBalance());
+  return r;
+}
+
+std::vector<currency> SimBrokerGroup::getEquities() {
+  // Every account prices its positions at the same clock, so the lookups are shared for this call
+  std::vector<currency> r;
+  r.reserve(this->accounts.size());
+  for (auto& a : this->accounts) r.push_back(a.getEquity());
+  this->shared->clear();
+  return r;
+}
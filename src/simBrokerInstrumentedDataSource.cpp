@@ -0,0 +1,232 @@
+#include "simBrokerInstrumentedDataSource.hpp"
+#include <chrono>
+#include <cstdio>
+#include <bit>
+#include <algorithm>
+
+const char* SimBrokerInstrumentedDataSource::methodName(Method m) {
+  switch (m) {
+    case GET_MINUTE_BARS:                   return "getMinuteBars";
+    case GET_PRICE:                         return "getPrice";
+    case GET_ASSET_BORROW_RATE:             return "getAssetBorrowRate";
+    case GET_MARKET_PHASE:                  return "getMarketPhase";
+    case GET_NEXT_MARKET_PHASE_CHANGE:      return "getNextMarketPhaseChange";
+    case GET_PREV_MARKET_PHASE_CHANGE:      return "getPrevMarketPhaseChange";
+    case GET_NEXT_MARKET_PHASE_CHANGE_TO:   return "getNextMarketPhaseChangeTo";
+    case GET_PREV_MARKET_PHASE_CHANGE_TO:   return "getPrevMarketPhaseChangeTo";
+    case GET_NEXT_MARKET_PHASE_CHANGE_FROM: return "getNextMarketPhaseChangeFrom";
+    case GET_PREV_MARKET_PHASE_CHANGE_FROM: return "getPrevMarketPhaseChangeFrom";
+    case IS_TICKER_MARGINABLE:              return "isTickerMarginable";
+    case IS_TICKER_ETB:                     return "isTickerETB";
+    case IS_TICKER_SHORTABLE:               return "isTickerShortable";
+    case GET_PRICE_SERIES:                  return "getPriceSeries";
+    case GET_ASSET_BORROW_RATE_SERIES:      return "getAssetBorrowRateSeries";
+    case GET_PRICES:                        return "getPrices";
+    case GET_ASSET_BORROW_RATES:            return "getAssetBorrowRates";
+    default:                                return "unknown";
+  }
+}
+
+// Histogram
+//
+// Values below subBuckets get a bucket each. Above that, a value with its highest bit at position
+// e lands in the sub-bucket given by the next 3 bits down.
+int SimBrokerInstrumentedDataSource::Histogram::bucket(uint64_t ns) {
+  if (ns < subBuckets) return ns;
+  int e = std::bit_width(ns)-1; // >= 3
+  int sub = (ns >> (e-3)) & (subBuckets-1);
+  return (e-2)*subBuckets+sub;
+}
+
+uint64_t SimBrokerInstrumentedDataSource::Histogram::bucketTop(int b) {
+  if (b < subBuckets) return b;
+  int e = b/subBuckets+2;
+  uint64_t sub = b%subBuckets;
+  uint64_t low = (uint64_t(subBuckets)+sub) << (e-3);
+  return low+(uint64_t(1) << (e-3))-1;
+}
+
+void SimBrokerInstrumentedDataSource::Histogram::record(uint64_t ns) {
+  this->counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+  this->sum.fetch_add(ns, std::memory_order_relaxed);
+
+  uint64_t prev = this->maximum.load(std::memory_order_relaxed);
+  while (ns > prev && !this->maximum.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+}
+
+uint64_t SimBrokerInstrumentedDataSource::Histogram::count() const {
+  uint64_t n = 0;
+  for (auto& c : this->counts) n += c.load(std::memory_order_relaxed);
+  return n;
+}
+
+uint64_t SimBrokerInstrumentedDataSource::Histogram::total() const { return this->sum.load(std::memory_order_relaxed); }
+uint64_t SimBrokerInstrumentedDataSource::Histogram::max() const { return this->maximum.load(std::memory_order_relaxed); }
+
+uint64_t SimBrokerInstrumentedDataSource::Histogram::percentile(double p) const {
+  uint64_t n = this->count();
+  if (n == 0) return 0;
+
+  uint64_t target = (uint64_t)((p/100.0)*n);
+  if (target >= n) target = n-1;
+
+  uint64_t seen = 0;
+  for (int b = 0; b < buckets; b++) {
+    seen += this->counts[b].load(std::memory_order_relaxed);
+    if (seen > target) return std::min(bucketTop(b), this->max());
+  }
+  return this->max();
+}
+
+void SimBrokerInstrumentedDataSource::Histogram::reset() {
+  for (auto& c : this->counts) c = 0;
+  this->sum = 0;
+  this->maximum = 0;
+}
+
+// Data source
+
+SimBrokerInstrumentedDataSource::SimBrokerInstrumentedDataSource(SimBrokerStockDataSource* source) : source(source) {};
+
+uint64_t SimBrokerInstrumentedDataSource::getCalls(Method m) { return this->calls[m].load(std::memory_order_relaxed); }
+const SimBrokerInstrumentedDataSource::Histogram& SimBrokerInstrumentedDataSource::getLatency(Method m) { return this->latency[m]; }
+
+std::map<std::string, uint64_t> SimBrokerInstrumentedDataSource::getTickerCalls() {
+  std::lock_guard<std::mutex> lock(this->tickerLock);
+  return std::map<std::string, uint64_t>(this->tickerCalls.begin(), this->tickerCalls.end());
+}
+
+void SimBrokerInstrumentedDataSource::setTracer(SimBrokerTracer* tracer) { this->tracer = tracer; }
+
+void SimBrokerInstrumentedDataSource::reset() {
+  for (int m = 0; m < METHOD_COUNT; m++) {
+    this->calls[m] = 0;
+    this->latency[m].reset();
+  }
+
+  std::lock_guard<std::mutex> lock(this->tickerLock);
+  this->tickerCalls.clear();
+}
+
+std::string SimBrokerInstrumentedDataSource::report() {
+  std::string r;
+  char line[256];
+
+  uint64_t totalNs = 0;
+  for (int m = 0; m < METHOD_COUNT; m++) totalNs += this->latency[m].total();
+
+  snprintf(line, sizeof(line), "%-30s %12s %12s %7s %10s %10s %10s %10s\n",
+           "method", "calls", "total ms", "share", "p50 ns", "p90 ns", "p99 ns", "max ns");
+  r += line;
+  for (int m = 0; m < METHOD_COUNT; m++) {
+    auto& h = this->latency[m];
+    uint64_t n = this->getCalls((Method)m);
+    if (n == 0) continue;
+
+    snprintf(line, sizeof(line), "%-30s %12lu %12.3f %6.1f%% %10lu %10lu %10lu %10lu\n",
+             methodName((Method)m), n, h.total()/1e6, totalNs > 0 ? (100.0*h.total())/totalNs : 0.0,
+             h.percentile(50), h.percentile(90), h.percentile(99), h.max());
+    r += line;
+  }
+
+  auto tickers = this->getTickerCalls();
+  if (tickers.size() > 0) {
+    snprintf(line, sizeof(line), "\n%-30s %12s\n", "ticker", "calls");
+    r += line;
+    for (auto& [ticker, n] : tickers) {
+      snprintf(line, sizeof(line), "%-30s %12lu\n", ticker.c_str(), n);
+      r += line;
+    }
+  }
+
+  return r;
+}
+
+void SimBrokerInstrumentedDataSource::countTicker(const std::string& ticker) {
+  std::lock_guard<std::mutex> lock(this->tickerLock);
+  this->tickerCalls[ticker]++;
+}
+
+template <typename F>
+auto SimBrokerInstrumentedDataSource::timed(Method m, const std::string* ticker, const std::vector<std::string>* tickers, F f) -> decltype(f()) {
+  this->calls[m].fetch_add(1, std::memory_order_relaxed);
+  if (ticker) this->countTicker(*ticker);
+  if (tickers) for (auto& t : *tickers) this->countTicker(t);
+
+  struct Record {
+    Histogram& h;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    ~Record() { h.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-begin).count()); }
+  } record{this->latency[m]};
+  SimBrokerTracer::Span span(this->tracer, methodName(m), 0, ticker);
+
+  return f();
+}
+
+std::vector<SimBrokerStockDataSource::Bar> SimBrokerInstrumentedDataSource::getMinuteBars(std::string ticker, uint64_t startTime, uint64_t endTime) {
+  return this->timed(GET_MINUTE_BARS, &ticker, NULL, [&]() { return this->source->getMinuteBars(ticker, startTime, endTime); });
+}
+
+currency SimBrokerInstrumentedDataSource::getPrice(std::string ticker, uint64_t time) {
+  return this->timed(GET_PRICE, &ticker, NULL, [&]() { return this->source->getPrice(ticker, time); });
+}
+
+cpp_dec_float_100 SimBrokerInstrumentedDataSource::getAssetBorrowRate(std::string ticker, uint64_t time) {
+  return this->timed(GET_ASSET_BORROW_RATE, &ticker, NULL, [&]() { return this->source->getAssetBorrowRate(ticker, time); });
+}
+
+SimBrokerStockDataSource::MarketPhase SimBrokerInstrumentedDataSource::getMarketPhase(uint64_t time) {
+  return this->timed(GET_MARKET_PHASE, NULL, NULL, [&]() { return this->source->getMarketPhase(time); });
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerInstrumentedDataSource::getNextMarketPhaseChange(uint64_t time) {
+  return this->timed(GET_NEXT_MARKET_PHASE_CHANGE, NULL, NULL, [&]() { return this->source->getNextMarketPhaseChange(time); });
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerInstrumentedDataSource::getPrevMarketPhaseChange(uint64_t time) {
+  return this->timed(GET_PREV_MARKET_PHASE_CHANGE, NULL, NULL, [&]() { return this->source->getPrevMarketPhaseChange(time); });
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerInstrumentedDataSource::getNextMarketPhaseChangeTo(uint64_t time, MarketPhase to) {
+  return this->timed(GET_NEXT_MARKET_PHASE_CHANGE_TO, NULL, NULL, [&]() { return this->source->getNextMarketPhaseChangeTo(time, to); });
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerInstrumentedDataSource::getPrevMarketPhaseChangeTo(uint64_t time, MarketPhase to) {
+  return this->timed(GET_PREV_MARKET_PHASE_CHANGE_TO, NULL, NULL, [&]() { return this->source->getPrevMarketPhaseChangeTo(time, to); });
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerInstrumentedDataSource::getNextMarketPhaseChangeFrom(uint64_t time, MarketPhase from) {
+  return this->timed(GET_NEXT_MARKET_PHASE_CHANGE_FROM, NULL, NULL, [&]() { return this->source->getNextMarketPhaseChangeFrom(time, from); });
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerInstrumentedDataSource::getPrevMarketPhaseChangeFrom(uint64_t time, MarketPhase from) {
+  return this->timed(GET_PREV_MARKET_PHASE_CHANGE_FROM, NULL, NULL, [&]() { return this->source->getPrevMarketPhaseChangeFrom(time, from); });
+}
+
+bool SimBrokerInstrumentedDataSource::isTickerMarginable(std::string ticker, uint64_t time) {
+  return this->timed(IS_TICKER_MARGINABLE, &ticker, NULL, [&]() { return this->source->isTickerMarginable(ticker, time); });
+}
+
+bool SimBrokerInstrumentedDataSource::isTickerETB(std::string ticker, uint64_t time) {
+  return this->timed(IS_TICKER_ETB, &ticker, NULL, [&]() { return this->source->isTickerETB(ticker, time); });
+}
+
+bool SimBrokerInstrumentedDataSource::isTickerShortable(std::string ticker, uint64_t time) {
+  return this->timed(IS_TICKER_SHORTABLE, &ticker, NULL, [&]() { return this->source->isTickerShortable(ticker, time); });
+}
+
+std::vector<currency> SimBrokerInstrumentedDataSource::getPriceSeries(std::string ticker, std::vector<uint64_t> times) {
+  return this->timed(GET_PRICE_SERIES, &ticker, NULL, [&]() { return this->source->getPriceSeries(ticker, times); });
+}
+
+std::vector<cpp_dec_float_100> SimBrokerInstrumentedDataSource::getAssetBorrowRateSeries(std::string ticker, std::vector<uint64_t> times) {
+  return this->timed(GET_ASSET_BORROW_RATE_SERIES, &ticker, NULL, [&]() { return this->source->getAssetBorrowRateSeries(ticker, times); });
+}
+
+std::vector<currency> SimBrokerInstrumentedDataSource::getPrices(std::vector<std::string> tickers, uint64_t time) {
+  return this->timed(GET_PRICES, NULL, &tickers, [&]() { return this->source->getPrices(tickers, time); });
+}
+
+std::vector<cpp_dec_float_100> SimBrokerInstrumentedDataSource::getAssetBorrowRates(std::vector<std::string> tickers, uint64_t time) {
+  return this->timed(GET_ASSET_BORROW_RATES, NULL, &tickers, [&]() { return this->source->getAssetBorrowRates(tickers, time); });
+}
@@ -0,0 +1,279 @@
+#include "simBrokerMemoryDataSource.hpp"
+#include <stdexcept>
+#include <algorithm>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+
+// Same phase boundaries as the reference data source
+static const uint64_t premarketLength = 5.5*3600;
+static const uint64_t postmarketLength = 4*3600;
+
+SimBrokerMemoryDataSource::SimBrokerMemoryDataSource() {};
+
+void SimBrokerMemoryDataSource::checkNotFrozen() {
+  if (this->isFrozen) throw std::logic_error("SimBrokerMemoryDataSource can't be changed once frozen");
+}
+
+void SimBrokerMemoryDataSource::addBar(std::string ticker, Bar bar) {
+  this->checkNotFrozen();
+  this->tickers[ticker];
+  this->loadingBars[ticker].push_back({
+    bar.time,
+    bar.openPrice.convert_to<double>(),
+    bar.closePrice.convert_to<double>(),
+    bar.highPrice.convert_to<double>(),
+    bar.lowPrice.convert_to<double>(),
+    bar.volume
+  });
+}
+
+void SimBrokerMemoryDataSource::addCalendarDay(uint64_t open, uint64_t close) {
+  this->checkNotFrozen();
+  this->calendar.push_back(std::pair(open, close));
+}
+
+void SimBrokerMemoryDataSource::setAssetBorrowRate(std::string ticker, cpp_dec_float_100 rate) {
+  this->checkNotFrozen();
+  this->tickers[ticker].borrowRate = rate;
+}
+
+void SimBrokerMemoryDataSource::setTickerFlags(std::string ticker, bool marginable, bool ETB, bool shortable) {
+  this->checkNotFrozen();
+  auto& t = this->tickers[ticker];
+  t.marginable = marginable;
+  t.ETB = ETB;
+  t.shortable = shortable;
+}
+
+static void eachLine(std::string path, std::function<void(char* line)> func) {
+  FILE* f = fopen(path.c_str(), "r");
+  if (f == NULL) throw std::runtime_error("Failed to open "+path);
+
+  char line[1024];
+  while (fgets(line, sizeof(line), f) != NULL) func(line);
+  fclose(f);
+}
+
+void SimBrokerMemoryDataSource::loadBarsFile(std::string path) {
+  this->checkNotFrozen();
+
+  eachLine(path, [this](char* line) {
+    char* comma = strchr(line, ',');
+    char* colon = strchr(line, ':');
+    if (comma == NULL || colon == NULL || colon < comma) return;
+    if (std::string(comma+1, colon) != "1Min") return;
+
+    std::string ticker(line, comma);
+    char* p = colon+1;
+    PackedBar b;
+    b.time       = strtoull(p, &p, 10); p++;
+    b.openPrice  = strtod(p, &p); p++;
+    b.closePrice = strtod(p, &p); p++;
+    b.highPrice  = strtod(p, &p); p++;
+    b.lowPrice   = strtod(p, &p); p++;
+    b.volume     = strtod(p, &p);
+
+    this->tickers[ticker];
+    this->loadingBars[ticker].push_back(b);
+  });
+}
+
+void SimBrokerMemoryDataSource::loadCalendarFile(std::string path) {
+  this->checkNotFrozen();
+
+  eachLine(path, [this](char* line) {
+    char* p = line;
+    uint64_t open = strtoull(p, &p, 10);
+    if (*p != ',') return;
+    uint64_t close = strtoull(p+1, NULL, 10);
+    this->calendar.push_back(std::pair(open, close));
+  });
+}
+
+void SimBrokerMemoryDataSource::freeze() {
+  this->checkNotFrozen();
+
+  // Flatten bars into one array, sorted by time within each ticker
+  uint64_t total = 0;
+  for (auto& [ticker, bars] : this->loadingBars) total += bars.size();
+
+  // The array goes in a shared mapping so processes forked from here on read the one physical copy
+  // (a private mapping would get duplicated page by page as either side touched it)
+  size_t bytes = std::max<size_t>(total*sizeof(PackedBar), 1);
+  void* mem = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) throw std::runtime_error("Failed to map memory for SimBrokerMemoryDataSource bars");
+  this->barStore = std::shared_ptr<PackedBar>((PackedBar*)mem, [bytes](PackedBar* p) { munmap(p, bytes); });
+  this->bars = this->barStore.get();
+
+  for (auto& [ticker, bars] : this->loadingBars) {
+    std::stable_sort(bars.begin(), bars.end(), [](const auto& a, const auto& b) -> bool {
+      return a.time < b.time;
+    });
+
+    auto& info = this->tickers[ticker];
+    info.firstBar = this->barCount;
+    std::copy(bars.begin(), bars.end(), this->barStore.get()+this->barCount);
+    this->barCount += bars.size();
+    info.endBar = this->barCount;
+  }
+  this->loadingBars.clear();
+  mprotect(mem, bytes, PROT_READ);
+
+  std::sort(this->calendar.begin(), this->calendar.end());
+  this->calendar.erase(std::unique(this->calendar.begin(), this->calendar.end()), this->calendar.end());
+
+  std::map<uint64_t, MarketPhase> marketPhases;
+  for (auto openClose : this->calendar) {
+    marketPhases[openClose.first-premarketLength] = MarketPhase::PREMARKET;
+    marketPhases[openClose.first] = MarketPhase::OPEN;
+    marketPhases[openClose.second] = MarketPhase::POSTMARKET;
+    marketPhases[openClose.second+postmarketLength] = MarketPhase::CLOSED;
+  }
+
+  bool first = true;
+  MarketPhase prevPhase = MarketPhase::CLOSED;
+  for (auto& [time, phase] : marketPhases) {
+    if (!first) this->marketPhaseChanges.push_back({prevPhase, phase, time});
+    prevPhase = phase;
+    first = false;
+  }
+
+  this->isFrozen = true;
+}
+
+bool SimBrokerMemoryDataSource::frozen() { return this->isFrozen; }
+
+const SimBrokerMemoryDataSource::TickerInfo* SimBrokerMemoryDataSource::ticker(const std::string& ticker) {
+  if (!this->isFrozen) throw std::logic_error("SimBrokerMemoryDataSource must be frozen before use");
+
+  auto it = this->tickers.find(ticker);
+  if (it == this->tickers.end()) return NULL;
+  return &it->second;
+}
+
+SimBrokerStockDataSource::Bar SimBrokerMemoryDataSource::unpack(const PackedBar& b) {
+  Bar bar = {};
+  bar.time = b.time;
+  bar.openPrice = b.openPrice;
+  bar.closePrice = b.closePrice;
+  bar.highPrice = b.highPrice;
+  bar.lowPrice = b.lowPrice;
+  bar.volume = b.volume;
+  return bar;
+}
+
+std::vector<SimBrokerStockDataSource::Bar> SimBrokerMemoryDataSource::getMinuteBars(std::string ticker, uint64_t startTime, uint64_t endTime) {
+  std::vector<Bar> r;
+  auto t = this->ticker(ticker);
+  if (t == NULL || endTime < 60) return r;
+
+  auto begin = this->bars+t->firstBar;
+  auto end = this->bars+t->endBar;
+  auto cmp = [](const PackedBar& b, uint64_t time) -> bool { return b.time < time; };
+  auto first = std::lower_bound(begin, end, startTime, cmp);
+  auto last = std::lower_bound(first, end, endTime-60, cmp);
+
+  r.reserve(last-first);
+  for (auto it = first; it != last; it++) r.push_back(this->unpack(*it));
+  return r;
+}
+
+currency SimBrokerMemoryDataSource::getPrice(std::string ticker, uint64_t time) {
+  auto t = this->ticker(ticker);
+  if (t == NULL) return -1;
+
+  auto end = this->bars+t->endBar;
+  auto it = std::lower_bound(this->bars+t->firstBar, end, time, [](const PackedBar& b, uint64_t time) -> bool {
+    return b.time < time;
+  });
+
+  if (it == end) return -1;
+  return it->openPrice;
+}
+
+cpp_dec_float_100 SimBrokerMemoryDataSource::getAssetBorrowRate(std::string ticker, [[maybe_unused]]uint64_t time) {
+  auto t = this->ticker(ticker);
+  if (t == NULL) return 0.03;
+  return t->borrowRate;
+}
+
+SimBrokerStockDataSource::MarketPhase SimBrokerMemoryDataSource::getMarketPhase(uint64_t time) {
+  if (!this->isFrozen) throw std::logic_error("SimBrokerMemoryDataSource must be frozen before use");
+
+  // The last day whose premarket started at or before time is the only one that can contain it
+  auto it = std::upper_bound(this->calendar.begin(), this->calendar.end(), time, [](uint64_t time, const auto& day) -> bool {
+    return time < day.first-premarketLength;
+  });
+  if (it == this->calendar.begin()) return MarketPhase::CLOSED;
+  auto& day = *(it-1);
+
+  if (time >= day.first && time <= day.second) return MarketPhase::OPEN;
+  if (time < day.first) return MarketPhase::PREMARKET;
+  if (time < day.second+postmarketLength) return MarketPhase::POSTMARKET;
+  return MarketPhase::CLOSED;
+}
+
+// Index of the first phase change after time
+static size_t nextChangeIndex(const std::vector<SimBrokerStockDataSource::MarketPhaseChange>& changes, uint64_t time) {
+  return std::upper_bound(changes.begin(), changes.end(), time, [](uint64_t time, const auto& c) -> bool {
+    return time < c.time;
+  })-changes.begin();
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerMemoryDataSource::getNextMarketPhaseChange(uint64_t time) {
+  size_t i = nextChangeIndex(this->marketPhaseChanges, time);
+  if (i >= this->marketPhaseChanges.size()) throw std::logic_error("Not enough data to determine market phase");
+  return this->marketPhaseChanges[i];
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerMemoryDataSource::getPrevMarketPhaseChange(uint64_t time) {
+  size_t i = nextChangeIndex(this->marketPhaseChanges, time);
+  if (i == 0) throw std::logic_error("Not enough data to determine market phase");
+  return this->marketPhaseChanges[i-1];
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerMemoryDataSource::getNextMarketPhaseChangeTo(uint64_t time, MarketPhase to) {
+  for (size_t i = nextChangeIndex(this->marketPhaseChanges, time); i < this->marketPhaseChanges.size(); i++) {
+    if (this->marketPhaseChanges[i].to == to) return this->marketPhaseChanges[i];
+  }
+  throw std::logic_error("Not enough data to determine market phase");
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerMemoryDataSource::getPrevMarketPhaseChangeTo(uint64_t time, MarketPhase to) {
+  for (size_t i = nextChangeIndex(this->marketPhaseChanges, time); i > 0; i--) {
+    if (this->marketPhaseChanges[i-1].to == to) return this->marketPhaseChanges[i-1];
+  }
+  throw std::logic_error("Not enough data to determine market phase");
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerMemoryDataSource::getNextMarketPhaseChangeFrom(uint64_t time, MarketPhase from) {
+  for (size_t i = nextChangeIndex(this->marketPhaseChanges, time); i < this->marketPhaseChanges.size(); i++) {
+    if (this->marketPhaseChanges[i].from == from) return this->marketPhaseChanges[i];
+  }
+  throw std::logic_error("Not enough data to determine market phase");
+}
+
+SimBrokerStockDataSource::MarketPhaseChange SimBrokerMemoryDataSource::getPrevMarketPhaseChangeFrom(uint64_t time, MarketPhase from) {
+  for (size_t i = nextChangeIndex(this->marketPhaseChanges, time); i > 0; i--) {
+    if (this->marketPhaseChanges[i-1].from == from) return this->marketPhaseChanges[i-1];
+  }
+  throw std::logic_error("Not enough data to determine market phase");
+}
+
+bool SimBrokerMemoryDataSource::isTickerMarginable(std::string ticker, [[maybe_unused]]uint64_t time) {
+  auto t = this->ticker(ticker);
+  return t == NULL || t->marginable;
+}
+
+bool SimBrokerMemoryDataSource::isTickerETB(std::string ticker, [[maybe_unused]]uint64_t time) {
+  auto t = this->ticker(ticker);
+  return t == NULL || t->ETB;
+}
+
+bool SimBrokerMemoryDataSource::isTickerShortable(std::string ticker, [[maybe_unused]]uint64_t time) {
+  auto t = this->ticker(ticker);
+  return t == NULL || t->shortable;
+}
@@ -0,0 +1,306 @@
+#include "simBrokerPortfolio.hpp"
+#include <stdexcept>
+#include <algorithm>
+
+// Index into SharedOrder::sides for an account's quantity
+static int side(int64_t qty) { return qty < 0 ? 1 : 0; }
+
+SimBrokerPortfolio::SimBrokerPortfolio(SimBrokerStockDataSource* dataSource, uint64_t startTime, size_t accounts) :
+  stockDataSource(dataSource),
+  accounts(accounts),
+  clock(startTime),
+  engine(dataSource, startTime, false),
+  balances(accounts, 0.0),
+  nextPositionId(accounts, 0)
+{};
+
+size_t SimBrokerPortfolio::size() { return this->accounts; }
+uint64_t SimBrokerPortfolio::getClock() { return this->clock; }
+uint64_t SimBrokerPortfolio::getOrderCount() { return this->orders.size(); }
+currency SimBrokerPortfolio::getBalance(size_t account) { return this->balances.at(account); }
+const std::vector<currency>& SimBrokerPortfolio::getBalances() { return this->balances; }
+void SimBrokerPortfolio::enableInstaFill() { this->engine.enableInstaFill(); }
+void SimBrokerPortfolio::disableInstaFill() { this->engine.disableInstaFill(); }
+bool SimBrokerPortfolio::instaFillEnabled() { return this->engine.instaFillEnabled(); }
+void SimBrokerPortfolio::addFunds(size_t account, currency chedda) { this->balances.at(account) += chedda; }
+void SimBrokerPortfolio::rmFunds(size_t account, currency cheeze) { this->balances.at(account) -= cheeze; }
+
+void SimBrokerPortfolio::addFunds(const std::vector<currency>& amounts) {
+  if (amounts.size() != this->accounts) throw std::logic_error("Expected one amount per account");
+  for (size_t i = 0; i < this->accounts; i++) this->balances[i] += amounts[i];
+}
+
+void SimBrokerPortfolio::updateClock(uint64_t time) {
+  if (time < this->clock) throw std::logic_error("SimBrokerPortfolio instructed to travel back in time (this is not possible).");
+
+  uint64_t oldtime = this->clock;
+  this->clock = time;
+  if (time != oldtime) this->updateState();
+}
+
+SimBrokerPortfolio::Holding& SimBrokerPortfolio::holding(const std::string& symbol) {
+  auto it = this->holdingIndex.find(symbol);
+  if (it != this->holdingIndex.end()) return this->holdings[it->second];
+
+  Holding h;
+  h.symbol = symbol;
+  h.qty.assign(this->accounts, 0);
+  h.avgEntryPrice.assign(this->accounts, 0.0);
+  h.costBasis.assign(this->accounts, 0.0);
+  h.createdTime.assign(this->accounts, 0);
+  h.positionId.assign(this->accounts, 0);
+
+  this->holdingIndex[symbol] = this->holdings.size();
+  this->holdings.push_back(std::move(h));
+  return this->holdings.back();
+}
+
+// Same arithmetic as SimBroker::addToPosition, so the numbers match a SimBroker exactly
+void SimBrokerPortfolio::addToPosition(Holding& h, size_t i, int64_t qty, currency avgPrice) {
+  if (h.qty[i] != 0) {
+    h.avgEntryPrice[i] = ((h.qty[i]*h.avgEntryPrice[i])+(qty*avgPrice))/((h.qty[i]+qty)*1.0);
+    h.costBasis[i] = h.avgEntryPrice[i]*h.qty[i];
+    h.qty[i] += qty;
+  } else {
+    // New position
+    h.avgEntryPrice[i] = avgPrice;
+    h.qty[i] = qty;
+    h.costBasis[i] = h.avgEntryPrice[i]*h.qty[i];
+    h.createdTime[i] = this->clock;
+    h.positionId[i] = this->nextPositionId[i]++;
+  }
+}
+
+std::vector<currency> SimBrokerPortfolio::getEquities() {
+  std::vector<currency> equities = this->balances;
+
+  for (auto& h : this->holdings) {
+    bool held = false;
+    for (auto q : h.qty) { if (q != 0) { held = true; break; } }
+    if (!held) continue;
+
+    currency price = this->stockDataSource->getPrice(h.symbol, this->clock);
+    for (size_t i = 0; i < this->accounts; i++) {
+      if (h.qty[i] != 0) equities[i] += h.qty[i]*price;
+    }
+  }
+
+  return equities;
+}
+
+// Cash account rules of SimBroker::getBuyingPower
+std::vector<currency> SimBrokerPortfolio::getBuyingPowers() {
+  std::vector<currency> buyingPowers = this->balances;
+
+  for (auto& so : this->orders) {
+    bool open = false;
+    for (size_t i = 0; i < this->accounts; i++) {
+      if (so.status[i] == SimBroker::OrderStatus::OPEN && so.filledQty[i] != so.qty[i]) { open = true; break; }
+    }
+    if (!open) continue;
+
+    auto& o = so.sides[0]; // Only the plan's fields, the same on both sides
+    auto held = this->holdingIndex.find(o.symbol);
+    currency price = (o.type == SimBroker::OrderType::LIMIT) ? o.limitPrice : this->stockDataSource->getPrice(o.symbol, this->clock);
+
+    for (size_t i = 0; i < this->accounts; i++) {
+      if (so.status[i] != SimBroker::OrderStatus::OPEN || so.filledQty[i] == so.qty[i]) continue;
+
+      // Long sell orders don't effect buying power
+      if (so.qty[i] < 0 && held != this->holdingIndex.end() && this->holdings[held->second].qty[i] > 0) continue;
+
+      buyingPowers[i] -= price*labs(so.qty[i]-so.filledQty[i]);
+    }
+  }
+
+  return buyingPowers;
+}
+
+uint64_t SimBrokerPortfolio::placeOrder(SimBroker::OrderPlan p, const std::vector<int64_t>& qtys) {
+  if (qtys.size() != this->accounts) throw std::logic_error("Expected one quantity per account");
+
+  // Let SimBroker validate the plan and fill in the order fields
+  this->engine.clock = this->clock;
+  SimBroker::Order o = this->engine.newOrder(p);
+  o.id = this->orders.size();
+
+  SharedOrder so;
+  so.qty = qtys;
+  so.filledQty.assign(this->accounts, 0);
+  so.status.assign(this->accounts, SimBroker::OrderStatus::REJECTED);
+  so.filledAt.assign(this->accounts, 0);
+  so.filledAvgPrice.assign(this->accounts, 0.0);
+
+  currency price = this->stockDataSource->getPrice(p.symbol, this->clock);
+  currency buyPrice = price;
+  if (buyPrice > p.limitPrice && p.type == SimBroker::OrderType::LIMIT) buyPrice = p.limitPrice;
+
+  bool needBuyingPower = false;
+  for (auto q : qtys) needBuyingPower |= q > 0;
+  std::vector<currency> buyingPowers;
+  if (needBuyingPower && price >= 0) buyingPowers = this->getBuyingPowers();
+
+  auto held = this->holdingIndex.find(p.symbol);
+  int64_t largest[2] = {0, 0};
+  for (size_t i = 0; i < this->accounts; i++) {
+    int64_t q = qtys[i];
+    bool accepted = false;
+
+    if (q > 0) {
+      accepted = price >= 0 && buyingPowers[i] >= (q*buyPrice);
+    } else if (q < 0) {
+      // Sells can't go short without margin
+      int64_t existingQty = (held != this->holdingIndex.end()) ? this->holdings[held->second].qty[i] : 0;
+      accepted = existingQty+q >= 0;
+    }
+
+    if (accepted) {
+      so.status[i] = SimBroker::OrderStatus::OPEN;
+      if (llabs(q) > llabs(largest[side(q)])) largest[side(q)] = q;
+    } else {
+      this->setAccountStatus(so, i, SimBroker::OrderStatus::REJECTED);
+    }
+  }
+
+  for (int s = 0; s < 2; s++) {
+    so.sides[s] = o;
+    so.sides[s].qty = largest[s];
+    auto status = (largest[s] != 0) ? SimBroker::OrderStatus::OPEN : SimBroker::OrderStatus::REJECTED;
+    this->engine.setOrderStatus(so.sides[s], status, this->clock);
+  }
+
+  this->orders.push_back(std::move(so));
+
+  if (this->engine.instaFillEnabled()) this->updateState();
+  return o.id;
+}
+
+void SimBrokerPortfolio::cancelOrder(uint64_t orderId) {
+  if (orderId >= this->orders.size()) throw std::logic_error("Invalid order ID");
+  auto& so = this->orders[orderId];
+
+  // Like SimBroker, this cancels every account's order whatever its status
+  for (auto& o : so.sides) this->engine.setOrderStatus(o, SimBroker::OrderStatus::CANCELLED, this->clock);
+  for (size_t i = 0; i < this->accounts; i++) {
+    if (so.ownHistory.count(i) > 0) this->setAccountStatus(so, i, SimBroker::OrderStatus::CANCELLED);
+    else so.status[i] = SimBroker::OrderStatus::CANCELLED;
+  }
+}
+
+void SimBrokerPortfolio::cancelOrder(uint64_t orderId, size_t account) {
+  if (orderId >= this->orders.size()) throw std::logic_error("Invalid order ID");
+  auto& so = this->orders[orderId];
+
+  if (account >= this->accounts) throw std::logic_error("Invalid account");
+
+  // Fills are already applied up to the clock, so from here on this account just stops taking part
+  this->setAccountStatus(so, account, SimBroker::OrderStatus::CANCELLED);
+
+  // No need to keep simulating the account's side of the order once nobody is left on it
+  int s = side(so.qty[account]);
+  if (so.sides[s].status != SimBroker::OrderStatus::OPEN) return;
+  for (size_t i = 0; i < this->accounts; i++) {
+    if (side(so.qty[i]) == s && so.status[i] == SimBroker::OrderStatus::OPEN) return;
+  }
+  this->engine.setOrderStatus(so.sides[s], SimBroker::OrderStatus::CANCELLED, this->clock);
+}
+
+void SimBrokerPortfolio::setAccountStatus(SharedOrder& so, size_t account, SimBroker::OrderStatus status) {
+  // The account's history leaves the shared one from here on
+  SimBroker::Order o;
+  auto it = so.ownHistory.find(account);
+  o.orderStatusHistory = (it != so.ownHistory.end()) ? it->second : so.sides[side(so.qty[account])].orderStatusHistory;
+
+  this->engine.setOrderStatus(o, status, this->clock);
+  so.ownHistory[account] = std::move(o.orderStatusHistory);
+  so.status[account] = status;
+}
+
+void SimBrokerPortfolio::updateState() {
+  this->engine.clock = this->clock;
+
+  for (auto& so : this->orders) {
+    for (int s = 0; s < 2; s++) {
+      auto& o = so.sides[s];
+      if (!this->engine.orderNeedsUpdate(o)) continue;
+
+      this->engine.updateOrderTIF(o);
+      if (o.status == SimBroker::OrderStatus::EXPIRED) {
+        for (size_t i = 0; i < this->accounts; i++) {
+          if (side(so.qty[i]) == s && so.status[i] == SimBroker::OrderStatus::OPEN) so.status[i] = SimBroker::OrderStatus::EXPIRED;
+        }
+      }
+
+      if (o.filledQty == o.qty || o.qty == 0 || o.doneFilling) continue;
+      int64_t before = o.filledQty;
+      this->engine.simulateFill(o);
+      if (o.filledQty != before) this->applyFill(so, s);
+    }
+  }
+}
+
+void SimBrokerPortfolio::applyFill(SharedOrder& so, int s) {
+  auto& o = so.sides[s];
+  Holding& h = this->holding(o.symbol);
+  int64_t filled = llabs(o.filledQty);
+
+  for (size_t i = 0; i < this->accounts; i++) {
+    if (side(so.qty[i]) != s) continue;
+
+    // Expired orders still get the fills from before they expired, cancelled accounts are done
+    if (so.status[i] != SimBroker::OrderStatus::OPEN && so.status[i] != SimBroker::OrderStatus::EXPIRED) continue;
+    if (so.filledQty[i] == so.qty[i]) continue;
+
+    int64_t target = std::min(filled, (int64_t)llabs(so.qty[i]));
+    if (so.qty[i] < 0) target = -target;
+    int64_t delta = target-so.filledQty[i];
+    if (delta == 0) continue;
+
+    so.filledQty[i] = target;
+    so.filledAvgPrice[i] = o.filledAvgPrice;
+    if (target == so.qty[i]) so.filledAt[i] = this->clock;
+
+    this->addToPosition(h, i, delta, o.filledAvgPrice);
+    this->balances[i] -= delta*o.filledAvgPrice;
+  }
+}
+
+SimBroker::Order SimBrokerPortfolio::getOrder(uint64_t orderId, size_t account) {
+  if (orderId >= this->orders.size()) throw std::logic_error("Invalid order id provided");
+  auto& so = this->orders[orderId];
+  if (account >= this->accounts) throw std::logic_error("Invalid account");
+
+  SimBroker::Order o = so.sides[side(so.qty[account])];
+  o.qty = so.qty[account];
+  o.filledQty = so.filledQty[account];
+  o.filledAvgPrice = so.filledAvgPrice[account];
+  o.filledAt = so.filledAt[account];
+  o.status = so.status[account];
+
+  auto it = so.ownHistory.find(account);
+  if (it != so.ownHistory.end()) o.orderStatusHistory = it->second;
+
+  return o;
+}
+
+std::vector<SimBroker::Position> SimBrokerPortfolio::getPositions(size_t account) {
+  if (account >= this->accounts) throw std::logic_error("Invalid account");
+
+  std::vector<SimBroker::Position> r;
+  for (auto& h : this->holdings) {
+    if (h.qty[account] == 0) continue;
+
+    SimBroker::Position p = {};
+    p.id = h.positionId[account];
+    p.symbol = h.symbol;
+    p.avgEntryPrice = h.avgEntryPrice[account];
+    p.qty = h.qty[account];
+    p.costBasis = h.costBasis[account];
+    p.createdTime = h.createdTime[account];
+    r.push_back(p);
+  }
+
+  // SimBroker lists positions in the order they were opened
+  std::sort(r.begin(), r.end(), [](const auto& a, const auto& b) { return a.id < b.id; });
+  return r;
+}
@@ -0,0 +1,146 @@
+#include "simBrokerScheduler.hpp"
+#include <algorithm>
+
+SimBrokerScheduler::Context::Context(SimBrokerScheduler* scheduler, unsigned worker) :
+  scheduler(scheduler),
+  workerIndex(worker)
+{};
+
+bool SimBrokerScheduler::Context::cancelled() { return this->scheduler->isCancelled; }
+void SimBrokerScheduler::Context::cancelRemaining() { this->scheduler->cancel(); }
+unsigned SimBrokerScheduler::Context::worker() { return this->workerIndex; }
+
+SimBrokerScheduler::SimBrokerScheduler(unsigned threads) {
+  if (threads == 0) threads = std::thread::hardware_concurrency();
+  if (threads == 0) threads = 1;
+
+  for (unsigned i = 0; i < threads; i++) this->workers.push_back(std::make_unique<Worker>());
+
+  // Worker 0 is whichever thread calls run()
+  for (unsigned i = 1; i < threads; i++) this->threads.emplace_back(&SimBrokerScheduler::workerLoop, this, i);
+};
+
+SimBrokerScheduler::~SimBrokerScheduler() {
+  {
+    std::lock_guard<std::mutex> l(this->lock);
+    this->stopping = true;
+  }
+  this->wake.notify_all();
+  for (auto& t : this->threads) t.join();
+}
+
+void SimBrokerScheduler::submit(Job job, int64_t priority) {
+  this->pending.push_back({job, priority});
+}
+
+SimBrokerScheduler::Report SimBrokerScheduler::run() {
+  // Deal the jobs out round-robin in priority order, so every deque is sorted by priority too
+  std::stable_sort(this->pending.begin(), this->pending.end(), [](const auto& a, const auto& b) -> bool {
+    return a.priority > b.priority;
+  });
+
+  for (size_t i = 0; i < this->pending.size(); i++) {
+    this->workers[i%this->workers.size()]->jobs.push_back(std::move(this->pending[i]));
+  }
+  this->pending.clear();
+
+  this->isCancelled = false;
+  this->completed = 0;
+  this->dropped = 0;
+  this->stolen = 0;
+  this->error = nullptr;
+
+  {
+    std::lock_guard<std::mutex> l(this->lock);
+    this->busyWorkers = this->threads.size();
+    this->batch++;
+  }
+  this->wake.notify_all();
+
+  this->runBatch(0);
+
+  {
+    std::unique_lock<std::mutex> l(this->lock);
+    this->done.wait(l, [this]() { return this->busyWorkers == 0; });
+  }
+
+  if (this->error) std::rethrow_exception(this->error);
+
+  Report r;
+  r.completed = this->completed;
+  r.cancelled = this->dropped;
+  r.stolen = this->stolen;
+  return r;
+}
+
+void SimBrokerScheduler::cancel() { this->isCancelled = true; }
+
+unsigned SimBrokerScheduler::getThreads() { return this->workers.size(); }
+
+void SimBrokerScheduler::workerLoop(unsigned index) {
+  uint64_t seenBatch = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> l(this->lock);
+      this->wake.wait(l, [this, seenBatch]() { return this->stopping || this->batch != seenBatch; });
+      if (this->stopping) return;
+      seenBatch = this->batch;
+    }
+
+    this->runBatch(index);
+
+    {
+      std::lock_guard<std::mutex> l(this->lock);
+      this->busyWorkers--;
+    }
+    this->done.notify_all();
+  }
+}
+
+bool SimBrokerScheduler::takeJob(unsigned index, QueuedJob& out, bool& wasStolen) {
+  // Our own deque first, highest priority first
+  {
+    auto& w = *this->workers[index];
+    std::lock_guard<std::mutex> l(w.lock);
+    if (w.jobs.size() > 0) {
+      out = std::move(w.jobs.front());
+      w.jobs.pop_front();
+      wasStolen = false;
+      return true;
+    }
+  }
+
+  // Then steal from the back of everyone else's
+  for (size_t i = 1; i < this->workers.size(); i++) {
+    auto& w = *this->workers[(index+i)%this->workers.size()];
+    std::lock_guard<std::mutex> l(w.lock);
+    if (w.jobs.size() > 0) {
+      out = std::move(w.jobs.back());
+      w.jobs.pop_back();
+      wasStolen = true;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void SimBrokerScheduler::runBatch(unsigned index) {
+  Context ctx(this, index);
+  QueuedJob j;
+  bool wasStolen;
+
+  while (this->takeJob(index, j, wasStolen)) {
+    if (this->isCancelled) { this->dropped++; continue; }
+    if (wasStolen) this->stolen++;
+
+    try {
+      j.job(ctx);
+    } catch (...) {
+      std::lock_guard<std::mutex> l(this->lock);
+      if (!this->error) this->error = std::current_exception();
+    }
+
+    this->completed++;
+  }
+}
@@ -0,0 +1,339 @@
+#include "simBrokerSweep.hpp"
+#include <stdexcept>
+#include <algorithm>
+#include <numeric>
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// Same default as SimBrokerScheduler
+static unsigned sweepThreads(unsigned threads) {
+  if (threads == 0) threads = std::thread::hardware_concurrency();
+  return std::max(1u, threads);
+}
+
+SimBrokerSweep::SimBrokerSweep(SimBrokerStockDataSource* dataSource, BrokerConfig config, unsigned threads) :
+  stockDataSource(dataSource),
+  config(config),
+  threads(sweepThreads(threads)),
+  pool(this->threads)
+{};
+
+std::vector<SimBrokerSweep::Params> SimBrokerSweep::grid(std::map<std::string, std::vector<double>> axes) {
+  std::vector<Params> r = {{}};
+
+  for (auto& [name, values] : axes) {
+    std::vector<Params> next;
+    next.reserve(r.size()*values.size());
+    for (auto& p : r) {
+      for (auto v : values) {
+        Params np = p;
+        np[name] = v;
+        next.push_back(np);
+      }
+    }
+    r = next;
+  }
+
+  return r;
+}
+
+void SimBrokerSweep::prepareBroker(SimBroker& broker) {
+  // Forks share the checkpoint's orders and positions until they change them
+  if (this->prefix) {
+    broker = this->prefix->fork();
+    return;
+  }
+
+  broker.reset(this->config.startTime, this->config.margin);
+  broker.addFunds(this->config.funds);
+  broker.setInitialMarginRequirement(this->config.initialMarginRequirement);
+  broker.setMaintenanceMarginRequirement(this->config.maintenanceMarginRequirement);
+  broker.setInterestRate(this->config.interestRate);
+  if (this->config.instaFill) broker.enableInstaFill();
+  if (!this->config.shortRoundLotFee) broker.disableShortRoundLotFee();
+}
+
+SimBroker& SimBrokerSweep::pooledBroker(unsigned worker) {
+  auto& b = this->pool.at(worker);
+  if (!b) b.emplace(this->stockDataSource, this->config.startTime, this->config.margin);
+  return *b;
+}
+
+void SimBrokerSweep::fillResult(Result& r, SimBroker& broker) {
+  r.clock = broker.getClock();
+  r.balance = broker.getBalance();
+  r.positions = broker.getPositions();
+  r.orderCount = broker.getOrders().size();
+  r.equity = broker.getEquity();
+}
+
+SimBrokerSweep::Result SimBrokerSweep::runOne(uint64_t run, const Params& params, Strategy& strategy, SimBroker& broker) {
+  Result r;
+  r.run = run;
+  r.params = params;
+
+  try {
+    this->prepareBroker(broker);
+    strategy(broker, params);
+    this->fillResult(r, broker);
+  } catch (const std::exception& e) {
+    r.failed = true;
+    r.error = e.what();
+  } catch (...) {
+    r.failed = true;
+    r.error = "Unknown exception";
+  }
+
+  return r;
+}
+
+std::vector<SimBrokerSweep::Result> SimBrokerSweep::startSweep(const std::vector<Params>& params) {
+  this->prefix.reset();
+  if (this->config.checkpoint != "") {
+    this->prefix.emplace(this->stockDataSource, this->config.startTime, this->config.margin);
+    this->prefix->loadCheckpoint(this->config.checkpoint);
+  }
+
+  std::vector<Result> results(params.size());
+  for (size_t i = 0; i < params.size(); i++) {
+    results[i].run = i;
+    results[i].params = params[i];
+    results[i].cancelled = true;
+  }
+
+  return results;
+}
+
+std::vector<SimBrokerSweep::Result> SimBrokerSweep::run(std::vector<Params> params, Strategy strategy, StopCondition stop) {
+  auto results = this->startSweep(params);
+  if (!this->scheduler) this->scheduler = std::make_unique<SimBrokerScheduler>(this->threads);
+
+  for (size_t i = 0; i < params.size(); i++) {
+    int64_t priority = this->costEstimate ? this->costEstimate(params[i]) : 0;
+    this->scheduler->submit([this, i, &params, &results, &strategy, &stop](SimBrokerScheduler::Context& ctx) {
+      results[i] = this->runOne(i, params[i], strategy, this->pooledBroker(ctx.worker()));
+      if (stop && stop(results[i])) ctx.cancelRemaining();
+    }, priority);
+  }
+
+  this->scheduler->run();
+  return results;
+}
+
+void SimBrokerSweep::setCostEstimate(CostEstimate func) { this->costEstimate = func; }
+unsigned SimBrokerSweep::getThreads() { return this->threads; }
+
+// Multi-process mode
+//
+// The coordinator puts a small work queue in shared memory (next run to claim and a stop flag)
+// and forks the workers. Each worker claims runs until the queue is empty and sends one message
+// per run down its own pipe:
+//   uint64 run, uint8 failed, uint64 length, then the error message or the broker's checkpoint
+// The coordinator restores each checkpoint to build the Result, so results are exact.
+struct SimBrokerSweepQueue {
+  // Taking a value claims order[value] in the same atomic step, so runs order[0, next) are
+  // exactly the ones some worker has started - even if it died before reporting back
+  std::atomic<uint64_t> next;
+  std::atomic<bool> stop;
+};
+
+static bool writeAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+void SimBrokerSweep::workerProcess(int fd, const std::vector<uint64_t>& order, const std::vector<Params>& params,
+                                   Strategy& strategy, SimBrokerSweepQueue* queue) {
+  SimBroker broker(this->stockDataSource, this->config.startTime, this->config.margin);
+
+  while (!queue->stop) {
+    uint64_t i = queue->next++;
+    if (i >= order.size()) break;
+
+    uint64_t run = order[i];
+
+    uint8_t failed = 0;
+    std::string payload;
+    try {
+      this->prepareBroker(broker);
+      strategy(broker, params[run]);
+      payload = broker.checkpoint();
+    } catch (const std::exception& e) {
+      failed = 1;
+      payload = e.what();
+    } catch (...) {
+      failed = 1;
+      payload = "Unknown exception";
+    }
+
+    uint64_t size = payload.size();
+    std::string msg;
+    msg.append((const char*)&run, sizeof(run));
+    msg.append((const char*)&failed, sizeof(failed));
+    msg.append((const char*)&size, sizeof(size));
+    msg.append(payload);
+    if (!writeAll(fd, msg.data(), msg.size())) return;
+  }
+}
+
+std::vector<SimBrokerSweep::Result> SimBrokerSweep::runProcesses(std::vector<Params> params, Strategy strategy,
+                                                                 StopCondition stop, unsigned processes) {
+  auto results = this->startSweep(params);
+  if (params.size() == 0) return results;
+
+  if (processes == 0) processes = std::max(1u, std::thread::hardware_concurrency());
+  if (processes > params.size()) processes = params.size();
+
+  // Most expensive first, like run()
+  std::vector<uint64_t> order(params.size());
+  std::iota(order.begin(), order.end(), 0);
+  if (this->costEstimate) {
+    std::vector<int64_t> cost(params.size());
+    for (size_t i = 0; i < params.size(); i++) cost[i] = this->costEstimate(params[i]);
+    std::stable_sort(order.begin(), order.end(), [&cost](uint64_t a, uint64_t b) { return cost[a] > cost[b]; });
+  }
+
+  size_t bytes = sizeof(SimBrokerSweepQueue);
+  void* mem = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) throw std::runtime_error("Failed to map memory for the sweep work queue");
+  auto queue = new (mem) SimBrokerSweepQueue{{0}, {false}};
+
+  // The children would only get this thread - whatever locks the scheduler's threads held at the
+  // time of the fork would stay locked forever
+  this->scheduler.reset();
+
+  struct Worker {
+    pid_t pid;
+    int fd;
+    std::string buffer;
+  };
+  std::vector<Worker> workers;
+
+  // Anything still buffered would otherwise be written once by every process
+  fflush(NULL);
+
+  for (unsigned p = 0; p < processes; p++) {
+    int fds[2];
+    if (pipe(fds) != 0) break;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+      close(fds[0]);
+      close(fds[1]);
+      break;
+    }
+
+    if (pid == 0) {
+      close(fds[0]);
+      for (auto& w : workers) close(w.fd);
+      this->workerProcess(fds[1], order, params, strategy, queue);
+
+      // Skip destructors and atexit handlers, those belong to the coordinator
+      _exit(0);
+    }
+
+    close(fds[1]);
+    workers.push_back({pid, fds[0], ""});
+  }
+
+  if (workers.size() == 0) {
+    munmap(mem, bytes);
+    throw std::runtime_error("Failed to start any sweep worker processes");
+  }
+
+  std::vector<bool> received(params.size(), false);
+  const size_t headerSize = sizeof(uint64_t)+sizeof(uint8_t)+sizeof(uint64_t);
+
+  size_t running = workers.size();
+  std::vector<pollfd> pollfds;
+  while (running > 0) {
+    pollfds.clear();
+    for (auto& w : workers) pollfds.push_back({w.fd, POLLIN, 0});
+    if (poll(pollfds.data(), pollfds.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    for (size_t i = 0; i < workers.size(); i++) {
+      auto& w = workers[i];
+      if (w.fd < 0 || pollfds[i].revents == 0) continue;
+
+      char buf[65536];
+      ssize_t n = read(w.fd, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        close(w.fd);
+        w.fd = -1;
+        running--;
+        continue;
+      }
+      w.buffer.append(buf, n);
+
+      // Handle every complete message we have
+      size_t pos = 0;
+      while (w.buffer.size()-pos >= headerSize) {
+        uint64_t run, size;
+        uint8_t failed;
+        memcpy(&run, w.buffer.data()+pos, sizeof(run));
+        memcpy(&failed, w.buffer.data()+pos+sizeof(run), sizeof(failed));
+        memcpy(&size, w.buffer.data()+pos+sizeof(run)+sizeof(failed), sizeof(size));
+        if (w.buffer.size()-pos-headerSize < size) break;
+
+        std::string payload = w.buffer.substr(pos+headerSize, size);
+        pos += headerSize+size;
+
+        Result& r = results[run];
+        r.cancelled = false;
+        if (failed) {
+          r.failed = true;
+          r.error = payload;
+        } else {
+          try {
+            SimBroker broker(this->stockDataSource, 0, false);
+            broker.restore(payload);
+            this->fillResult(r, broker);
+          } catch (const std::exception& e) {
+            r.failed = true;
+            r.error = e.what();
+          }
+        }
+
+        received[run] = true;
+        if (stop && stop(r)) queue->stop = true;
+      }
+      w.buffer.erase(0, pos);
+    }
+  }
+
+  for (auto& w : workers) {
+    if (w.fd >= 0) close(w.fd);
+    waitpid(w.pid, NULL, 0);
+  }
+
+  // Runs that were claimed but never reported: the worker died (crashed, killed...) mid-run
+  uint64_t claimed = std::min<uint64_t>(queue->next, order.size());
+  for (uint64_t i = 0; i < claimed; i++) {
+    uint64_t run = order[i];
+    if (!received[run]) {
+      results[run].cancelled = false;
+      results[run].failed = true;
+      results[run].error = "Worker process exited before finishing this run";
+    }
+  }
+
+  munmap(mem, bytes);
+  return results;
+}
@@ -0,0 +1,182 @@
+#include "simBrokerTracer.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <stdexcept>
+
+static std::atomic<uint64_t> nextTracerId = 1;
+
+static int64_t steadyNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+SimBrokerTracer::Span::Span(SimBrokerTracer* tracer, const char* name, uint64_t simTime,
+                            const std::string* symbol, int64_t orderId) :
+  tracer(tracer),
+  name(name),
+  simTime(simTime),
+  symbol(symbol),
+  orderId(orderId),
+  begin(tracer ? tracer->now() : 0)
+{};
+
+SimBrokerTracer::Span::~Span() {
+  if (this->tracer) this->tracer->record(this->name, this->begin, this->tracer->now(), this->simTime, this->symbol, this->orderId);
+}
+
+SimBrokerTracer::SimBrokerTracer(size_t eventsPerThread) :
+  id(nextTracerId++),
+  eventsPerThread(std::max<size_t>(eventsPerThread, 1)),
+  epoch(steadyNs())
+{};
+
+uint64_t SimBrokerTracer::now() { return steadyNs()-this->epoch; }
+
+SimBrokerTracer::Ring* SimBrokerTracer::ring() {
+  // Each thread remembers its rings by tracer id. Almost always there's one tracer, found first try.
+  thread_local std::vector<std::pair<uint64_t, Ring*>> mine;
+  for (auto& [id, r] : mine) {
+    if (id == this->id) return r;
+  }
+
+  std::lock_guard<std::mutex> l(this->lock);
+  auto r = std::make_unique<Ring>();
+  r->events.resize(this->eventsPerThread);
+  r->thread = this->rings.size();
+  mine.push_back({this->id, r.get()});
+  this->rings.push_back(std::move(r));
+  return this->rings.back().get();
+}
+
+void SimBrokerTracer::record(const char* name, uint64_t begin, uint64_t end, uint64_t simTime,
+                             const std::string* symbol, int64_t orderId) {
+  Ring* r = this->ring();
+  uint64_t n = r->written.load(std::memory_order_relaxed);
+
+  Event& e = r->events[n%r->events.size()];
+  e.name = name;
+  e.begin = begin;
+  e.duration = end-begin;
+  e.simTime = simTime;
+  e.orderId = orderId;
+  e.thread = r->thread;
+  e.symbol[0] = 0;
+  if (symbol) {
+    size_t len = std::min(symbol->size(), sizeof(e.symbol)-1);
+    memcpy(e.symbol, symbol->data(), len);
+    e.symbol[len] = 0;
+  }
+
+  r->written.store(n+1, std::memory_order_release);
+}
+
+std::vector<SimBrokerTracer::Event> SimBrokerTracer::events() {
+  std::vector<Event> out;
+  std::lock_guard<std::mutex> l(this->lock);
+  for (auto& r : this->rings) {
+    uint64_t n = r->written.load(std::memory_order_acquire);
+    uint64_t size = r->events.size();
+    for (uint64_t i = (n > size ? n-size : 0); i < n; i++) out.push_back(r->events[i%size]);
+  }
+
+  std::stable_sort(out.begin(), out.end(), [](const Event& a, const Event& b) { return a.begin < b.begin; });
+  return out;
+}
+
+uint64_t SimBrokerTracer::dropped() {
+  uint64_t total = 0;
+  std::lock_guard<std::mutex> l(this->lock);
+  for (auto& r : this->rings) {
+    uint64_t n = r->written.load(std::memory_order_acquire);
+    if (n > r->events.size()) total += n-r->events.size();
+  }
+  return total;
+}
+
+void SimBrokerTracer::clear() {
+  std::lock_guard<std::mutex> l(this->lock);
+  for (auto& r : this->rings) r->written.store(0, std::memory_order_release);
+}
+
+static void appendJSONString(std::string& out, const char* s) {
+  out += '"';
+  for (; *s; s++) {
+    char c = *s;
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char)c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out += escaped;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+std::string SimBrokerTracer::chromeTrace() {
+  std::vector<Event> events = this->events();
+  uint32_t threads = 0;
+  for (auto& e : events) threads = std::max(threads, e.thread+1);
+
+  std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  char buf[256];
+  bool first = true;
+
+  for (uint32_t t = 0; t < threads; t++) {
+    snprintf(buf, sizeof(buf), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+             first ? "" : ",\n", t, t);
+    out += buf;
+    first = false;
+  }
+
+  for (auto& e : events) {
+    out += first ? "" : ",\n";
+    first = false;
+
+    out += "{\"name\":";
+    appendJSONString(out, e.name);
+    // Chrome wants microseconds
+    snprintf(buf, sizeof(buf), ",\"cat\":\"simbroker\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+             e.thread, e.begin/1000.0, e.duration/1000.0);
+    out += buf;
+
+    bool firstArg = true;
+    if (e.simTime != 0) {
+      time_t t = e.simTime;
+      tm utc;
+      gmtime_r(&t, &utc);
+      char date[32];
+      strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S UTC", &utc);
+      snprintf(buf, sizeof(buf), "\"simTime\":%lu,\"simDate\":\"%s\"", e.simTime, date);
+      out += buf;
+      firstArg = false;
+    }
+    if (e.symbol[0] != 0) {
+      out += firstArg ? "\"symbol\":" : ",\"symbol\":";
+      appendJSONString(out, e.symbol);
+      firstArg = false;
+    }
+    if (e.orderId >= 0) {
+      snprintf(buf, sizeof(buf), "%s\"orderId\":%ld", firstArg ? "" : ",", e.orderId);
+      out += buf;
+    }
+    out += "}}";
+  }
+
+  out += "]}\n";
+  return out;
+}
+
+void SimBrokerTracer::writeChromeTrace(std::string path) {
+  std::string trace = this->chromeTrace();
+  FILE* f = fopen(path.c_str(), "w");
+  if (f == NULL) throw std::runtime_error("Failed to open "+path+" for writing");
+  bool ok = fwrite(trace.data(), 1, trace.size(), f) == trace.size();
+  ok = (fclose(f) == 0) && ok;
+  if (!ok) throw std::runtime_error("Failed to write "+path);
+}
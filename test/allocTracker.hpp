@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <stdint.h>
+
+// Counts every heap allocation in the process by replacing the global operator new/delete, so
+// tests and benchmarks can see how much heap churn an operation causes - and assert that paths
+// which don't allocate stay that way.
+//
+// Defines the replacement operators, so include it from exactly one file per binary. Counts are
+// process-wide: anything other threads allocate meanwhile (e.g. a fill scheduler's workers) is
+// counted too.
+
+struct AllocCounts {
+  uint64_t allocations = 0;
+  uint64_t frees = 0;
+  uint64_t bytes = 0; // Total requested, not live
+
+  AllocCounts operator-(const AllocCounts& o) const {
+    return {this->allocations-o.allocations, this->frees-o.frees, this->bytes-o.bytes};
+  }
+};
+
+namespace allocTracker {
+  inline std::atomic<uint64_t> allocations = 0;
+  inline std::atomic<uint64_t> frees = 0;
+  inline std::atomic<uint64_t> bytes = 0;
+
+  inline AllocCounts now() {
+    return {allocations.load(std::memory_order_relaxed), frees.load(std::memory_order_relaxed),
+            bytes.load(std::memory_order_relaxed)};
+  }
+}
+
+// What f allocated
+template <typename F>
+AllocCounts countAllocs(F f) {
+  AllocCounts before = allocTracker::now();
+  f();
+  return allocTracker::now()-before;
+}
+
+void* operator new(size_t size) {
+  allocTracker::allocations.fetch_add(1, std::memory_order_relaxed);
+  allocTracker::bytes.fetch_add(size, std::memory_order_relaxed);
+  void* p = std::malloc(size > 0 ? size : 1);
+  if (p == NULL) throw std::bad_alloc();
+  return p;
+}
+
+// GCC can't tell that these pair with the operator new above
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept {
+  if (p == NULL) return;
+  allocTracker::frees.fetch_add(1, std::memory_order_relaxed);
+  std::free(p);
+}
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+#pragma GCC diagnostic pop
@@ -0,0 +1,820 @@
+#include <stdio.h>
+#include <cstring>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <thread>
+#include "allocTracker.hpp"
+#include "simBroker.hpp"
+#include "simBrokerMemoryDataSource.hpp"
+#include "simBrokerForwardingDataSource.hpp"
+#include <chrono>
+#include <functional>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <algorithm>
+
+// Benchmarks, run with `make bench` from the repo root (or build/bench micro|backtest for one set).
+//
+// Microbenchmarks time the core broker operations, reporting time, heap allocations and data
+// source calls per operation. Backtest benchmarks replay whole data sets minute by minute with a
+// scripted strategy, reporting simulated minutes per second - our real workload. They take a
+// couple of minutes.
+//
+// Scaling benchmarks (build/bench scaling, or `make benchScaling`) aren't run by default. They grow
+// one dimension of the book at a time - open orders, positions, symbols, how far back a live
+// order's fill scan goes - and time updateClock, placeOrder and getBuyingPower at each size, to
+// show how each cost grows. Sizes stop at 10k unless --max-size says otherwise: placing an order
+// costs O(open orders), so just building a 100k order book takes the best part of an hour.
+//
+// build/bench [micro|backtest|scaling]... [--json out.json] [--check baseline.json] [--csv out.csv]
+//             [--max-size n]
+//
+// --csv writes the scaling results as CSV. --json writes the other results as JSON. --check compares them to a baseline written by --json (see
+// `make benchBaseline` / `make benchCheck`) and exits non-zero if anything regressed. Allocation and
+// data source call counts don't depend on the machine and are always checked. Timings only mean
+// anything against a baseline from the same machine: the baseline records which machine it came
+// from (host name, CPU model and core count), and timings are only checked when that matches -
+// elsewhere they're just reported. Record a baseline before upgrading and check after.
+
+// ANSI bold colors
+#define BYEL "\x1B[1;33m"
+#define BWHT "\x1B[1;37m"
+#define BRED "\x1B[1;31m"
+
+// ANSI reset
+#define RESET "\x1B[0m"
+
+// Counts calls to the data source it wraps. Tickers with trailing digits are the same data as the
+// ticker without them ("SPY7" is SPY), so benchmarks can have as many symbols as they like.
+class CountingSource : public SimBrokerForwardingDataSource {
+  public:
+    std::atomic<uint64_t> calls = 0;
+
+    CountingSource(SimBrokerStockDataSource* source) : SimBrokerForwardingDataSource(source) {}
+
+  protected:
+    // Batches are one call each, like they would be for a source that answers them in one query
+    void called() { this->calls++; }
+
+    std::string ticker(std::string t) {
+      while (t.size() > 0 && isdigit(t.back())) t.pop_back();
+      return t;
+    }
+};
+
+CountingSource* counted;
+
+// Every benchmark's results, for --json and --check. Names are "section/benchmark".
+struct Result {
+  std::string name;
+  double nsPerOp;
+  double allocsPerOp;
+  double bytesPerOp; // Reported, but --check doesn't fail on it
+  double callsPerOp;
+  // Allowed slowdown against the baseline's ns/op before --check fails, as a fraction. Counts only
+  // get a little slack (countTolerance) since they should be exactly the same run to run.
+  double tolerance;
+};
+std::vector<Result> results;
+std::string section;
+
+const double countTolerance = 0.01;
+
+// Slowdowns of less than this many ns/op never count, whatever the tolerance: at tens of nanoseconds
+// per op, timer and scheduling jitter alone is tens of percent
+const double noiseFloorNs = 50;
+
+// Identifies the machine a baseline was recorded on, since timings only compare on the same one
+std::string machineId() {
+  char host[256] = "";
+  gethostname(host, sizeof(host)-1);
+
+  std::string cpu = "unknown CPU";
+  std::ifstream info("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(info, line)) {
+    if (line.rfind("model name", 0) != 0) continue;
+    size_t colon = line.find(':');
+    if (colon != std::string::npos) cpu = line.substr(line.find_first_not_of(' ', colon+1));
+    break;
+  }
+
+  return std::string(host)+", "+cpu+", "+std::to_string(std::thread::hardware_concurrency())+" threads";
+}
+
+void startSection(std::string name) {
+  section = name;
+  printf(BYEL "%s\n" RESET, name.c_str());
+}
+
+// Runs op ops times in batches, calling setup (untimed) before each batch. unitsPerOp divides the
+// results further, e.g. to report per bar when every op walks a known number of bars.
+//
+// The whole run is repeated and the median kept. A minimum is thrown off by a single lucky round
+// (e.g. one that ran at a boosted clock), a median only by most rounds being off. tolerance is the
+// slowdown --check allows (see Result), set per benchmark by how noisy it is.
+const int rounds = 5;
+
+void bench(std::string name, uint64_t ops, uint64_t batch, std::function<void()> setup,
+           std::function<void(uint64_t i)> op, uint64_t unitsPerOp = 1, double tolerance = 0.25) {
+  std::vector<std::chrono::nanoseconds> times;
+  AllocCounts allocs;
+  uint64_t calls = 0;
+
+  for (int round = 0; round < rounds; round++) {
+    std::chrono::nanoseconds elapsed(0);
+    allocs = {};
+    calls = 0;
+
+    for (uint64_t i = 0; i < ops;) {
+      setup();
+
+      AllocCounts allocsBefore = allocTracker::now();
+      uint64_t callsBefore = counted->calls;
+      auto begin = std::chrono::steady_clock::now();
+      for (uint64_t j = 0; j < batch && i < ops; j++, i++) op(i);
+      elapsed += std::chrono::steady_clock::now()-begin;
+      AllocCounts used = allocTracker::now()-allocsBefore;
+      allocs.allocations += used.allocations;
+      allocs.bytes += used.bytes;
+      calls += counted->calls-callsBefore;
+    }
+
+    times.push_back(elapsed);
+  }
+  std::sort(times.begin(), times.end());
+  std::chrono::nanoseconds elapsed = times[times.size()/2];
+
+  double units = ops*unitsPerOp;
+  printf("%-56s %12.0f %10.1f %10.0f %10.2f\n", name.c_str(), elapsed.count()/units, allocs.allocations/units,
+         allocs.bytes/units, calls/units);
+  results.push_back({section+"/"+name, elapsed.count()/units, allocs.allocations/units, allocs.bytes/units,
+                     calls/units, tolerance});
+}
+
+const uint64_t spyStart = 1644854400; // Feb 14 2022, 11am EST
+const uint64_t gmeStart = 1610461800; // Jan 12 2021, market open
+
+void microBenchmarks(CountingSource& source) {
+  SimBroker broker(&source, spyStart, true);
+  auto fresh = [&broker](uint64_t start, bool margin) {
+    broker.reset(start, margin);
+    broker.addFunds(10000000);
+  };
+
+  printf(BWHT "%-56s %12s %10s %10s %10s\n" RESET, "", "ns/op", "allocs/op", "bytes/op", "calls/op");
+
+  startSection("placeOrder");
+  auto placeBench = [&](std::string name, SimBroker::OrderType type, int64_t qty, currency limit) {
+    bench(name, 2000, 200, [&]() { fresh(spyStart, true); }, [&](uint64_t) {
+      SimBroker::OrderPlan p = {};
+      p.symbol = "SPY";
+      p.qty = qty;
+      p.type = type;
+      p.limitPrice = limit;
+      p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+      broker.placeOrder(p);
+    });
+  };
+  placeBench("market, long", SimBroker::OrderType::MARKET, 1, 0);
+  placeBench("market, short", SimBroker::OrderType::MARKET, -1, 0);
+  placeBench("limit, long", SimBroker::OrderType::LIMIT, 1, 1);
+  placeBench("limit, short", SimBroker::OrderType::LIMIT, -1, 100000);
+
+  startSection("updateClock, one minute at a time");
+  for (uint64_t n : {10, 100, 1000}) {
+    bench(std::to_string(n)+" open limit orders", n >= 1000 ? 20 : 200, 20, [&]() {
+      fresh(spyStart, true);
+      for (uint64_t i = 0; i < n; i++) {
+        SimBroker::OrderPlan p = {};
+        p.symbol = "SPY"+std::to_string(i%10);
+        p.qty = 1;
+        p.type = SimBroker::OrderType::LIMIT;
+        p.limitPrice = 1;
+        p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+        broker.placeOrder(p);
+      }
+    }, [&](uint64_t) { broker.updateClock(broker.getClock()+60); });
+  }
+
+  startSection("getEquity / getBuyingPower");
+  for (uint64_t n : {1, 10, 100}) {
+    auto setup = [&]() {
+      fresh(spyStart, true);
+      broker.enableInstaFill();
+      for (uint64_t i = 0; i < n; i++) {
+        SimBroker::OrderPlan p = {};
+        p.symbol = "SPY"+std::to_string(i);
+        p.qty = (i%2 == 0) ? 1 : -1;
+        broker.placeOrder(p);
+      }
+      broker.updateClock(broker.getClock()+60);
+    };
+    // Around a microsecond with one position, where noise is a bigger fraction
+    double tolerance = n == 1 ? 0.5 : 0.25;
+    bench("getEquity, "+std::to_string(n)+" positions", 2000, 2000, setup, [&](uint64_t) { broker.getEquity(); }, 1, tolerance);
+    bench("getBuyingPower, "+std::to_string(n)+" positions", 2000, 2000, setup, [&](uint64_t) { broker.getBuyingPower(); }, 1, tolerance);
+  }
+
+  startSection("eachBar");
+  {
+    // A live order placed at the open gets its fill rescanned from there on every update
+    const uint64_t bars = 390;
+    bench("per bar, one live order placed a trading day ago", 100, 100, [&]() {
+      fresh(gmeStart, true);
+      SimBroker::OrderPlan p = {};
+      p.symbol = "GME";
+      p.qty = 1;
+      p.type = SimBroker::OrderType::LIMIT;
+      p.limitPrice = 1;
+      p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+      broker.placeOrder(p);
+      broker.updateClock(gmeStart+(bars*60));
+    }, [&](uint64_t) { broker.updateClock(broker.getClock()+1); }, bars, 0.5);
+  }
+
+  startSection("remainingDayTrades");
+  auto dayTradeSetup = [&](bool trades) {
+    return [&broker, &fresh, trades]() {
+      fresh(gmeStart, true);
+      if (!trades) return;
+      broker.enableInstaFill();
+      for (int i = 0; i < 2; i++) {
+        SimBroker::OrderPlan p = {};
+        p.symbol = "GME";
+        p.qty = 1;
+        broker.placeOrder(p);
+        broker.updateClock(broker.getClock()+60);
+        p.qty = -1;
+        broker.placeOrder(p);
+        broker.updateClock(broker.getClock()+60);
+      }
+    };
+  };
+  // Tens of nanoseconds, so timing noise is a bigger fraction
+  bench("no day trades", 100000, 100000, dayTradeSetup(false), [&](uint64_t) { broker.remainingDayTrades(); }, 1, 0.5);
+  bench("two day trades", 100000, 100000, dayTradeSetup(true), [&](uint64_t) { broker.remainingDayTrades(); }, 1, 0.5);
+}
+
+// Splits wall time between the parts of a backtest
+struct PhaseTimer {
+  std::chrono::nanoseconds total = std::chrono::nanoseconds(0);
+
+  template <typename F>
+  void time(F f) {
+    auto begin = std::chrono::steady_clock::now();
+    f();
+    this->total += std::chrono::steady_clock::now()-begin;
+  }
+
+  double ms() { return this->total.count()/1e6; }
+};
+
+// Peak resident set size since the last resetPeakRSS(). getrusage's ru_maxrss is the peak of the
+// whole process and never goes down, so every backtest after the biggest one would just report
+// the biggest one's peak. On Linux we reset the high-water mark (VmHWM) through
+// /proc/self/clear_refs before each run instead; elsewhere we fall back to ru_maxrss.
+void resetPeakRSS() {
+  std::ofstream f("/proc/self/clear_refs");
+  if (f) f << "5";
+}
+
+uint64_t peakRSSKiB() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.rfind("VmHWM:", 0) == 0) return std::stoull(line.substr(6));
+  }
+
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// A scripted strategy stepping the clock a minute at a time over [start, end). While the market is
+// open: a market order every hour (alternating buy/sell, so we go in and out of positions - and
+// shorts with margin) and a day limit order 0.1% off the price every 90 minutes. An account check
+// every 2 hours, open or not.
+void backtest(std::string name, SimBrokerStockDataSource* source, std::string symbol,
+              uint64_t start, uint64_t end, bool margin, bool instaFill) {
+  PhaseTimer updates, orders, account;
+  uint64_t minutes = 0;
+
+  resetPeakRSS();
+  AllocCounts allocsBefore = allocTracker::now();
+  auto begin = std::chrono::steady_clock::now();
+  SimBroker broker(source, start, margin);
+  broker.addFunds(100000);
+  if (instaFill) broker.enableInstaFill();
+
+  for (uint64_t t = start; t < end; t += 60, minutes++) {
+    updates.time([&]() { broker.updateClock(t); });
+    bool open = source->getMarketPhase(t) == SimBrokerStockDataSource::MarketPhase::OPEN;
+
+    if (open && minutes%60 == 0) {
+      orders.time([&]() {
+        SimBroker::OrderPlan p = {};
+        p.symbol = symbol;
+        p.qty = (minutes/60)%2 == 0 ? 10 : -10;
+        broker.placeOrder(p);
+      });
+    }
+
+    if (open && minutes%90 == 0) {
+      orders.time([&]() {
+        currency price = source->getPrice(symbol, t);
+        if (price <= 0) return;
+
+        SimBroker::OrderPlan p = {};
+        p.symbol = symbol;
+        p.qty = (minutes/90)%2 == 0 ? 5 : -5;
+        p.type = SimBroker::OrderType::LIMIT;
+        p.limitPrice = p.qty > 0 ? price*0.999 : price*1.001;
+        broker.placeOrder(p);
+      });
+    }
+
+    if (minutes%120 == 0) {
+      account.time([&]() {
+        broker.getEquity();
+        broker.getBuyingPower();
+      });
+    }
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+  printf("%-40s %12.0f %9.0f %9.0f %9.0f %10ld\n", name.c_str(), minutes/seconds,
+         updates.ms(), orders.ms(), account.ms(), peakRSSKiB());
+  // Per simulated minute. The source isn't counted, so no calls. A single run rather than a median
+  // of several (see bench()), so a little more slack.
+  AllocCounts allocs = allocTracker::now()-allocsBefore;
+  results.push_back({section+"/"+name, seconds*1e9/minutes, double(allocs.allocations)/minutes,
+                     double(allocs.bytes)/minutes, 0, 0.35});
+}
+
+void backtestBenchmarks(SimBrokerStockDataSource* source) {
+  printf(BWHT "%-40s %12s %9s %9s %9s %10s\n" RESET, "", "sim min/s", "clock ms", "order ms", "acct ms", "peak KiB");
+
+  struct DataSet {
+    std::string name;
+    std::string symbol;
+    uint64_t start;
+    uint64_t end;
+  };
+  std::vector<DataSet> sets = {
+    {"SPY month", "SPY", 1644224400, 1646700000}, // Feb 7 - Mar 8 2022
+    {"GME squeeze", "GME", 1609943400, 1614211200}, // Jan 6 - Feb 25 2021
+  };
+
+  for (auto& d : sets) {
+    startSection(d.name);
+    for (bool margin : {true, false}) {
+      for (bool instaFill : {false, true}) {
+        std::string name = std::string(margin ? "margin" : "cash")+(instaFill ? ", instaFill" : "");
+        backtest(name, source, d.symbol, d.start, d.end, margin, instaFill);
+      }
+    }
+  }
+}
+
+// One point on a scaling curve
+struct ScalingPoint {
+  std::string dimension;
+  uint64_t size;
+  std::string operation;
+  double nsPerOp;
+  double allocsPerOp;
+  double callsPerOp;
+};
+
+// Times op until it's had 100ms or maxOps calls, whichever comes first
+ScalingPoint measure(std::function<void()> op, uint64_t maxOps) {
+  AllocCounts allocsBefore = allocTracker::now();
+  uint64_t callsBefore = counted->calls;
+  auto begin = std::chrono::steady_clock::now();
+
+  uint64_t ops = 0;
+  std::chrono::nanoseconds elapsed(0);
+  while (ops < maxOps && elapsed < std::chrono::milliseconds(100)) {
+    op();
+    ops++;
+    elapsed = std::chrono::steady_clock::now()-begin;
+  }
+
+  AllocCounts allocs = allocTracker::now()-allocsBefore;
+  return {"", 0, "", double(elapsed.count())/ops, double(allocs.allocations)/ops,
+          double(counted->calls-callsBefore)/ops};
+}
+
+void scalingBenchmarks(CountingSource& source, std::string csvPath, uint64_t maxSize) {
+  SimBroker broker(&source, spyStart, true);
+  std::vector<ScalingPoint> points;
+
+  auto fresh = [&broker](uint64_t start) {
+    broker.reset(start, true);
+    broker.addFunds(1000000000);
+  };
+
+  // A GTC limit order that won't fill (or, with instaFill, a market order that fills immediately)
+  auto place = [&broker](std::string symbol, bool fill) {
+    SimBroker::OrderPlan p = {};
+    p.symbol = symbol;
+    p.qty = 1;
+    if (!fill) {
+      p.type = SimBroker::OrderType::LIMIT;
+      p.limitPrice = 1;
+      p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+    }
+    broker.placeOrder(p);
+  };
+
+  // Printed as we go, with the exponent of each step: the k in cost ~ size^k between this point and
+  // the last for the same operation (~0 is constant, ~1 linear, ~2 quadratic)
+  printf(BWHT "%-12s %8s %-16s %14s %10s %10s %9s\n" RESET, "", "size", "", "ns/op", "allocs/op", "calls/op", "exponent");
+  auto record = [&points](ScalingPoint p) {
+    std::string exponent = "";
+    for (size_t j = points.size(); j-- > 0;) {
+      auto& prev = points[j];
+      if (prev.dimension != p.dimension) break;
+      if (prev.operation != p.operation) continue;
+      char e[16];
+      snprintf(e, sizeof(e), "%.2f", std::log(p.nsPerOp/prev.nsPerOp)/std::log(double(p.size)/prev.size));
+      exponent = e;
+      break;
+    }
+    printf("%-12s %8lu %-16s %14.0f %10.1f %10.2f %9s\n", p.dimension.c_str(), p.size, p.operation.c_str(),
+           p.nsPerOp, p.allocsPerOp, p.callsPerOp, exponent.c_str());
+    points.push_back(p);
+  };
+
+  // Times each operation against the book setup() builds. They share the book - placing a few
+  // orders more or moving the clock on a few minutes doesn't change its size much, and building
+  // the biggest books takes far longer than measuring them.
+  auto point = [&](std::string dimension, uint64_t size, std::function<void()> setup) {
+    struct Operation {
+      std::string name;
+      std::function<void()> op;
+      uint64_t maxOps;
+    };
+    // placeOrder last, so the orders it adds aren't in the book the others see
+    std::vector<Operation> operations = {
+      {"getBuyingPower", [&]() { broker.getBuyingPower(); }, 1000},
+      {"updateClock", [&]() { broker.updateClock(broker.getClock()+60); }, 30},
+      {"placeOrder", [&]() { place("SPY", false); }, 100},
+    };
+
+    setup();
+    for (auto& o : operations) {
+      ScalingPoint p = measure(o.op, o.maxOps);
+      p.dimension = dimension;
+      p.size = size;
+      p.operation = o.name;
+      record(p);
+    }
+  };
+
+  startSection("Open orders, over 10 symbols");
+  for (uint64_t n : {10, 100, 1000, 10000, 100000}) {
+    if (n > maxSize) break;
+    point("orders", n, [&, n]() {
+      fresh(spyStart);
+      for (uint64_t i = 0; i < n; i++) place("SPY"+std::to_string(i%10), false);
+    });
+  }
+
+  startSection("Positions, one per symbol");
+  for (uint64_t n : {1, 10, 100, 1000, 5000}) {
+    if (n > maxSize) break;
+    point("positions", n, [&, n]() {
+      fresh(spyStart);
+      broker.enableInstaFill();
+      for (uint64_t i = 0; i < n; i++) place("SPY"+std::to_string(i), true);
+      broker.disableInstaFill();
+    });
+  }
+
+  startSection("Symbols, 1000 open orders over them");
+  for (uint64_t n : {1, 10, 100, 1000}) {
+    if (n > maxSize) break;
+    point("symbols", n, [&, n]() {
+      fresh(spyStart);
+      for (uint64_t i = 0; i < 1000; i++) place("SPY"+std::to_string(i%n), false);
+    });
+  }
+
+  // How much history every update rescans: 100 live orders placed this many trading days ago
+  startSection("History, 100 live orders placed N trading days ago");
+  for (uint64_t n : {1, 5, 10, 20}) {
+    point("historyDays", n, [&, n]() {
+      fresh(gmeStart);
+      for (uint64_t i = 0; i < 100; i++) place("GME"+std::to_string(i%10), false);
+
+      uint64_t t = gmeStart;
+      for (uint64_t day = 0; day < n; day++) {
+        t = source.getNextMarketPhaseChangeTo(t+1, SimBrokerStockDataSource::MarketPhase::OPEN).time;
+      }
+      broker.updateClock(t+3600);
+    });
+  }
+
+  if (csvPath != "") {
+    std::ofstream csv(csvPath);
+    csv << "dimension,size,operation,ns_per_op,allocs_per_op,calls_per_op\n";
+    for (auto& p : points) {
+      csv << p.dimension << "," << p.size << "," << p.operation << "," << p.nsPerOp << "," << p.allocsPerOp << ","
+          << p.callsPerOp << "\n";
+    }
+    printf("\nWrote scaling results to %s\n", csvPath.c_str());
+  }
+}
+
+std::string jsonString(const std::string& s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') out += '\\';
+    out += c;
+  }
+  return out+"\"";
+}
+
+std::string resultsJSON(const std::vector<Result>& results) {
+  std::ostringstream out;
+  out << "{\n  \"machine\": " << jsonString(machineId()) << ",\n  \"benchmarks\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result& r = results[i];
+    char numbers[256];
+    snprintf(numbers, sizeof(numbers),
+             "\"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f, \"calls_per_op\": %.2f, \"tolerance\": %.2f",
+             r.nsPerOp, r.allocsPerOp, r.bytesPerOp, r.callsPerOp, r.tolerance);
+    out << (i > 0 ? ",\n" : "\n") << "    {\"name\": " << jsonString(r.name) << ", " << numbers << "}";
+  }
+  out << "\n  ]\n}\n";
+  return out.str();
+}
+
+struct Baseline {
+  std::string machine; // machineId() of where it was recorded, empty if unknown
+  std::map<std::string, Result> results;
+};
+
+// Reads back what resultsJSON writes - any JSON will do as long as it has a "benchmarks" array of
+// objects with the same fields, so baselines can be edited by hand (e.g. to loosen a tolerance).
+class BaselineReader {
+  public:
+    BaselineReader(std::string text) : text(text) {}
+
+    Baseline read() {
+      Baseline baseline;
+      this->expect('{');
+      while (!this->consume('}')) {
+        std::string key = this->string();
+        this->expect(':');
+        if (key == "machine") {
+          baseline.machine = this->string();
+        } else if (key != "benchmarks") {
+          this->skipValue();
+        } else {
+          this->expect('[');
+          while (!this->consume(']')) {
+            Result r = this->result();
+            baseline.results[r.name] = r;
+            this->consume(',');
+          }
+        }
+        this->consume(',');
+      }
+      return baseline;
+    }
+
+  private:
+    std::string text;
+    size_t pos = 0;
+
+    void skipSpace() {
+      while (this->pos < this->text.size() && isspace(this->text[this->pos])) this->pos++;
+    }
+
+    bool consume(char c) {
+      this->skipSpace();
+      if (this->pos < this->text.size() && this->text[this->pos] == c) {
+        this->pos++;
+        return true;
+      }
+      return false;
+    }
+
+    void expect(char c) {
+      if (!this->consume(c)) throw std::runtime_error(std::string("Bad baseline: expected '")+c+"' at offset "+std::to_string(this->pos));
+    }
+
+    std::string string() {
+      this->expect('"');
+      std::string out;
+      while (this->pos < this->text.size() && this->text[this->pos] != '"') {
+        if (this->text[this->pos] == '\\') this->pos++;
+        if (this->pos < this->text.size()) out += this->text[this->pos++];
+      }
+      this->expect('"');
+      return out;
+    }
+
+    double number() {
+      this->skipSpace();
+      size_t used = 0;
+      double n = std::stod(this->text.substr(this->pos, 64), &used);
+      this->pos += used;
+      return n;
+    }
+
+    void skipValue() {
+      this->skipSpace();
+      if (this->pos >= this->text.size()) throw std::runtime_error("Bad baseline: unexpected end");
+      char c = this->text[this->pos];
+      if (c == '"') {
+        this->string();
+      } else if (c == '{' || c == '[') {
+        char close = c == '{' ? '}' : ']';
+        this->pos++;
+        while (!this->consume(close)) {
+          if (c == '{') {
+            this->string();
+            this->expect(':');
+          }
+          this->skipValue();
+          this->consume(',');
+        }
+      } else if (isalpha(c)) {
+        while (this->pos < this->text.size() && isalpha(this->text[this->pos])) this->pos++;
+      } else {
+        this->number();
+      }
+    }
+
+    Result result() {
+      Result r = {"", 0, 0, 0, 0, 0.25};
+      this->expect('{');
+      while (!this->consume('}')) {
+        std::string key = this->string();
+        this->expect(':');
+        if (key == "name") r.name = this->string();
+        else if (key == "ns_per_op") r.nsPerOp = this->number();
+        else if (key == "allocs_per_op") r.allocsPerOp = this->number();
+        else if (key == "bytes_per_op") r.bytesPerOp = this->number();
+        else if (key == "calls_per_op") r.callsPerOp = this->number();
+        else if (key == "tolerance") r.tolerance = this->number();
+        else this->skipValue();
+        this->consume(',');
+      }
+      return r;
+    }
+};
+
+Baseline readBaseline(std::string path) {
+  std::ifstream in(path);
+  if (!in) throw std::runtime_error("Can't open baseline "+path);
+  std::stringstream text;
+  text << in.rdbuf();
+  return BaselineReader(text.str()).read();
+}
+
+// Prints how each result compares to the baseline. Returns the number of regressions: a benchmark
+// doing more allocations or data source calls than before, or - if checkTimes - one slower than its
+// tolerance allows by more than noiseFloorNs. Benchmarks that aren't in both are reported but don't
+// count.
+int checkResults(const std::vector<Result>& results, const std::map<std::string, Result>& baseline, bool checkTimes) {
+  printf(BWHT "%-64s %12s %12s %8s %10s %10s\n" RESET, "", "base ns/op", "ns/op", "change", "allocs/op", "calls/op");
+
+  auto countRegressed = [](double base, double now) {
+    return now > base*(1+countTolerance)+0.005;
+  };
+
+  int regressions = 0;
+  for (auto& r : results) {
+    auto it = baseline.find(r.name);
+    if (it == baseline.end()) {
+      printf("%-64s %12s %12.0f %8s\n", r.name.c_str(), "-", r.nsPerOp, "new");
+      continue;
+    }
+
+    const Result& b = it->second;
+    double change = b.nsPerOp > 0 ? (r.nsPerOp/b.nsPerOp)-1 : 0;
+    bool slower = checkTimes && change > b.tolerance && r.nsPerOp-b.nsPerOp > noiseFloorNs;
+    bool moreAllocs = countRegressed(b.allocsPerOp, r.allocsPerOp);
+    bool moreCalls = countRegressed(b.callsPerOp, r.callsPerOp);
+
+    // Counts show "was>now" when they went up
+    char allocs[32], calls[32];
+    if (moreAllocs) snprintf(allocs, sizeof(allocs), "%.1f>%.1f", b.allocsPerOp, r.allocsPerOp);
+    else snprintf(allocs, sizeof(allocs), "%.1f", r.allocsPerOp);
+    if (moreCalls) snprintf(calls, sizeof(calls), "%.2f>%.2f", b.callsPerOp, r.callsPerOp);
+    else snprintf(calls, sizeof(calls), "%.2f", r.callsPerOp);
+
+    bool regressed = slower || moreAllocs || moreCalls;
+    if (regressed) regressions++;
+    printf("%s%-64s %12.0f %12.0f %+7.0f%% %10s %10s%s\n", regressed ? BRED : "", r.name.c_str(),
+           b.nsPerOp, r.nsPerOp, change*100, allocs, calls, regressed ? RESET : "");
+  }
+
+  for (auto& [name, b] : baseline) {
+    bool ran = false;
+    for (auto& r : results) ran = ran || r.name == name;
+    if (!ran) printf("%-64s %12.0f %12s %8s\n", name.c_str(), b.nsPerOp, "-", "not run");
+  }
+
+  return regressions;
+}
+
+int main(int argc, char** argv) {
+  bool micro = false;
+  bool backtests = false;
+  bool scaling = false;
+  std::string jsonPath, checkPath, csvPath;
+  uint64_t maxSize = 10000;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "micro") == 0) {
+      micro = true;
+    } else if (strcmp(argv[i], "backtest") == 0) {
+      backtests = true;
+    } else if (strcmp(argv[i], "scaling") == 0) {
+      scaling = true;
+    } else if (strcmp(argv[i], "--json") == 0 && i+1 < argc) {
+      jsonPath = argv[++i];
+    } else if (strcmp(argv[i], "--check") == 0 && i+1 < argc) {
+      checkPath = argv[++i];
+    } else if (strcmp(argv[i], "--csv") == 0 && i+1 < argc) {
+      csvPath = argv[++i];
+    } else if (strcmp(argv[i], "--max-size") == 0 && i+1 < argc) {
+      maxSize = std::stoull(argv[++i]);
+    } else {
+      fprintf(stderr, "Usage: %s [micro|backtest|scaling]... [--json out.json] [--check baseline.json] [--csv out.csv] [--max-size n]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (!micro && !backtests && !scaling) micro = backtests = true;
+
+  // Read the baseline first so a bad path doesn't waste a run
+  Baseline baseline;
+  if (checkPath != "") {
+    try {
+      baseline = readBaseline(checkPath);
+    } catch (std::exception& e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 2;
+    }
+  }
+
+  auto loadBegin = std::chrono::steady_clock::now();
+  SimBrokerMemoryDataSource memSource;
+  memSource.loadBarsFile("test/data/bars.testdata");
+  memSource.loadCalendarFile("test/data/calendar.testdata");
+  memSource.freeze();
+  double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-loadBegin).count();
+  printf("Loaded test data in %.1fms\n\n", loadMs);
+
+  CountingSource source(&memSource);
+  counted = &source;
+
+  if (micro) microBenchmarks(source);
+  if (micro && backtests) printf("\n");
+  if (backtests) backtestBenchmarks(&memSource);
+  if ((micro || backtests) && scaling) printf("\n");
+  if (scaling) scalingBenchmarks(source, csvPath, maxSize);
+
+  if (jsonPath != "") {
+    // Keep tolerances that were loosened by hand in the file we're replacing
+    std::map<std::string, Result> previous;
+    try { previous = readBaseline(jsonPath).results; } catch (std::exception&) {}
+    std::vector<Result> out = results;
+    for (auto& r : out) {
+      auto it = previous.find(r.name);
+      if (it != previous.end()) r.tolerance = it->second.tolerance;
+    }
+
+    std::ofstream file(jsonPath);
+    file << resultsJSON(out);
+    printf("\nWrote results to %s\n", jsonPath.c_str());
+  }
+
+  if (checkPath != "") {
+    printf("\n");
+    bool sameMachine = baseline.machine == machineId();
+    if (!sameMachine) {
+      printf("Baseline was recorded on %s, this is %s: timings are only reported, not checked\n\n",
+             baseline.machine == "" ? "an unknown machine" : baseline.machine.c_str(), machineId().c_str());
+    }
+    int regressions = checkResults(results, baseline.results, sameMachine);
+    if (regressions > 0) {
+      printf(BRED "\n%d benchmark(s) regressed against %s\n" RESET, regressions, checkPath.c_str());
+      return 1;
+    }
+    printf("\nNo regressions against %s\n", checkPath.c_str());
+  }
+
+  return 0;
+}
@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <tuple>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Generates synthetic market data for stress tests and benchmarks that need more than test/data
+// holds: minute bars for as many tickers and years as you like, plus the matching calendar, in the
+// same formats as test/mkTestData.cpp writes (see the end of that file) - so
+// SimBrokerMemoryDataSource::loadBarsFile/loadCalendarFile load them as they are.
+//
+// build/mkSynthData [--tickers n] [--start YYYY-MM-DD] [--days n] [--seed n] [--out dir]
+//
+// The output depends only on the arguments: the same seed gives the same bytes on every run on the
+// same platform and C library. Elsewhere prices may differ in the last digits, since libm's log,
+// exp, sin, cos and pow aren't guaranteed to round the same everywhere.
+// Each ticker's data depends only on the seed and its index, so asking for more tickers adds
+// tickers without changing the existing ones.
+//
+// What it models, roughly:
+// - An NYSE-style calendar: weekends and the usual market holidays off, 1pm early closes, open and
+//   close in New York time (so DST shifts them in UTC)
+// - Prices as a random walk with per-ticker volatility and drift, with overnight gaps and the odd
+//   news jump
+// - A U-shaped intraday volume profile, and sparse extended hours (4am-9:30am, 4pm-8pm) bars
+// - Missing minutes where nothing traded - rarely for liquid tickers, often for illiquid ones
+// - Trading halts: stretches of the regular session with no bars, reopening at a new price
+
+// Deterministic randomness. std::mt19937_64 is fully specified but std's distributions aren't, so
+// this does its own: splitmix64 for the generator, Box-Muller for normals.
+class Random {
+  public:
+    Random(uint64_t seed) : state(seed) {}
+
+    uint64_t next() {
+      uint64_t z = (this->state += 0x9e3779b97f4a7c15);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+      return z ^ (z >> 31);
+    }
+
+    // [0, 1)
+    double uniform() { return (this->next() >> 11) * (1.0/9007199254740992.0); }
+
+    double uniform(double lo, double hi) { return lo+(hi-lo)*this->uniform(); }
+
+    double normal() {
+      if (this->haveSpare) {
+        this->haveSpare = false;
+        return this->spare;
+      }
+      double u = 1-this->uniform(); // (0, 1]
+      double v = this->uniform();
+      double r = std::sqrt(-2*std::log(u));
+      this->spare = r*std::sin(2*M_PI*v);
+      this->haveSpare = true;
+      return r*std::cos(2*M_PI*v);
+    }
+
+    bool chance(double p) { return this->uniform() < p; }
+
+  private:
+    uint64_t state;
+    bool haveSpare = false;
+    double spare = 0;
+};
+
+// Civil dates, proleptic Gregorian (after Howard Hinnant's algorithms)
+struct Date {
+  int year;
+  int month; // 1-12
+  int day;   // 1-31
+};
+
+int64_t daysFromCivil(Date d) {
+  int y = d.year - (d.month <= 2);
+  int64_t era = (y >= 0 ? y : y-399) / 400;
+  unsigned yoe = unsigned(y - era*400);
+  unsigned doy = (153*(d.month + (d.month > 2 ? -3 : 9)) + 2)/5 + d.day-1;
+  unsigned doe = yoe*365 + yoe/4 - yoe/100 + doy;
+  return era*146097 + int64_t(doe) - 719468;
+}
+
+Date civilFromDays(int64_t z) {
+  z += 719468;
+  int64_t era = (z >= 0 ? z : z-146096) / 146097;
+  unsigned doe = unsigned(z - era*146097);
+  unsigned yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+  int y = int(yoe) + era*400;
+  unsigned doy = doe - (365*yoe + yoe/4 - yoe/100);
+  unsigned mp = (5*doy + 2)/153;
+  int d = doy - (153*mp+2)/5 + 1;
+  int m = mp < 10 ? mp+3 : mp-9;
+  return {y + (m <= 2), m, d};
+}
+
+// 0 = Sunday
+int weekday(int64_t days) { return int((days+4) % 7 + 7) % 7; }
+
+// The nth (1-based) given weekday of a month, or the last one for n = -1
+int64_t nthWeekday(int year, int month, int wd, int n) {
+  if (n < 0) {
+    int64_t last = daysFromCivil({month == 12 ? year+1 : year, month == 12 ? 1 : month+1, 1})-1;
+    return last - ((weekday(last)-wd+7) % 7);
+  }
+  int64_t first = daysFromCivil({year, month, 1});
+  return first + ((wd-weekday(first)+7) % 7) + 7*(n-1);
+}
+
+int64_t easter(int year) {
+  int a = year%19, b = year/100, c = year%100, d = b/4, e = b%4;
+  int f = (b+8)/25, g = (b-f+1)/3, h = (19*a+b-d-g+15)%30;
+  int i = c/4, k = c%4, l = (32+2*e+2*i-h-k)%7;
+  int m = (a+11*h+22*l)/451;
+  int month = (h+l-7*m+114)/31, day = ((h+l-7*m+114)%31)+1;
+  return daysFromCivil({year, month, day});
+}
+
+// A fixed-date holiday moves to Friday if it's on a Saturday, Monday if on a Sunday
+int64_t observed(int64_t days) {
+  if (weekday(days) == 6) return days-1;
+  if (weekday(days) == 0) return days+1;
+  return days;
+}
+
+bool isHoliday(int64_t days) {
+  Date d = civilFromDays(days);
+  int y = d.year;
+  std::vector<int64_t> holidays = {
+    nthWeekday(y, 1, 1, 3),  // Martin Luther King Jr. Day
+    nthWeekday(y, 2, 1, 3),  // Washington's Birthday
+    easter(y)-2,             // Good Friday
+    nthWeekday(y, 5, 1, -1), // Memorial Day
+    observed(daysFromCivil({y, 7, 4})),
+    nthWeekday(y, 9, 1, 1),  // Labor Day
+    nthWeekday(y, 11, 4, 4), // Thanksgiving
+    observed(daysFromCivil({y, 12, 25})),
+  };
+  // New Year's Day on a Saturday isn't made up for on the Friday before
+  int64_t newYear = daysFromCivil({y, 1, 1});
+  if (weekday(newYear) != 6) holidays.push_back(observed(newYear));
+  if (y >= 2022) holidays.push_back(observed(daysFromCivil({y, 6, 19}))); // Juneteenth
+
+  return std::find(holidays.begin(), holidays.end(), days) != holidays.end();
+}
+
+// Closes at 1pm: the day before Independence Day, the day after Thanksgiving, Christmas Eve
+bool isEarlyClose(int64_t days) {
+  Date d = civilFromDays(days);
+  if (days == nthWeekday(d.year, 11, 4, 4)+1) return true;
+  if (d.month == 12 && d.day == 24) return true;
+  if (d.month == 7 && d.day == 3 && weekday(days+1) != 6 && weekday(days+1) != 0) return true;
+  return false;
+}
+
+// US daylight saving (as of 2007): second Sunday in March to first Sunday in November
+int utcOffsetHours(int64_t days) {
+  Date d = civilFromDays(days);
+  int64_t start = nthWeekday(d.year, 3, 0, 2);
+  int64_t end = nthWeekday(d.year, 11, 0, 1);
+  return (days >= start && days < end) ? -4 : -5;
+}
+
+// Unix time of a New York wall clock time
+uint64_t newYorkTime(int64_t days, int hour, int minute) {
+  return uint64_t(days*86400 + (hour*3600) + (minute*60) - (utcOffsetHours(days)*3600));
+}
+
+struct TradingDay {
+  int64_t days;
+  uint64_t open;
+  uint64_t close;
+};
+
+std::vector<TradingDay> calendar(int64_t firstDay, uint64_t count) {
+  std::vector<TradingDay> out;
+  for (int64_t d = firstDay; out.size() < count; d++) {
+    if (weekday(d) == 0 || weekday(d) == 6 || isHoliday(d)) continue;
+    out.push_back({d, newYorkTime(d, 9, 30), newYorkTime(d, isEarlyClose(d) ? 13 : 16, 0)});
+  }
+  return out;
+}
+
+// AAAA, AAAB, ... ZZZZ - letters only, since some test sources treat trailing digits as aliases
+const uint64_t maxTickers = 26*26*26*26;
+
+std::string tickerName(uint64_t i) {
+  std::string name = "AAAA";
+  for (int c = 3; c >= 0; c--, i /= 26) name[c] = 'A'+(i%26);
+  return name;
+}
+
+// Relative share of the day's volume traded in a regular session minute: heavy at the open and
+// close, quiet at lunch
+double volumeShape(double dayFraction) {
+  double x = dayFraction*2-1; // -1 at the open, 1 at the close
+  return 0.4 + 1.6*x*x + (dayFraction > 0.97 ? 2 : 0);
+}
+
+double roundPrice(double p) {
+  double tick = p < 1 ? 0.0001 : 0.01;
+  return std::max(tick, std::round(p/tick)*tick);
+}
+
+struct Writer {
+  FILE* f;
+  std::string ticker;
+  uint64_t bars = 0;
+
+  void bar(uint64_t time, double open, double close, double high, double low, uint64_t volume) {
+    fprintf(this->f, "%s,1Min:%lu,%lf,%lf,%lf,%lf,%lu\n", this->ticker.c_str(), time, open, close, high, low, volume);
+    this->bars++;
+  }
+};
+
+// Returns how many bars it wrote
+uint64_t generateTicker(uint64_t index, uint64_t seed, const std::vector<TradingDay>& days, FILE* f) {
+  Random r(seed ^ (0x51ed270b27a5e4d3*(index+1)));
+  Writer w = {f, tickerName(index)};
+
+  // Per-ticker character: a few liquid large caps, a long tail of thin, volatile small caps
+  double liquidity = std::pow(r.uniform(), 3);             // 0 (illiquid) - 1 (liquid)
+  double price = std::exp(r.uniform(std::log(2), std::log(800)));
+  double annualVol = 0.15 + (1-liquidity)*r.uniform(0.1, 1.0);
+  double annualDrift = r.normal()*0.1;
+  double dailyVolume = std::exp(r.uniform(std::log(2e4), std::log(5e5)) + liquidity*std::log(200));
+  double missingMinute = 0.002 + std::pow(1-liquidity, 2)*0.6; // Chance a regular minute has no trades
+  double extendedBar = 0.05 + liquidity*0.6;                   // Chance an extended hours minute has a bar
+  double haltChance = 0.001 + (1-liquidity)*0.01;              // Per day
+
+  double minuteVol = annualVol/std::sqrt(252.0*390);
+  double minuteDrift = annualDrift/(252.0*390);
+
+  auto step = [&](double vol) {
+    double open = price;
+    price = roundPrice(price*std::exp(minuteDrift + vol*r.normal()));
+    double wiggle = std::abs(r.normal())*vol*0.5;
+    double high = roundPrice(std::max(open, price)*(1+wiggle));
+    double low = roundPrice(std::min(open, price)*(1-wiggle));
+    return std::tuple(open, price, high, low);
+  };
+
+  for (auto& day : days) {
+    // Overnight gap, with the occasional earnings/news sized one
+    double gapVol = annualVol/std::sqrt(252.0)*0.5;
+    if (r.chance(0.01)) gapVol *= 8;
+    price = roundPrice(price*std::exp(gapVol*r.normal()));
+
+    double todaysVolume = dailyVolume*std::exp(0.4*r.normal());
+    uint64_t regularMinutes = (day.close-day.open)/60;
+
+    // A halt somewhere in the session: no bars for 5-30 minutes, then a jump
+    uint64_t haltStart = UINT64_MAX, haltEnd = 0;
+    if (r.chance(haltChance)) {
+      haltStart = day.open + 60*uint64_t(r.uniform(15, regularMinutes-45));
+      haltEnd = haltStart + 60*uint64_t(r.uniform(5, 30));
+    }
+
+    uint64_t preOpen = newYorkTime(day.days, 4, 0);
+    uint64_t postClose = day.close + 4*3600;
+    for (uint64_t t = preOpen; t < postClose; t += 60) {
+      bool regular = t >= day.open && t < day.close;
+
+      if (!regular) {
+        if (!r.chance(extendedBar)) continue;
+        auto [o, c, h, l] = step(minuteVol*0.5);
+        w.bar(t, o, c, h, l, std::max<uint64_t>(1, todaysVolume*0.0005*std::exp(r.normal())));
+        continue;
+      }
+
+      if (t >= haltStart && t < haltEnd) {
+        if (t+60 == haltEnd) price = roundPrice(price*std::exp(minuteVol*10*r.normal()));
+        continue;
+      }
+
+      double dayFraction = double(t-day.open)/(day.close-day.open);
+      double shape = volumeShape(dayFraction);
+      // Price moves even in minutes nothing trades; there's just no bar to show it
+      auto [o, c, h, l] = step(minuteVol*std::sqrt(shape));
+      if (r.chance(missingMinute/shape)) continue;
+
+      uint64_t volume = std::max<uint64_t>(1, todaysVolume/regularMinutes*shape*std::exp(0.5*r.normal()));
+      w.bar(t, o, c, h, l, volume);
+    }
+  }
+
+  return w.bars;
+}
+
+bool parseDate(const char* s, Date& d) {
+  return sscanf(s, "%d-%d-%d", &d.year, &d.month, &d.day) == 3 && d.month >= 1 && d.month <= 12 && d.day >= 1 && d.day <= 31;
+}
+
+int main(int argc, char** argv) {
+  uint64_t tickers = 100;
+  uint64_t tradingDays = 252;
+  uint64_t seed = 1;
+  Date start = {2020, 1, 2};
+  std::string out = "build/synthdata";
+
+  for (int i = 1; i < argc; i++) {
+    bool hasValue = i+1 < argc;
+    if (strcmp(argv[i], "--tickers") == 0 && hasValue) {
+      tickers = std::stoull(argv[++i]);
+    } else if (strcmp(argv[i], "--days") == 0 && hasValue) {
+      tradingDays = std::stoull(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && hasValue) {
+      seed = std::stoull(argv[++i]);
+    } else if (strcmp(argv[i], "--start") == 0 && hasValue && parseDate(argv[i+1], start)) {
+      i++;
+    } else if (strcmp(argv[i], "--out") == 0 && hasValue) {
+      out = argv[++i];
+    } else {
+      fprintf(stderr, "Usage: %s [--tickers n] [--start YYYY-MM-DD] [--days n] [--seed n] [--out dir]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if (tickers > maxTickers) {
+    fprintf(stderr, "At most %lu tickers\n", maxTickers);
+    return 2;
+  }
+
+  mkdir(out.c_str(), 0755);
+  std::vector<TradingDay> days = calendar(daysFromCivil(start), tradingDays);
+
+  FILE* fcal = fopen((out+"/calendar.synthdata").c_str(), "w");
+  if (fcal == NULL) {
+    perror(("Can't write to "+out).c_str());
+    return 1;
+  }
+  for (auto& d : days) fprintf(fcal, "%lu,%lu\n", d.open, d.close);
+  fclose(fcal);
+
+  FILE* f = fopen((out+"/bars.synthdata").c_str(), "w");
+  if (f == NULL) {
+    perror(("Can't write to "+out).c_str());
+    return 1;
+  }
+  static char buffer[1 << 20];
+  setvbuf(f, buffer, _IOFBF, sizeof(buffer));
+
+  printf("Generating %lu tickers over %lu trading days into %s\n", tickers, tradingDays, out.c_str());
+  uint64_t bars = 0;
+  for (uint64_t i = 0; i < tickers; i++) {
+    bars += generateTicker(i, seed, days, f);
+    if ((i+1)%100 == 0 || i+1 == tickers) printf("%lu/%lu tickers, %lu bars\n", i+1, tickers, bars);
+  }
+  fclose(f);
+
+  return 0;
+}
+
+// Files written (formats as test/data, see test/mkTestData.cpp):
+// <out>/bars.synthdata:     ticker,1Min:time,openprice,closeprice,highprice,lowprice,volume\n
+// <out>/calendar.synthdata: open,close\n
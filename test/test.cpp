@@ -1,10 +1,23 @@
 #include <stdio.h>
 #include <cstring>
 #include "simBroker.hpp"
+#include "simBrokerSweep.hpp"
+#include "simBrokerMemoryDataSource.hpp"
+#include "simBrokerGroup.hpp"
+#include "simBrokerPortfolio.hpp"
+#include "simBrokerAsyncDataSource.hpp"
+#include "simBrokerInstrumentedDataSource.hpp"
+#include "simBrokerForwardingDataSource.hpp"
+#include "simBrokerTracer.hpp"
+#include "allocTracker.hpp"
+#include <thread>
+#include <chrono>
 #include <stdexcept>
 #include <functional>
 #include <map>
 #include <cmath>
+#include <csignal>
+#include <atomic>
 
 // ANSI colors
 #define BLK "\x1B[0;30m"
@@ -157,7 +170,7 @@ class TestSimBrokerStockDataSource : SimBrokerStockDataSource {
       }
 
       FILE* fcal = fopen("test/data/calendar.testdata","r");
-      this->readLines(f, [this](std::string line) { this->addCalTestDataLine(line); });
+      this->readLines(fcal, [this](std::string line) { this->addCalTestDataLine(line); });
       fclose(fcal);
 
       // Make sure calendar is in order
@@ -198,7 +211,10 @@ class TestSimBrokerStockDataSource : SimBrokerStockDataSource {
 
     std::vector<Bar> getMinuteBars(std::string ticker, uint64_t startTime, uint64_t endTime) {
       std::vector<Bar> r;
-      for (auto bar : bars[ticker+"1Min"]) {
+      auto tickerBars = bars.find(ticker+"1Min");
+      if (tickerBars == bars.end()) return r;
+
+      for (auto bar : tickerBars->second) {
         if (bar.time >= startTime && bar.time < (endTime-60)) {
           r.push_back(bar);
         }
@@ -208,7 +224,10 @@ class TestSimBrokerStockDataSource : SimBrokerStockDataSource {
     }
 
     currency getPrice(std::string ticker, uint64_t time) {
-      for (auto bar : bars[ticker+"1Min"]) {
+      auto tickerBars = bars.find(ticker+"1Min");
+      if (tickerBars == bars.end()) throw std::logic_error("Failed to get price");
+
+      for (auto bar : tickerBars->second) {
         if (bar.time >= time) return bar.openPrice;
       }
       throw std::logic_error("Failed to get price");
@@ -300,6 +319,22 @@ class neverShortableSDC : TestSimBrokerStockDataSource {
   bool isTickerShortable([[maybe_unused]]std::string ticker, [[maybe_unused]]uint64_t time) { return false; };
 };
 
+// Counts calendar lookups, for tests that check we aren't walking the calendar repeatedly
+class calendarCountingSDC : TestSimBrokerStockDataSource {
+  public:
+    uint64_t calendarCalls = 0;
+
+    ::SimBrokerStockDataSource::MarketPhaseChange getNextMarketPhaseChangeTo(uint64_t time, ::SimBrokerStockDataSource::MarketPhase to) {
+      calendarCalls++;
+      return TestSimBrokerStockDataSource::getNextMarketPhaseChangeTo(time, to);
+    }
+
+    ::SimBrokerStockDataSource::MarketPhaseChange getPrevMarketPhaseChangeTo(uint64_t time, ::SimBrokerStockDataSource::MarketPhase to) {
+      calendarCalls++;
+      return TestSimBrokerStockDataSource::getPrevMarketPhaseChangeTo(time, to);
+    }
+};
+
 // This data source is needed for market open/close tests, to ensure that the SimBroker is
 // checking market state and not just passing open/close situation tests due to data availability
 class AlwaysBarsSource : SimBrokerStockDataSource {
@@ -372,6 +407,45 @@ class AlwaysBarsSource : SimBrokerStockDataSource {
   bool isTickerShortable([[maybe_unused]]std::string ticker, [[maybe_unused]]uint64_t time) { return true; };
 };
 
+// Every bar/price lookup takes a while, like a remote API would. Any ticker with trailing digits
+// ("GME2") is the same data as the ticker without them, so tests can have many symbols.
+class SlowSource : public SimBrokerForwardingDataSource {
+  private:
+    std::chrono::milliseconds latency;
+
+    void wait() {
+      this->requests++;
+      uint64_t now = ++this->inFlight;
+      uint64_t peak = this->peakInFlight;
+      while (now > peak && !this->peakInFlight.compare_exchange_weak(peak, now)) {}
+      std::this_thread::sleep_for(this->latency);
+      this->inFlight--;
+    }
+
+  protected:
+    std::string ticker(std::string t) {
+      while (t.size() > 0 && isdigit(t.back())) t.pop_back();
+      return t;
+    }
+
+  public:
+    std::atomic<uint64_t> requests = 0;
+    std::atomic<uint64_t> inFlight = 0;
+    std::atomic<uint64_t> peakInFlight = 0; // Most slow requests waiting at the same time
+
+    SlowSource(SimBrokerStockDataSource* source, std::chrono::milliseconds latency) : SimBrokerForwardingDataSource(source), latency(latency) {}
+
+    std::vector<Bar> getMinuteBars(std::string ticker, uint64_t startTime, uint64_t endTime) {
+      this->wait();
+      return SimBrokerForwardingDataSource::getMinuteBars(ticker, startTime, endTime);
+    }
+
+    currency getPrice(std::string ticker, uint64_t time) {
+      this->wait();
+      return SimBrokerForwardingDataSource::getPrice(ticker, time);
+    }
+};
+
 bool test(std::function<bool()> func, std::string msg) {
   try {
     return massert(msg, func());
@@ -2272,6 +2346,27 @@ int main() {
            (b2 < (b1-interestOwed)+0.001);
   }, "Buying stocks greater than our cash balance results in the correct *user-defined* interest rate being charged on the loaned portion of the transaction");
 
+  test([&mSource]() {
+    // The margin call handler forces the night-by-night path, so we can compare against it
+    SimBroker bulk((SimBrokerStockDataSource*)&mSource, 1610461800+3600, true); // Jan 12 2021, 1 hour after open
+    SimBroker nightly((SimBrokerStockDataSource*)&mSource, 1610461800+3600, true);
+    nightly.setMarginCallHandler([](){});
+
+    for (SimBroker* b : {&bulk, &nightly}) {
+      b->addFunds(1000);
+
+      SimBroker::OrderPlan p = {};
+      p.symbol = "GME";
+      p.qty = -5;
+      b->placeOrder(p);
+      b->updateClock(b->getClock()+3600);
+      b->rmFunds(1500); // Put the cash side into a loan as well
+      b->updateClock(b->getClock()+((3600*24)*14)); // 2 weeks
+    }
+
+    return bulk.getBalance() == nightly.getBalance() && bulk.getBalance() < nightly.getOrders()[0].filledAvgPrice*5-500;
+  }, "Large clock jumps with no open orders charge exactly the same interest and borrow fees as charging night by night");
+
   test([&mSource]() {
     SimBroker simBroker((SimBrokerStockDataSource*)&mSource, 1611856200, true); // Jan 28
     simBroker.addFunds(800); 
@@ -2694,6 +2789,28 @@ int main() {
     return simBroker.getEquity() == equityShouldBe;
   }, "Filled short orders of qty 110 with round lot fee enabled result in the correct (qty of 200) interest being charged");
 
+  test([&mSource]() {
+    SimBroker simBroker((SimBrokerStockDataSource*)&mSource, 1645650000-(4*3600), true); // 4 hours before market close
+    simBroker.addFunds(9000000);
+    simBroker.enableShortRoundLotFee();
+
+    SimBroker::OrderPlan p = {};
+    p.symbol = "SPY";
+    p.qty = -110;
+    simBroker.placeOrder(p);
+    simBroker.updateClock(simBroker.getClock()+(3600));
+    currency b1 = simBroker.getBalance();
+
+    simBroker.updateClock(simBroker.getClock()+(3600*9)); // Couple hours after postmarket
+    auto a = simBroker.getLastNightlyAccrual();
+    currency price = mSource.getPrice("SPY", a.time);
+    currency fee = ((price*200)*mSource.getAssetBorrowRate("SPY", a.time))/360;
+
+    return a.symbols.size() == 1 && a.symbols[0] == "SPY" && a.qtys[0] == 200 &&
+           a.prices[0] == price && a.fees[0] == fee && a.interest == 0 &&
+           simBroker.getBalance() == b1-fee;
+  }, "The nightly accrual breakdown reports the borrow fee charged for each short position");
+
   test([&mSource, &neverShortableSource]() {
     SimBroker simBroker((SimBrokerStockDataSource*)&mSource, 1645650000-(4*3600), true); // 4 hours before market close
     simBroker.addFunds(9000000);
@@ -2763,6 +2880,32 @@ int main() {
     return !marginCalled;
   }, "If the price doesn't rise enough while we are holding a short position, we don't get margin called");
 
+  test([&mSource]() {
+    SimBroker simBroker((SimBrokerStockDataSource*)&mSource, 1610461800+3600, true); // Jan 12 2021, 1 hour after open
+    simBroker.addFunds(60);
+    simBroker.disableShortRoundLotFee();
+
+    SimBroker::OrderPlan p = {};
+    p.symbol = "GME";
+    p.qty = -5;
+    simBroker.placeOrder(p);
+
+    // Walk through the squeeze, comparing the (screened) check to the full calculation every step
+    uint64_t mismatches = 0;
+    uint64_t calls = 0;
+    for (uint64_t t = simBroker.getClock()+3600; t < 1611856200; t += 1800) {
+      simBroker.updateClock(t);
+      if (mSource.getMarketPhase(t) != SimBrokerStockDataSource::MarketPhase::OPEN) continue;
+
+      bool full = simBroker.getEquity()/simBroker.getLoan() < simBroker.getMaintenanceMarginRequirement();
+      bool screened = simBroker.checkForMarginCall();
+      if (full != screened) mismatches++;
+      if (full) calls++;
+    }
+
+    return mismatches == 0 && calls > 0;
+  }, "Screened margin call checks agree with the full calculation as prices move");
+
   // PDT
   printf(BYEL "\nPDT: \n" RESET);
 
@@ -3229,6 +3372,1277 @@ int main() {
 		return simBroker.remainingDayTrades() == 3 && !PDTCalled;
 	}, "buy->sell on different days does not count as a round trip");
 
+	test([]() {
+	  calendarCountingSDC countingSource;
+	  SimBroker simBroker((SimBrokerStockDataSource*)&countingSource, 1644854400, true); // Feb 14 11am EST
+	  simBroker.addFunds(200000);
+
+		SimBroker::OrderPlan p = {};
+		p.symbol = "SPY";
+		p.qty = 1;
+		SimBroker::OrderPlan sp = p;
+		sp.qty = -1;
+
+		simBroker.placeOrder(p);
+		simBroker.updateClock(simBroker.getClock()+(60*5));
+		simBroker.placeOrder(sp);
+		simBroker.updateClock(simBroker.getClock()+(60*5));
+
+		int8_t remaining = simBroker.remainingDayTrades();
+		uint64_t calls = countingSource.calendarCalls;
+		for (int i = 0; i < 100; i++) remaining = simBroker.remainingDayTrades();
+
+		return remaining == 2 && countingSource.calendarCalls == calls;
+	}, "Repeated remainingDayTrades() calls don't walk the calendar");
+
+	test([&mSource]() {
+	  SimBroker simBroker((SimBrokerStockDataSource*)&mSource, 1644854400, true); // Feb 14 11am EST
+	  simBroker.addFunds(200000);
+
+		// Open the whole time, never fills
+		SimBroker::OrderPlan lp = {};
+		lp.symbol = "SPY";
+		lp.qty = 1;
+		lp.type = SimBroker::OrderType::LIMIT;
+		lp.limitPrice = 1;
+		lp.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+		simBroker.placeOrder(lp);
+
+		SimBroker::OrderPlan p = {};
+		p.symbol = "SPY";
+		p.qty = 1;
+		SimBroker::OrderPlan sp = p;
+		sp.qty = -1;
+
+		simBroker.placeOrder(p);
+		simBroker.updateClock(simBroker.getClock()+(60*5));
+		simBroker.updateClock(simBroker.getClock()+(60*5));
+		simBroker.placeOrder(sp);
+		simBroker.updateClock(simBroker.getClock()+(60*5));
+
+		return simBroker.remainingDayTrades() == 2;
+	}, "An open order in the same symbol that doesn't fill doesn't hide a round trip");
+
+	test([&mSource]() {
+		// The same position, one broker advancing minute by minute while an unfilled order is open
+		auto entryPrice = [&mSource](uint64_t step) {
+		  SimBroker simBroker((SimBrokerStockDataSource*)&mSource, 1644854400, true); // Feb 14 11am EST
+		  simBroker.addFunds(200000);
+
+			SimBroker::OrderPlan p = {};
+			p.symbol = "SPY";
+			p.qty = 1;
+			simBroker.placeOrder(p);
+			simBroker.updateClock(simBroker.getClock()+60);
+			p.qty = 2;
+			simBroker.placeOrder(p);
+			simBroker.updateClock(simBroker.getClock()+60);
+
+			p.qty = 1;
+			p.type = SimBroker::OrderType::LIMIT;
+			p.limitPrice = 1;
+			p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+			simBroker.placeOrder(p);
+
+			uint64_t end = simBroker.getClock()+(3600*3);
+			while (simBroker.getClock() < end) simBroker.updateClock(std::min(end, simBroker.getClock()+step));
+			return simBroker.getPositions()[0].avgEntryPrice;
+		};
+
+		return entryPrice(60) == entryPrice(3600*3);
+	}, "A position's entry price doesn't depend on how often the clock is advanced");
+
+  // In-memory data source
+  printf(BYEL "\nIn-memory data source: \n" RESET);
+
+  SimBrokerMemoryDataSource memSource;
+  memSource.loadBarsFile("test/data/bars.testdata");
+  memSource.loadCalendarFile("test/data/calendar.testdata");
+  memSource.freeze();
+
+  // A spread of times covering both data sets, market phases and data gaps
+  std::vector<uint64_t> sampleTimes;
+  for (uint64_t t = 1609943400-(3600*24); t < 1614215604; t += 3571) sampleTimes.push_back(t);
+  for (uint64_t t = 1644224400-(3600*24); t < 1646700737; t += 3571) sampleTimes.push_back(t);
+
+  test([&mSource, &memSource, &sampleTimes]() {
+    for (auto t : sampleTimes) {
+      for (std::string ticker : {"SPY", "GME"}) {
+        auto a = mSource.getMinuteBars(ticker, t, t+(60*90));
+        auto b = memSource.getMinuteBars(ticker, t, t+(60*90));
+        if (a.size() != b.size()) return false;
+        for (size_t i = 0; i < a.size(); i++) {
+          if (a[i].time != b[i].time || a[i].openPrice != b[i].openPrice || a[i].closePrice != b[i].closePrice ||
+              a[i].highPrice != b[i].highPrice || a[i].lowPrice != b[i].lowPrice || a[i].volume != b[i].volume) return false;
+        }
+
+        currency p;
+        try { p = mSource.getPrice(ticker, t); } catch (...) { p = -1; }
+        if (p != memSource.getPrice(ticker, t)) return false;
+      }
+    }
+    return true;
+  }, "SimBrokerMemoryDataSource returns the same bars and prices as the reference data source");
+
+  test([&mSource, &memSource, &sampleTimes]() {
+    using MP = SimBrokerStockDataSource::MarketPhase;
+    // Equal results, or both throw at the edges of the data
+    auto same = [](std::function<SimBrokerStockDataSource::MarketPhaseChange()> a,
+                   std::function<SimBrokerStockDataSource::MarketPhaseChange()> b) {
+      SimBrokerStockDataSource::MarketPhaseChange ca, cb;
+      bool aThrew = false;
+      bool bThrew = false;
+      try { ca = a(); } catch (const std::logic_error& e) { aThrew = true; }
+      try { cb = b(); } catch (const std::logic_error& e) { bThrew = true; }
+      if (aThrew || bThrew) return aThrew == bThrew;
+      return ca.from == cb.from && ca.to == cb.to && ca.time == cb.time;
+    };
+
+    for (auto t : sampleTimes) {
+      if (mSource.getMarketPhase(t) != memSource.getMarketPhase(t)) return false;
+      if (!same([&]() { return mSource.getNextMarketPhaseChange(t); }, [&]() { return memSource.getNextMarketPhaseChange(t); })) return false;
+      if (!same([&]() { return mSource.getPrevMarketPhaseChange(t); }, [&]() { return memSource.getPrevMarketPhaseChange(t); })) return false;
+      for (MP phase : {MP::PREMARKET, MP::OPEN, MP::POSTMARKET, MP::CLOSED}) {
+        if (!same([&]() { return mSource.getNextMarketPhaseChangeTo(t, phase); }, [&]() { return memSource.getNextMarketPhaseChangeTo(t, phase); })) return false;
+        if (!same([&]() { return mSource.getPrevMarketPhaseChangeTo(t, phase); }, [&]() { return memSource.getPrevMarketPhaseChangeTo(t, phase); })) return false;
+        if (!same([&]() { return mSource.getNextMarketPhaseChangeFrom(t, phase); }, [&]() { return memSource.getNextMarketPhaseChangeFrom(t, phase); })) return false;
+        if (!same([&]() { return mSource.getPrevMarketPhaseChangeFrom(t, phase); }, [&]() { return memSource.getPrevMarketPhaseChangeFrom(t, phase); })) return false;
+      }
+    }
+    return true;
+  }, "SimBrokerMemoryDataSource reports the same market phases as the reference data source");
+
+  test([&memSource]() {
+    try {
+      memSource.addCalendarDay(1, 2);
+    } catch (const std::logic_error& e) {
+      return true;
+    }
+    return false;
+  }, "SimBrokerMemoryDataSource can't be modified once frozen");
+
+  test([&mSource, &memSource]() {
+    auto run = [](SimBrokerStockDataSource* source) {
+      SimBroker simBroker(source, 1610461800+3600, true); // Jan 12 2021, 1 hour after open
+      simBroker.addFunds(1000);
+
+      SimBroker::OrderPlan p = {};
+      p.symbol = "GME";
+      p.qty = -5;
+      simBroker.placeOrder(p);
+      p.qty = 5;
+      p.type = SimBroker::OrderType::LIMIT;
+      p.limitPrice = 30;
+      p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+      simBroker.placeOrder(p);
+      simBroker.updateClock(simBroker.getClock()+((3600*24)*10));
+      return simBroker.getBalance();
+    };
+
+    return run((SimBrokerStockDataSource*)&mSource) == run(&memSource);
+  }, "A backtest against SimBrokerMemoryDataSource matches one against the reference data source");
+
+  test([&memSource, &sampleTimes]() {
+    std::vector<uint64_t> expected;
+    for (auto t : sampleTimes) expected.push_back(memSource.getMinuteBars("SPY", t, t+(60*90)).size());
+
+    std::atomic<uint64_t> mismatches = 0;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++) {
+      threads.emplace_back([&]() {
+        for (size_t j = 0; j < sampleTimes.size(); j++) {
+          if (memSource.getMinuteBars("SPY", sampleTimes[j], sampleTimes[j]+(60*90)).size() != expected[j]) mismatches++;
+        }
+      });
+    }
+    for (auto& t : threads) t.join();
+
+    return mismatches == 0;
+  }, "SimBrokerMemoryDataSource can be read from several threads at once");
+
+  // Sweeps
+  printf(BYEL "\nSweeps: \n" RESET);
+
+  test([]() {
+    auto g = SimBrokerSweep::grid({{"a", {1, 2, 3}}, {"b", {10, 20}}});
+    return g.size() == 6 && g[0].at("a") == 1 && g[0].at("b") == 10 && g[5].at("a") == 3 && g[5].at("b") == 20;
+  }, "SimBrokerSweep::grid produces every combination of parameter values");
+
+  test([&mSource]() {
+    SimBrokerSweep::BrokerConfig config;
+    config.startTime = 1644854400; // Feb 14 11am EST
+    config.funds = 100000;
+
+    auto strategy = [](SimBroker& broker, const SimBrokerSweep::Params& params) {
+      SimBroker::OrderPlan p = {};
+      p.symbol = "SPY";
+      p.qty = params.at("qty");
+      p.type = SimBroker::OrderType::LIMIT;
+      p.limitPrice = params.at("limit");
+      broker.placeOrder(p);
+      broker.updateClock(broker.getClock()+(3600*2));
+    };
+
+    auto params = SimBrokerSweep::grid({{"qty", {1, 5, 10}}, {"limit", {430, 445, 460}}});
+    SimBrokerSweep sweep((SimBrokerStockDataSource*)&mSource, config, 3);
+    auto results = sweep.run(params, strategy);
+
+    if (results.size() != params.size()) return false;
+    for (size_t i = 0; i < params.size(); i++) {
+      SimBroker simBroker((SimBrokerStockDataSource*)&mSource, config.startTime, false);
+      simBroker.addFunds(config.funds);
+      strategy(simBroker, params[i]);
+
+      if (results[i].failed || results[i].run != i || results[i].params != params[i]) return false;
+      if (results[i].balance != simBroker.getBalance() || results[i].equity != simBroker.getEquity()) return false;
+      if (results[i].positions.size() != simBroker.getPositions().size()) return false;
+    }
+
+    return true;
+  }, "Sweep runs on multiple threads give the same results as running each backtest directly");
+
+  test([&mSource]() {
+    SimBrokerSweep::BrokerConfig config;
+    config.startTime = 1644854400;
+    SimBrokerSweep sweep((SimBrokerStockDataSource*)&mSource, config, 2);
+    auto results = sweep.run({{}, {}}, [](SimBroker& broker, [[maybe_unused]]const SimBrokerSweep::Params& params) {
+      broker.updateClock(broker.getClock()-1);
+    });
+
+    return results.size() == 2 && results[0].failed && results[1].failed && results[0].error.size() > 0;
+  }, "Exceptions thrown in a sweep run are reported in its result");
+
+  // Scheduler
+  printf(BYEL "\nScheduler: \n" RESET);
+
+  test([]() {
+    SimBrokerScheduler scheduler(4);
+    std::atomic<uint64_t> sum = 0;
+    for (uint64_t i = 1; i <= 100; i++) scheduler.submit([&sum, i]([[maybe_unused]]auto& ctx) { sum += i; });
+    auto r1 = scheduler.run();
+
+    // The pool is reused for the next batch
+    for (uint64_t i = 1; i <= 10; i++) scheduler.submit([&sum, i]([[maybe_unused]]auto& ctx) { sum += i; });
+    auto r2 = scheduler.run();
+
+    return sum == 5050+55 && r1.completed == 100 && r2.completed == 10 && r1.cancelled == 0;
+  }, "SimBrokerScheduler runs every submitted job, batch after batch");
+
+  test([]() {
+    SimBrokerScheduler scheduler(1);
+    std::vector<int64_t> order;
+    for (int64_t p : {3, 9, 1, 5}) scheduler.submit([&order, p]([[maybe_unused]]auto& ctx) { order.push_back(p); }, p);
+    scheduler.run();
+    return order == std::vector<int64_t>({9, 5, 3, 1});
+  }, "SimBrokerScheduler starts higher priority jobs first");
+
+  test([]() {
+    SimBrokerScheduler scheduler(2);
+    for (int i = 0; i < 8; i++) {
+      scheduler.submit([i]([[maybe_unused]]auto& ctx) {
+        if (i == 0) std::this_thread::sleep_for(std::chrono::milliseconds(200));
+      }, (i == 0) ? 1 : 0);
+    }
+    auto r = scheduler.run();
+    return r.completed == 8 && r.stolen > 0;
+  }, "SimBrokerScheduler workers steal queued jobs from busy workers");
+
+  test([]() {
+    SimBrokerScheduler scheduler(1);
+    uint64_t ran = 0;
+    for (int i = 0; i < 10; i++) {
+      scheduler.submit([&ran](auto& ctx) {
+        ran++;
+        if (ran == 3) ctx.cancelRemaining();
+      });
+    }
+    auto r = scheduler.run();
+    return ran == 3 && r.completed == 3 && r.cancelled == 7;
+  }, "Cancelling a SimBrokerScheduler batch drops the jobs that haven't started");
+
+  test([&memSource]() {
+    SimBrokerSweep::BrokerConfig config;
+    config.startTime = 1644854400; // Feb 14 11am EST
+    config.funds = 100000;
+
+    SimBrokerSweep sweep(&memSource, config, 1);
+    sweep.setCostEstimate([](const SimBrokerSweep::Params& params) { return (int64_t)params.at("qty"); });
+
+    auto params = SimBrokerSweep::grid({{"qty", {1, 2, 3, 4, 5, 6}}});
+    auto results = sweep.run(params, [](SimBroker& broker, const SimBrokerSweep::Params& params) {
+      SimBroker::OrderPlan p = {};
+      p.symbol = "SPY";
+      p.qty = params.at("qty");
+      broker.placeOrder(p);
+      broker.updateClock(broker.getClock()+3600);
+    }, [](const SimBrokerSweep::Result& r) { return r.positions.size() > 0 && r.positions[0].qty <= 5; });
+
+    // Most expensive first: 6 and 5 run, then we stop
+    uint64_t cancelled = 0;
+    for (auto& r : results) if (r.cancelled) cancelled++;
+    return cancelled == 4 && !results[5].cancelled && !results[4].cancelled && results[5].positions[0].qty == 6;
+  }, "A sweep stops early once its stop condition is met, running the most expensive runs first");
+
+  printf(BYEL "\nBroker groups: \n" RESET);
+
+  auto groupScenario = [](SimBroker& broker, size_t i) {
+    broker.addFunds(1000*(i+1));
+
+    SimBroker::OrderPlan p = {};
+    p.symbol = "GME";
+    p.qty = -((int64_t)i+1);
+    broker.placeOrder(p);
+
+    p.qty = i+1;
+    p.type = SimBroker::OrderType::LIMIT;
+    p.limitPrice = 25+(i*5);
+    p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+    broker.placeOrder(p);
+
+    p = {};
+    p.symbol = "GME";
+    p.qty = 1;
+    p.type = SimBroker::OrderType::LIMIT;
+    p.limitPrice = 20;
+    broker.placeOrder(p);
+  };
+
+  test([&memSource, &groupScenario]() {
+    uint64_t start = 1610461800+3600; // Jan 12 2021, 1 hour after open
+    SimBrokerGroup group(&memSource, start, true, 4);
+    for (size_t i = 0; i < group.size(); i++) groupScenario(group.account(i), i);
+    for (uint64_t t = start; t < start+((3600*24)*10); t += 3600*7) group.updateClock(t);
+
+    auto balances = group.getBalances();
+    for (size_t i = 0; i < group.size(); i++) {
+      SimBroker simBroker(&memSource, start, true);
+      groupScenario(simBroker, i);
+      for (uint64_t t = start; t < start+((3600*24)*10); t += 3600*7) simBroker.updateClock(t);
+
+      if (simBroker.getBalance() != balances[i]) return false;
+      if (simBroker.getOrders().size() != group.account(i).getOrders().size()) return false;
+      for (size_t j = 0; j < simBroker.getOrders().size(); j++) {
+        if (simBroker.getOrders()[j].filledQty != group.account(i).getOrders()[j].filledQty) return false;
+        if (simBroker.getOrders()[j].status != group.account(i).getOrders()[j].status) return false;
+      }
+    }
+    return true;
+  }, "Accounts in a SimBrokerGroup end up where the same accounts would on their own");
+
+  test([&memSource, &groupScenario]() {
+    uint64_t start = 1610461800+3600;
+    SimBrokerGroup group(&memSource, start, true, 8);
+    for (size_t i = 0; i < group.size(); i++) groupScenario(group.account(i), i);
+    for (uint64_t t = start; t < start+(3600*24); t += 600) group.updateClock(t);
+
+    auto stats = group.getStats();
+    return stats.barRequests >= stats.barBlocksFetched*4 && stats.priceRequests > stats.pricesFetched;
+  }, "A SimBrokerGroup fetches bars once per symbol per update instead of once per account");
+
+  printf(BYEL "\nForks: \n" RESET);
+
+  test([&memSource]() {
+    uint64_t start = 1610461800+3600; // Jan 12 2021, 1 hour after open
+    auto prefix = [](SimBroker& simBroker) {
+      simBroker.addFunds(1000);
+
+      SimBroker::OrderPlan p = {};
+      p.symbol = "GME";
+      p.qty = -5;
+      simBroker.placeOrder(p);
+      p.qty = 2;
+      p.type = SimBroker::OrderType::LIMIT;
+      p.limitPrice = 30;
+      p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+      simBroker.placeOrder(p);
+      simBroker.updateClock(simBroker.getClock()+(3600*24));
+    };
+
+    SimBroker parent(&memSource, start, true);
+    prefix(parent);
+    SimBroker branch = parent.fork();
+
+    SimBroker::OrderPlan p = {};
+    p.symbol = "GME";
+    p.qty = 1;
+    branch.placeOrder(p);
+    branch.cancelOrder(1);
+    branch.updateClock(branch.getClock()+(3600*24*5));
+    parent.updateClock(parent.getClock()+(3600*24*5));
+
+    SimBroker reference(&memSource, start, true);
+    prefix(reference);
+    reference.updateClock(reference.getClock()+(3600*24*5));
+
+    return parent.getBalance() == reference.getBalance() &&
+           parent.getOrders().size() == 2 && branch.getOrders().size() == 3 &&
+           parent.getOrder(1).status == SimBroker::OrderStatus::OPEN &&
+           branch.getOrder(1).status == SimBroker::OrderStatus::CANCELLED &&
+           parent.getPositions().size() == 1 && branch.getPositions().size() == 1 &&
+           parent.getPositions()[0].qty != branch.getPositions()[0].qty;
+  }, "Changes made to a fork don't affect the broker it was forked from");
+
+  test([]() {
+    SimBrokerCowVector<int, 4> a;
+    for (int i = 0; i < 10; i++) a.push_back(i);
+
+    SimBrokerCowVector<int, 4> b = a;
+    b.mut(9) = -1;
+    b.push_back(10);
+
+    // Only the last chunk was copied
+    bool shared = &a[0] == &b[0] && &a[4] == &b[4] && &a[8] != &b[8];
+    bool independent = a[9] == 9 && b[9] == -1 && a.size() == 10 && b.size() == 11;
+
+    b.erase(0);
+    return shared && independent && a[0] == 0 && b[0] == 1 && b.back() == 10 && b.size() == 10;
+  }, "SimBrokerCowVector copies share chunks until they're written to");
+
+  test([&memSource]() {
+    uint64_t start = 1610461800+3600; // Jan 12 2021, 1 hour after open
+    SimBroker parent(&memSource, start, true);
+    parent.enableProfiling();
+    parent.addFunds(1000);
+
+    SimBroker::OrderPlan p = {};
+    p.symbol = "GME";
+    p.qty = -5;
+    parent.placeOrder(p);
+    parent.updateClock(start+(3600*24*2));
+    parent.checkForMarginCall();
+    if (parent.getLastNightlyAccrual().symbols.size() != 1 || parent.hottestDays(1).size() != 1) return false;
+
+    std::vector<SimBroker> forks;
+    forks.reserve(3);
+    AllocCounts used = countAllocs([&]() {
+      for (int i = 0; i < 3; i++) forks.push_back(parent.fork());
+    });
+
+    forks[0].updateClock(forks[0].getClock()+(3600*24));
+    return used.allocations == 0 &&
+           parent.getLastNightlyAccrual().time != forks[0].getLastNightlyAccrual().time &&
+           parent.getLastNightlyAccrual().time == forks[1].getLastNightlyAccrual().time;
+  }, "Forking a broker with history, accruals and a profile doesn't allocate");
+
+  test([]() {
+    SimBrokerCow<std::vector<int>> a;
+    if (a->size() != 0) return false;
+    a.mut().push_back(1);
+
+    SimBrokerCow<std::vector<int>> b = a;
+    bool shared = &*a == &*b;
+    b.mut().push_back(2);
+    return shared && &*a != &*b && a->size() == 1 && b->size() == 2;
+  }, "SimBrokerCow copies share their value until one of them writes to it");
+
+  printf(BYEL "\nCheckpoints: \n" RESET);
+
+  uint64_t checkpointStart = 1610461800+3600; // Jan 12 2021, 1 hour after open
+  auto checkpointPrefix = [checkpointStart](SimBroker& simBroker) {
+    simBroker.addFunds(1000);
+
+    SimBroker::OrderPlan p = {};
+    p.symbol = "GME";
+    p.qty = -5;
+    simBroker.placeOrder(p);
+    simBroker.updateClock(checkpointStart+600);
+
+    // A day trade
+    p.qty = 2;
+    simBroker.placeOrder(p);
+    simBroker.updateClock(checkpointStart+1200);
+
+    p.qty = 1;
+    p.type = SimBroker::OrderType::LIMIT;
+    p.limitPrice = 35;
+    p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+    simBroker.placeOrder(p);
+    simBroker.updateClock(checkpointStart+(3600*24*3));
+  };
+
+  auto checkpointSuffix = [checkpointStart](SimBroker& simBroker) {
+    SimBroker::OrderPlan p = {};
+    p.symbol = "GME";
+    p.qty = -1;
+    simBroker.placeOrder(p);
+    simBroker.updateClock(checkpointStart+(3600*24*10));
+  };
+
+  auto sameBrokers = [](SimBroker& a, SimBroker& b) {
+    if (a.getBalance() != b.getBalance() || a.getClock() != b.getClock()) return false;
+    if (a.remainingDayTrades() != b.remainingDayTrades() || a.PDT() != b.PDT()) return false;
+    if (a.getLastNightlyAccrual().fees != b.getLastNightlyAccrual().fees) return false;
+
+    auto ao = a.getOrders(), bo = b.getOrders();
+    if (ao.size() != bo.size()) return false;
+    for (size_t i = 0; i < ao.size(); i++) {
+      if (ao[i].filledQty != bo[i].filledQty || ao[i].filledAvgPrice != bo[i].filledAvgPrice ||
+          ao[i].status != bo[i].status || ao[i].orderStatusHistory.size() != bo[i].orderStatusHistory.size()) return false;
+    }
+
+    auto ap = a.getPositions(), bp = b.getPositions();
+    if (ap.size() != bp.size()) return false;
+    for (size_t i = 0; i < ap.size(); i++) {
+      if (ap[i].qty != bp[i].qty || ap[i].avgEntryPrice != bp[i].avgEntryPrice) return false;
+    }
+
+    return a.checkpoint() == b.checkpoint();
+  };
+
+  test([&]() {
+    SimBroker original(&memSource, checkpointStart, true);
+    checkpointPrefix(original);
+    std::string checkpoint = original.checkpoint();
+
+    SimBroker restored(&memSource, 0, false);
+    restored.restore(checkpoint);
+    if (restored.checkpoint() != checkpoint || restored.remainingDayTrades() != 2) return false;
+
+    checkpointSuffix(original);
+    checkpointSuffix(restored);
+    return sameBrokers(original, restored);
+  }, "A restored checkpoint continues exactly like the broker it was taken from");
+
+  test([&]() {
+    std::string path = "build/test.checkpoint";
+    remove(path.c_str());
+
+    SimBroker original(&memSource, checkpointStart, true);
+    original.setAutoCheckpoint(path, 2);
+    checkpointPrefix(original);
+    original.setAutoCheckpoint(path, 0);
+    checkpointSuffix(original);
+
+    // Taken at a market close in the middle of the prefix's last updateClock
+    SimBroker restored(&memSource, 0, false);
+    restored.loadCheckpoint(path);
+    if (restored.getClock() <= checkpointStart+(3600*24*2) || restored.getClock() >= checkpointStart+(3600*24*3)) return false;
+
+    restored.updateClock(checkpointStart+(3600*24*3));
+    checkpointSuffix(restored);
+    return sameBrokers(original, restored);
+  }, "Automatic checkpoints can be resumed to the same end state");
+
+  test([&]() {
+    std::string path = "build/test.fork.checkpoint";
+    remove(path.c_str());
+
+    SimBroker parent(&memSource, checkpointStart, true);
+    parent.setAutoCheckpoint(path, 2);
+    checkpointPrefix(parent);
+
+    SimBroker saved(&memSource, 0, false);
+    saved.loadCheckpoint(path);
+    std::string before = saved.checkpoint();
+
+    SimBroker branch = parent.fork();
+    branch.updateClock(branch.getClock()+(3600*24*5));
+    saved.loadCheckpoint(path);
+    bool untouched = saved.checkpoint() == before;
+
+    // The parent still checkpoints
+    parent.updateClock(parent.getClock()+(3600*24*5));
+    saved.loadCheckpoint(path);
+    return untouched && saved.checkpoint() != before;
+  }, "Forks don't inherit automatic checkpoints, so they leave the parent's file alone");
+
+  test([&]() {
+    SimBroker original(&memSource, checkpointStart, true);
+    checkpointPrefix(original);
+    std::string checkpoint = original.checkpoint();
+
+    uint32_t rejected = 0;
+    for (std::string bad : {std::string("nope"), checkpoint.substr(0, checkpoint.size()/2), checkpoint+"x"}) {
+      SimBroker simBroker(&memSource, checkpointStart, true);
+      try { simBroker.restore(bad); } catch (const std::runtime_error& e) { rejected++; }
+      if (simBroker.getOrders().size() != 0) return false;
+    }
+    return rejected == 3;
+  }, "Invalid checkpoints are rejected without touching the broker");
+
+  test([&]() {
+    std::string path = "build/test.sweep.checkpoint";
+    SimBroker prefixBroker(&memSource, checkpointStart, true);
+    checkpointPrefix(prefixBroker);
+    prefixBroker.saveCheckpoint(path);
+
+    SimBrokerSweep::BrokerConfig config;
+    config.checkpoint = path;
+    SimBrokerSweep sweep(&memSource, config, 2);
+
+    auto results = sweep.run(SimBrokerSweep::grid({{"qty", {1, 2}}}), [](SimBroker& broker, const SimBrokerSweep::Params& params) {
+      SimBroker::OrderPlan p = {};
+      p.symbol = "GME";
+      p.qty = -params.at("qty");
+      broker.placeOrder(p);
+      broker.updateClock(broker.getClock()+(3600*24));
+    });
+
+    SimBroker expected(&memSource, checkpointStart, true);
+    checkpointPrefix(expected);
+    SimBroker::OrderPlan p = {};
+    p.symbol = "GME";
+    p.qty = -2;
+    expected.placeOrder(p);
+    expected.updateClock(expected.getClock()+(3600*24));
+
+    return !results[1].failed && results[1].balance == expected.getBalance() &&
+           results[0].orderCount == expected.getOrders().size();
+  }, "Sweeps can start every run from a common checkpoint");
+
+  printf(BYEL "\nMulti-process sweeps: \n" RESET);
+
+  auto processStrategy = [](SimBroker& broker, const SimBrokerSweep::Params& params) {
+    SimBroker::OrderPlan p = {};
+    p.symbol = "GME";
+    p.qty = -params.at("qty");
+    broker.placeOrder(p);
+    p.qty = params.at("qty");
+    p.type = SimBroker::OrderType::LIMIT;
+    p.limitPrice = params.at("limit");
+    p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+    broker.placeOrder(p);
+    broker.updateClock(broker.getClock()+(3600*24*5));
+  };
+
+  test([&memSource, &processStrategy]() {
+    SimBrokerSweep::BrokerConfig config;
+    config.startTime = 1610461800+3600; // Jan 12 2021, 1 hour after open
+    config.margin = true;
+    config.funds = 1000;
+
+    SimBrokerSweep sweep(&memSource, config, 2);
+    auto params = SimBrokerSweep::grid({{"qty", {1, 3, 5}}, {"limit", {20, 30}}});
+    auto threaded = sweep.run(params, processStrategy);
+    auto forked = sweep.runProcesses(params, processStrategy, nullptr, 3);
+    auto again = sweep.run(params, processStrategy); // runProcesses shut the thread pool down
+
+    for (size_t i = 0; i < params.size(); i++) {
+      if (again[i].failed || again[i].balance != threaded[i].balance) return false;
+      if (forked[i].failed || forked[i].cancelled || forked[i].params != params[i]) return false;
+      if (forked[i].balance != threaded[i].balance || forked[i].equity != threaded[i].equity) return false;
+      if (forked[i].clock != threaded[i].clock || forked[i].orderCount != threaded[i].orderCount) return false;
+      if (forked[i].positions.size() != threaded[i].positions.size()) return false;
+    }
+    return true;
+  }, "Sweeps run in worker processes give the same results as threaded sweeps");
+
+  test([&memSource, &processStrategy]() {
+    SimBrokerSweep::BrokerConfig config;
+    config.startTime = 1610461800+3600;
+    config.margin = true;
+    config.funds = 1000;
+
+    SimBrokerSweep sweep(&memSource, config);
+    auto results = sweep.runProcesses(SimBrokerSweep::grid({{"qty", {1, 2, 3, 4}}, {"limit", {20}}}),
+                                      [&processStrategy](SimBroker& broker, const SimBrokerSweep::Params& params) {
+      if (params.at("qty") == 2) raise(SIGKILL);
+      processStrategy(broker, params);
+    }, nullptr, 2);
+
+    uint32_t ok = 0;
+    for (auto& r : results) if (!r.failed && !r.cancelled) ok++;
+    return ok == 3 && results[1].failed && results[1].error.find("exited") != std::string::npos;
+  }, "A worker process dying only fails the run it was working on");
+
+  printf(BYEL "\nPortfolios: \n" RESET);
+
+  auto portfolioMatches = [](SimBrokerPortfolio& portfolio, std::vector<SimBroker>& brokers) {
+    auto equities = portfolio.getEquities();
+    auto buyingPowers = portfolio.getBuyingPowers();
+    for (size_t i = 0; i < brokers.size(); i++) {
+      auto& b = brokers[i];
+      if (portfolio.getBalance(i) != b.getBalance()) return false;
+      if (equities[i] != b.getEquity() || buyingPowers[i] != b.getBuyingPower()) return false;
+
+      auto positions = portfolio.getPositions(i);
+      if (positions.size() != b.getPositions().size()) return false;
+      for (size_t j = 0; j < positions.size(); j++) {
+        auto bp = b.getPositions()[j];
+        if (positions[j].qty != bp.qty || positions[j].avgEntryPrice != bp.avgEntryPrice ||
+            positions[j].costBasis != bp.costBasis || positions[j].symbol != bp.symbol) return false;
+      }
+
+      for (uint64_t id = 0; id < portfolio.getOrderCount(); id++) {
+        auto o = portfolio.getOrder(id, i);
+        auto bo = b.getOrder(id);
+        if (o.status != bo.status || o.filledQty != bo.filledQty || o.qty != bo.qty) return false;
+        if (o.filledQty != 0 && (o.filledAvgPrice != bo.filledAvgPrice || o.filledAt != bo.filledAt)) return false;
+        if (o.orderStatusHistory.size() != bo.orderStatusHistory.size()) return false;
+        for (size_t h = 0; h < o.orderStatusHistory.size(); h++) {
+          if (o.orderStatusHistory[h].status != bo.orderStatusHistory[h].status ||
+              o.orderStatusHistory[h].time != bo.orderStatusHistory[h].time) return false;
+        }
+      }
+    }
+
+    return true;
+  };
+
+  test([&memSource, &portfolioMatches]() {
+    uint64_t start = 1644854400; // Feb 14 11am EST
+    std::vector<currency> funds = {100, 500, 1000, 2500, 5000, 10000};
+
+    SimBrokerPortfolio portfolio(&memSource, start, funds.size());
+    portfolio.addFunds(funds);
+
+    std::vector<SimBroker> brokers;
+    for (auto f : funds) {
+      brokers.emplace_back(&memSource, start, false);
+      brokers.back().addFunds(f);
+    }
+
+    auto place = [&](SimBroker::OrderPlan p, std::function<int64_t(size_t)> qty) {
+      std::vector<int64_t> qtys;
+      for (size_t i = 0; i < funds.size(); i++) {
+        qtys.push_back(qty(i));
+        p.qty = qtys.back();
+        brokers[i].placeOrder(p);
+      }
+      return portfolio.placeOrder(p, qtys);
+    };
+
+    auto advance = [&](uint64_t time) {
+      portfolio.updateClock(time);
+      for (auto& b : brokers) b.updateClock(time);
+    };
+
+    SimBroker::OrderPlan p = {};
+    p.symbol = "SPY";
+    place(p, [&](size_t i) { return (int64_t)(funds[i]/800); });
+    p.type = SimBroker::OrderType::LIMIT;
+    p.limitPrice = 435;
+    p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+    uint64_t limit = place(p, [&](size_t i) { return (int64_t)(i+1); });
+    advance(start+1800);
+
+    portfolio.cancelOrder(limit, 2);
+    brokers[2].cancelOrder(limit);
+    advance(start+(3600*24));
+
+    p = {};
+    p.symbol = "SPY";
+    place(p, [&](size_t i) { return -(int64_t)(funds[i]/1600); });
+    advance(start+(3600*24*3));
+
+    return portfolioMatches(portfolio, brokers);
+  }, "Every SimBrokerPortfolio sub-account matches a SimBroker cash account given the same orders");
+
+  test([&memSource, &portfolioMatches]() {
+    uint64_t start = 1644854400; // Feb 14 11am EST
+    size_t accounts = 4;
+    SimBrokerPortfolio portfolio(&memSource, start, accounts);
+    portfolio.addFunds(std::vector<currency>(accounts, 100000));
+
+    std::vector<SimBroker> brokers;
+    for (size_t i = 0; i < accounts; i++) {
+      brokers.emplace_back(&memSource, start, false);
+      brokers.back().addFunds(100000);
+    }
+
+    auto place = [&](SimBroker::OrderPlan p, std::vector<int64_t> qtys) {
+      for (size_t i = 0; i < accounts; i++) {
+        p.qty = qtys[i];
+        brokers[i].placeOrder(p);
+      }
+      return portfolio.placeOrder(p, qtys);
+    };
+
+    auto advance = [&](uint64_t time) {
+      portfolio.updateClock(time);
+      for (auto& b : brokers) b.updateClock(time);
+    };
+
+    // Something to sell first
+    SimBroker::OrderPlan p = {};
+    p.symbol = "SPY";
+    place(p, {10, 10, 10, 10});
+    advance(start+60);
+
+    // Buyers and sellers at the same limit, just below the price: the sellers fill right away, the
+    // buyers don't
+    p.type = SimBroker::OrderType::LIMIT;
+    p.limitPrice = memSource.getPrice("SPY", start+60)-1;
+    p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+    uint64_t id = place(p, {3, -5, 8, -2});
+    advance(start+(3600*24*3));
+
+    bool sold = portfolio.getOrder(id, 1).filledQty == -5 && portfolio.getOrder(id, 3).filledQty == -2;
+    return sold && portfolioMatches(portfolio, brokers);
+  }, "SimBrokerPortfolio fills the buying and selling accounts of one limit order by their own rules");
+
+  test([&memSource]() {
+    SimBrokerPortfolio portfolio(&memSource, 1644854400, 3);
+    portfolio.addFunds({0, 100000, 100000});
+
+    SimBroker::OrderPlan p = {};
+    p.symbol = "SPY";
+    uint64_t id = portfolio.placeOrder(p, {10, 10, -10});
+    portfolio.updateClock(portfolio.getClock()+60);
+
+    // Not enough money, filled, and no shorts without margin
+    return portfolio.getOrder(id, 0).status == SimBroker::OrderStatus::REJECTED &&
+           portfolio.getOrder(id, 1).filledQty == 10 &&
+           portfolio.getOrder(id, 2).status == SimBroker::OrderStatus::REJECTED &&
+           portfolio.getPositions(0).size() == 0 && portfolio.getPositions(2).size() == 0 &&
+           portfolio.getBalance(0) == 0 && portfolio.getBalance(1) < 100000;
+  }, "SimBrokerPortfolio accepts or rejects each sub-account's share of an order on its own");
+
+  printf(BYEL "\nAsync data sources: \n" RESET);
+
+  auto asyncScenario = [](SimBroker& broker) {
+    broker.addFunds(5000);
+    broker.setMarginCallHandler([]() {});
+
+    SimBroker::OrderPlan p = {};
+    for (int i = 1; i <= 4; i++) {
+      p = {};
+      p.symbol = "GME"+std::to_string(i);
+      p.qty = i;
+      broker.placeOrder(p);
+
+      p.qty = -i;
+      p.type = SimBroker::OrderType::LIMIT;
+      p.limitPrice = 30+(i*5);
+      p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+      broker.placeOrder(p);
+    }
+  };
+
+  test([&memSource, &asyncScenario, &sameBrokers]() {
+    uint64_t start = 1610461800+3600; // Jan 12 2021, 1 hour after open
+    SlowSource slow(&memSource, std::chrono::milliseconds(0));
+    SimBrokerThreadedAsyncDataSource async(&slow, 4);
+
+    SimBroker a(&async, start, true);
+    SimBroker b(&slow, start, true);
+    asyncScenario(a);
+    asyncScenario(b);
+    for (uint64_t t = start; t < start+((3600*24)*10); t += 3600*5) {
+      a.updateClock(t);
+      b.updateClock(t);
+    }
+
+    return a.getPositions().size() > 0 && sameBrokers(a, b);
+  }, "A SimBroker on an async data source ends up the same as one on the blocking source");
+
+  test([&memSource, &asyncScenario]() {
+    uint64_t start = 1610461800+3600;
+    // Checks overlap rather than timing it, so a loaded or single core machine can't fail it
+    SlowSource instant(&memSource, std::chrono::milliseconds(0));
+    SimBroker blocking(&instant, start, true);
+    asyncScenario(blocking);
+    blocking.updateClock(start+(60*5));
+    if (instant.peakInFlight != 1) return false;
+
+    SlowSource slow(&memSource, std::chrono::milliseconds(5));
+    SimBrokerThreadedAsyncDataSource async(&slow, 16);
+    SimBroker broker(&async, start, true);
+    asyncScenario(broker);
+    broker.updateClock(start+(60*5));
+    return slow.peakInFlight > 1;
+  }, "An async data source's requests for an update are in flight at the same time");
+
+  printf(BYEL "\nParallel fills: \n" RESET);
+
+  test([&memSource, &asyncScenario, &sameBrokers]() {
+    uint64_t start = 1610461800+3600; // Jan 12 2021, 1 hour after open
+    SlowSource slow(&memSource, std::chrono::milliseconds(0));
+    SimBrokerScheduler scheduler(4);
+
+    SimBroker a(&slow, start, true);
+    SimBroker b(&slow, start, true);
+    a.setFillScheduler(&scheduler);
+    asyncScenario(a);
+    asyncScenario(b);
+    for (uint64_t t = start; t < start+((3600*24)*10); t += 3600*5) {
+      a.updateClock(t);
+      b.updateClock(t);
+    }
+
+    return a.getPositions().size() > 0 && sameBrokers(a, b);
+  }, "Parallel fills leave the broker in the same state as serial ones");
+
+  test([&memSource, &asyncScenario]() {
+    uint64_t start = 1610461800+3600;
+    SimBrokerScheduler scheduler(4);
+
+    // Checks overlap rather than timing it, so a loaded or single core machine can't fail it
+    SlowSource instant(&memSource, std::chrono::milliseconds(0));
+    SimBroker serial(&instant, start, false);
+    asyncScenario(serial);
+    serial.updateClock(start+(60*5));
+    if (instant.peakInFlight != 1) return false;
+
+    SlowSource slow(&memSource, std::chrono::milliseconds(5));
+    SimBroker broker(&slow, start, false);
+    broker.setFillScheduler(&scheduler);
+    asyncScenario(broker);
+    broker.updateClock(start+(60*5));
+    return slow.peakInFlight > 1;
+  }, "Fills for different symbols are simulated at the same time");
+
+  printf(BYEL "\nReset: \n" RESET);
+
+  auto resetScenario = [](SimBroker& broker) {
+    broker.addFunds(10000);
+    broker.setMarginCallHandler([]() {});
+
+    SimBroker::OrderPlan p = {};
+    p.symbol = "GME";
+    p.qty = -10;
+    broker.placeOrder(p);
+    p.qty = 5;
+    p.type = SimBroker::OrderType::LIMIT;
+    p.limitPrice = 30;
+    p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+    broker.placeOrder(p);
+
+    uint64_t start = broker.getClock();
+    for (uint64_t t = start; t < start+((3600*24)*8); t += 3600*5) broker.updateClock(t);
+  };
+
+  test([&memSource, &resetScenario]() {
+    uint64_t start = 1610461800+3600; // Jan 12 2021, 1 hour after open
+    SimBroker used(&memSource, start, false);
+    used.enableInstaFill();
+    used.setInterestRate(0.08);
+    resetScenario(used);
+
+    used.reset(start, true);
+    resetScenario(used);
+
+    SimBroker fresh(&memSource, start, true);
+    resetScenario(fresh);
+    return used.getOrders().size() > 0 && used.checkpoint() == fresh.checkpoint();
+  }, "A reset broker behaves exactly like a new one");
+
+  test([&memSource, &resetScenario]() {
+    uint64_t start = 1610461800+3600;
+    SimBroker broker(&memSource, start, true);
+    resetScenario(broker);
+
+    SimBroker branch = broker.fork();
+    std::string before = branch.checkpoint();
+    broker.reset(start, false);
+    broker.addFunds(5);
+    return branch.checkpoint() == before && broker.getOrders().size() == 0 && broker.getPositions().size() == 0;
+  }, "Resetting a broker doesn't affect its forks");
+
+  printf(BYEL "\nInstrumented data sources: \n" RESET);
+
+  test([&memSource, &resetScenario]() {
+    uint64_t start = 1610461800+3600; // Jan 12 2021, 1 hour after open
+    SimBrokerInstrumentedDataSource instrumented(&memSource);
+
+    SimBroker a(&instrumented, start, true);
+    SimBroker b(&memSource, start, true);
+    resetScenario(a);
+    resetScenario(b);
+    if (a.checkpoint() != b.checkpoint()) return false;
+
+    typedef SimBrokerInstrumentedDataSource I;
+    if (instrumented.getCalls(I::GET_MINUTE_BARS) == 0 || instrumented.getCalls(I::GET_MARKET_PHASE) == 0) return false;
+
+    uint64_t tickerCalls = 0;
+    for (int m = 0; m < I::METHOD_COUNT; m++) {
+      auto& h = instrumented.getLatency((I::Method)m);
+      if (h.count() != instrumented.getCalls((I::Method)m)) return false;
+      if (h.percentile(50) > h.percentile(99) || h.percentile(99) > h.max()) return false;
+      bool takesTicker = m == I::GET_MINUTE_BARS || m == I::GET_PRICE || m == I::GET_ASSET_BORROW_RATE ||
+                         m == I::IS_TICKER_MARGINABLE || m == I::IS_TICKER_ETB || m == I::IS_TICKER_SHORTABLE ||
+                         m >= I::GET_PRICE_SERIES; // Batches only ever hold our one short here
+      if (takesTicker) tickerCalls += instrumented.getCalls((I::Method)m);
+    }
+
+    auto perTicker = instrumented.getTickerCalls();
+    if (perTicker.size() != 1 || perTicker["GME"] != tickerCalls) return false;
+    if (instrumented.report().find("getMinuteBars") == std::string::npos) return false;
+
+    instrumented.reset();
+    return instrumented.getCalls(I::GET_MINUTE_BARS) == 0 && instrumented.getTickerCalls().size() == 0;
+  }, "The instrumented data source counts every call per method and ticker without changing results");
+
+  test([&memSource]() {
+    SlowSource aliases(&memSource, std::chrono::milliseconds(0));
+    SimBrokerInstrumentedDataSource instrumented(&aliases);
+    SimBroker simBroker(&instrumented, 1610461800+3600, true); // Jan 12 2021, 1 hour after open
+    simBroker.addFunds(1000);
+    simBroker.disableShortRoundLotFee();
+
+    for (std::string symbol : {"GME1", "GME2", "GME3", "GME4"}) {
+      SimBroker::OrderPlan p = {};
+      p.symbol = symbol;
+      p.qty = -1;
+      simBroker.placeOrder(p);
+    }
+    simBroker.updateClock(simBroker.getClock()+60);
+    if (simBroker.getPositions().size() != 4 || simBroker.checkForMarginCall()) return false; // Full check
+
+    typedef SimBrokerInstrumentedDataSource I;
+    simBroker.updateClock(simBroker.getClock()+60);
+    instrumented.reset();
+    bool called = simBroker.checkForMarginCall();
+    bool batched = instrumented.getCalls(I::GET_PRICE) == 0 && instrumented.getCalls(I::GET_PRICES) == 1;
+
+    instrumented.reset();
+    called = called || simBroker.checkForMarginCall();
+    bool again = instrumented.getCalls(I::GET_PRICE) == 0 && instrumented.getCalls(I::GET_PRICES) == 0;
+
+    return !called && batched && again;
+  }, "Screened margin checks look every position's price up in one batch, and nothing up twice at one time");
+
+  test([]() {
+    SimBrokerInstrumentedDataSource::Histogram h;
+    for (uint64_t ns = 1; ns <= 100000; ns++) h.record(ns);
+
+    auto near = [](uint64_t v, double expected) { return v >= expected && v <= expected*1.125; };
+    return h.count() == 100000 && h.max() == 100000 && h.total() == 5000050000 &&
+           near(h.percentile(50), 50000) && near(h.percentile(99), 99000) && h.percentile(100) == 100000;
+  }, "Latency histogram percentiles are accurate to within 12.5%");
+
+  printf(BYEL "\nStats: \n" RESET);
+
+  test([&memSource, &resetScenario]() {
+    uint64_t start = 1610461800+3600; // Jan 12 2021, 1 hour after open
+    SimBroker off(&memSource, start, true);
+    SimBroker on(&memSource, start, true);
+    on.enableStats();
+    resetScenario(off);
+    resetScenario(on);
+
+    auto s = on.getStats();
+    auto none = off.getStats();
+    if (none.updates != 0 || none.barsVisited != 0 || none.fillNs != 0) return false;
+    if (on.checkpoint() != off.checkpoint()) return false;
+
+    return s.updates > 0 && s.ordersScanned >= s.ordersUpdated && s.ordersUpdated > 0 && s.barsVisited > 0 &&
+           s.marginChecks > 0 && s.marginChecks >= s.marginScreenHits &&
+           s.tradingDayLookups >= s.tradingDayCacheHits && s.fillNs > 0 && s.pdtCheckNs > 0;
+  }, "Stats are only collected when enabled, and don't change results");
+
+  test([&memSource, &asyncScenario]() {
+    uint64_t start = 1610461800+3600;
+    SlowSource source(&memSource, std::chrono::milliseconds(0));
+    SimBrokerScheduler scheduler(4);
+
+    SimBroker serial(&source, start, true);
+    SimBroker parallel(&source, start, true);
+    parallel.setFillScheduler(&scheduler);
+    for (auto b : {&serial, &parallel}) {
+      b->enableStats();
+      asyncScenario(*b);
+      for (uint64_t t = start; t < start+(3600*24*3); t += 3600) b->updateClock(t);
+    }
+
+    auto a = serial.getStats(), b = parallel.getStats();
+    return a.barsVisited > 0 && a.barsVisited == b.barsVisited && a.gapFillPrices == b.gapFillPrices &&
+           a.ordersUpdated == b.ordersUpdated && a.updates == b.updates;
+  }, "Stats count the same work whether fills are simulated serially or in parallel");
+
+  printf(BYEL "\nAllocations: \n" RESET);
+
+  test([&memSource]() {
+    uint64_t start = 1610461800+3600; // Jan 12 2021, 1 hour after open
+    SimBroker broker(&memSource, start, true);
+    broker.addFunds(100000);
+    broker.enableInstaFill();
+
+    SimBroker::OrderPlan p = {};
+    p.symbol = "GME";
+    p.qty = 5;
+    broker.placeOrder(p);
+    p.symbol = "SPY";
+    p.qty = -5;
+    broker.placeOrder(p);
+    broker.updateClock(start+60);
+
+    AllocCounts used = countAllocs([&broker]() {
+      broker.getEquity();
+      broker.remainingDayTrades();
+    });
+    return used.allocations == 0 && used.bytes == 0;
+  }, "getEquity and remainingDayTrades don't allocate");
+
+  test([&memSource]() {
+    uint64_t start = 1610461800+3600;
+    SimBroker broker(&memSource, start, true);
+    broker.addFunds(100000);
+
+    SimBroker::OrderPlan p = {};
+    p.symbol = "GME";
+    p.qty = 5;
+    p.type = SimBroker::OrderType::LIMIT;
+    p.limitPrice = 1;
+    p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+    broker.placeOrder(p);
+
+    // The bars get bigger, but scanning more of them shouldn't mean more allocations
+    std::vector<uint64_t> allocations;
+    for (uint64_t hours : {1, 2, 5}) {
+      broker.updateClock(start+(hours*3600));
+      allocations.push_back(countAllocs([&broker]() { broker.updateClock(broker.getClock()+60); }).allocations);
+    }
+    return allocations[0] > 0 && allocations[0] == allocations[1] && allocations[1] == allocations[2];
+  }, "Allocations updating a live order don't grow with the bars it scans");
+
+  printf(BYEL "\nTracing: \n" RESET);
+
+  test([&memSource, &asyncScenario]() {
+    uint64_t start = 1610461800+3600; // Jan 12 2021, 1 hour after open
+    uint64_t end = start+(3600*24*3);
+    SlowSource slow(&memSource, std::chrono::milliseconds(0));
+    SimBrokerInstrumentedDataSource source(&slow);
+    SimBrokerTracer tracer;
+    source.setTracer(&tracer);
+
+    SimBroker traced(&source, start, true);
+    SimBroker plain(&slow, start, true);
+    traced.setTracer(&tracer);
+    for (auto b : {&traced, &plain}) {
+      asyncScenario(*b);
+      for (uint64_t t = start; t < end; t += 3600) b->updateClock(t);
+    }
+    if (traced.checkpoint() != plain.checkpoint()) return false;
+
+    auto events = tracer.events();
+    std::map<std::string, uint64_t> counts;
+    bool fillTagged = false, barsTagged = false, lastClock = false;
+    for (auto& e : events) {
+      counts[e.name]++;
+      if (std::string(e.name) == "fill") fillTagged = fillTagged || (std::string(e.symbol) == "GME2" && e.orderId >= 0 && e.simTime >= start);
+      if (std::string(e.name) == "getMinuteBars") barsTagged = barsTagged || std::string(e.symbol).rfind("GME", 0) == 0;
+      if (std::string(e.name) == "updateClock") lastClock = lastClock || e.simTime == end-3600;
+    }
+
+    std::string trace = tracer.chromeTrace();
+    size_t spans = 0;
+    for (size_t pos = 0; (pos = trace.find("\"ph\":\"X\"", pos)) != std::string::npos; pos++) spans++;
+
+    return fillTagged && barsTagged && lastClock && tracer.dropped() == 0 &&
+           counts["updateClock"] > 0 && counts["updateState"] > 0 && counts["chargeDayInterest"] > 0 &&
+           counts["marginCheck"] > 0 && counts["pdtCheck"] > 0 &&
+           trace.rfind("{\"displayTimeUnit\"", 0) == 0 && spans == events.size();
+  }, "Tracing records spans of updates, fills, interest and data source calls without changing results");
+
+  test([&memSource, &asyncScenario]() {
+    uint64_t start = 1610461800+3600;
+    uint64_t end = start+(3600*24*3);
+    SlowSource slow(&memSource, std::chrono::milliseconds(0));
+    SimBrokerScheduler scheduler(4);
+    SimBrokerTracer tracer(16);
+
+    SimBroker broker(&slow, start, true);
+    broker.setFillScheduler(&scheduler);
+    broker.setTracer(&tracer);
+    asyncScenario(broker);
+    for (uint64_t t = start; t < end; t += 3600) broker.updateClock(t);
+
+    // Full rings keep their newest spans: the last update is always in there
+    auto events = tracer.events();
+    uint32_t threads = 0;
+    bool lastClock = false;
+    for (auto& e : events) {
+      threads = std::max(threads, e.thread+1);
+      if (std::string(e.name) == "updateClock") lastClock = lastClock || e.simTime == end-3600;
+    }
+    if (!lastClock || events.size() > 16*threads || tracer.dropped() == 0) return false;
+
+    tracer.clear();
+    return tracer.events().empty() && tracer.dropped() == 0;
+  }, "Tracer rings keep the most recent spans when full, per thread");
+
+  printf(BYEL "\nProfiling: \n" RESET);
+
+  // A few market orders that fill straight away, and a limit order that never will
+  auto profileScenario = [](SimBroker& broker) {
+    broker.addFunds(10000);
+    SimBroker::OrderPlan p = {};
+    for (int i = 1; i <= 3; i++) {
+      p.symbol = "GME"+std::to_string(i);
+      p.qty = i;
+      broker.placeOrder(p);
+    }
+
+    p.symbol = "GME4";
+    p.qty = 1;
+    p.type = SimBroker::OrderType::LIMIT;
+    p.limitPrice = 1;
+    p.timeInForce = SimBroker::OrderTimeInForce::GOOD_TILL_CANCELLED;
+    return broker.placeOrder(p);
+  };
+
+  test([&memSource, &profileScenario]() {
+    uint64_t start = 1610461800+3600; // Jan 12 2021, 1 hour after open
+    SlowSource source(&memSource, std::chrono::milliseconds(0));
+    SimBroker profiled(&source, start, true);
+    SimBroker plain(&source, start, true);
+    profiled.enableProfiling();
+
+    uint64_t stuck = profileScenario(profiled);
+    profileScenario(plain);
+    uint64_t updates = 0;
+    for (uint64_t t = start+600; t < start+(3600*24*4); t += 600, updates++) {
+      profiled.updateClock(t);
+      plain.updateClock(t);
+    }
+    if (profiled.checkpoint() != plain.checkpoint()) return false;
+
+    auto orders = profiled.hottestOrders(10, SimBroker::BY_DATA_SOURCE_CALLS);
+    auto symbols = profiled.hottestSymbols(1, SimBroker::BY_DATA_SOURCE_CALLS);
+    if (orders.size() != 4 || orders[0].orderId != stuck || orders[0].symbol != "GME4") return false;
+    if (orders[0].cost.samples < updates || orders[1].cost.samples >= orders[0].cost.samples) return false;
+    if (symbols.size() != 1 || symbols[0].symbol != "GME4") return false;
+
+    // Jan 12-15 2021: 4 trading days, plus the overnight updates before each one's premarket
+    auto days = profiled.hottestDays(100);
+    uint64_t samples = 0, calls = 0;
+    for (auto& d : days) {
+      if (d.dayStart == 0) return false;
+      samples += d.cost.samples;
+      calls += d.cost.dataSourceCalls;
+    }
+    return days.size() == 4 && samples >= updates && calls > orders[0].cost.dataSourceCalls &&
+           profiled.hottestDays(1)[0].cost.ns >= profiled.hottestDays(2)[1].cost.ns;
+  }, "Profiling attributes update costs to days, symbols and orders, with stuck orders on top");
+
+  test([&memSource, &profileScenario]() {
+    uint64_t start = 1610461800+3600;
+    SlowSource source(&memSource, std::chrono::milliseconds(0));
+    SimBrokerScheduler scheduler(4);
+
+    SimBroker off(&source, start, true);
+    SimBroker serial(&source, start, true);
+    SimBroker parallel(&source, start, true);
+    serial.enableProfiling();
+    parallel.enableProfiling();
+    parallel.setFillScheduler(&scheduler);
+    for (auto b : {&off, &serial, &parallel}) {
+      profileScenario(*b);
+      for (uint64_t t = start+600; t < start+(3600*24*2); t += 600) b->updateClock(t);
+    }
+    if (!off.hottestDays(10).empty() || !off.hottestOrders(10).empty()) return false;
+
+    auto a = serial.hottestOrders(10, SimBroker::BY_DATA_SOURCE_CALLS);
+    auto b = parallel.hottestOrders(10, SimBroker::BY_DATA_SOURCE_CALLS);
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+      if (a[i].orderId != b[i].orderId || a[i].cost.samples != b[i].cost.samples ||
+          a[i].cost.dataSourceCalls != b[i].cost.dataSourceCalls) return false;
+    }
+
+    // Calls made on the scheduler's threads are charged to the day too
+    auto days = [](SimBroker& broker) {
+      std::map<uint64_t, uint64_t> calls;
+      for (auto& d : broker.hottestDays(100, SimBroker::BY_DATA_SOURCE_CALLS)) calls[d.dayStart] = d.cost.dataSourceCalls;
+      return calls;
+    };
+    if (days(serial).empty() || days(serial) != days(parallel)) return false;
+
+    serial.resetProfile();
+    return serial.hottestDays(10).empty() && serial.hottestSymbols(10).empty() && serial.hottestOrders(10).empty();
+  }, "Order and day profiles match with parallel fills, and are only kept while profiling");
+
 	// TODO: good faith violations for non-margin/cash accounts
 
   // TODO: test long position margin calls in the same precise way we're testing short position margin calls